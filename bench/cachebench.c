@@ -0,0 +1,173 @@
+/*
+ * cachebench.c - concurrent lookup throughput of the proxy's object cache
+ *
+ * usage: cachebench [-t max-threads] [-n keys] [-d secs] [-p policy] [-f]
+ *
+ * For each eviction policy (or only -p policy), fills a cache with n
+ * small objects, then for 1, 2, 4, ... max-threads threads has every
+ * thread look up random keys (and release them) for secs seconds.
+ * Prints lookups per second at each thread count, one column per
+ * policy.  Every lookup hits, so this measures the hit path: lru and
+ * tinylfu take the policy lock on each one, clock and s3fifo only set
+ * a bit.  Links the proxy's own cache.c, so it measures the real index
+ * and locks.
+ *
+ * With -f it measures the fill path instead: every thread inserts
+ * random keys into a cache that holds half of them, so each insert
+ * also evicts, once with the URL index (radix.c) kept and once
+ * without.  Prints inserts per second for both and the index's
+ * overhead, in all and per insert, with the first policy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "../cache.h"
+#include "../policy.h"
+
+#define MAX_POLICIES 8
+
+static int nkeys = 10000, duration = 2;
+static char **keys;
+static volatile int stop;
+static char body[512];
+
+static void *lookup_thread(void *arg)
+{
+  unsigned long x = (unsigned long)arg * 0x9e3779b97f4a7c15UL + 1;
+  long n = 0;
+  cache_obj_t *obj;
+
+  while (!stop) {
+    x ^= x << 13;                       /* xorshift64 */
+    x ^= x >> 7;
+    x ^= x << 17;
+    if ((obj = cache_lookup(keys[x % nkeys])))
+      cache_release(obj);
+    n++;
+  }
+  return (void *)n;
+}
+
+static void *insert_thread(void *arg)
+{
+  unsigned long x = (unsigned long)arg * 0x9e3779b97f4a7c15UL + 1;
+  long n = 0;
+
+  while (!stop) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    cache_insert(keys[x % nkeys], body, sizeof(body));
+    n++;
+  }
+  return (void *)n;
+}
+
+static double run(void *(*fn)(void *), int nthreads)
+{
+  pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+  struct timeval start, end;
+  long total = 0;
+  void *n;
+  int i;
+
+  stop = 0;
+  gettimeofday(&start, NULL);
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&tids[i], NULL, fn, (void *)(long)(i + 1));
+  sleep(duration);
+  stop = 1;
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(tids[i], &n);
+    total += (long)n;
+  }
+  gettimeofday(&end, NULL);
+  free(tids);
+  return total / ((end.tv_sec - start.tv_sec) +
+                  (end.tv_usec - start.tv_usec) / 1e6);
+}
+
+/* Inserts/sec with and without the URL index, per thread count */
+static void fill_bench(const char *policy, int maxthreads)
+{
+  double rate[2][8];
+  int i, t, on;
+
+  for (on = 0; on < 2; on++)
+    for (i = 1, t = 0; i <= maxthreads; i *= 2, t++) {
+      /* A fresh cache per run; the previous one is simply abandoned */
+      cache_init((size_t)nkeys / 2 * sizeof(body), sizeof(body), 0, policy);
+      cache_url_index(on);
+      rate[on][t] = run(insert_thread, i);
+    }
+  printf("%-8s %14s %14s %9s %9s   (inserts/sec, %s)\n", "threads",
+         "no index", "url index", "overhead", "ns/insert", policy);
+  for (i = 1, t = 0; i <= maxthreads; i *= 2, t++)
+    printf("%-8d %14.0f %14.0f %8.1f%% %9.0f\n", i, rate[0][t], rate[1][t],
+           100 * (rate[0][t] - rate[1][t]) / rate[0][t],
+           1e9 / rate[1][t] - 1e9 / rate[0][t]);
+}
+
+int main(int argc, char **argv)
+{
+  int maxthreads = 64, opt, i, j, t, np = 0, fill = 0;
+  const struct policy_ops *ps[MAX_POLICIES];
+  double rate[MAX_POLICIES][8];
+  char *only = NULL;
+
+  while ((opt = getopt(argc, argv, "t:n:d:p:f")) != -1) {
+    switch (opt) {
+    case 't': maxthreads = atoi(optarg); break;
+    case 'n': nkeys = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 'p': only = optarg; break;
+    case 'f': fill = 1; break;
+    default:
+      fprintf(stderr, "usage: %s [-t max-threads] [-n keys] [-d secs] "
+              "[-p policy] [-f]\n", argv[0]);
+      exit(1);
+    }
+  }
+  for (i = 0; policies[i] && np < MAX_POLICIES; i++)
+    if (!only || strcmp(only, policies[i]->name) == 0)
+      ps[np++] = policies[i];
+  if (np == 0 || maxthreads < 1 || maxthreads > 128) {
+    fprintf(stderr, "%s: bad policy or thread count\n", argv[0]);
+    exit(1);
+  }
+
+  memset(body, 'x', sizeof(body));
+  keys = malloc(nkeys * sizeof(char *));
+  for (i = 0; i < nkeys; i++) {
+    keys[i] = malloc(64);
+    snprintf(keys[i], 64, "origin.example:80/static/object-%d.html", i);
+  }
+  if (fill) {
+    fill_bench(ps[0]->name, maxthreads);
+    exit(0);
+  }
+  for (j = 0; j < np; j++) {
+    /* A fresh cache per policy; the previous one is simply abandoned */
+    cache_init((size_t)nkeys * 2 * sizeof(body), sizeof(body), 0,
+               ps[j]->name);
+    for (i = 0; i < nkeys; i++)
+      cache_insert(keys[i], body, sizeof(body));
+    for (i = 1, t = 0; i <= maxthreads; i *= 2, t++)
+      rate[j][t] = run(lookup_thread, i);
+  }
+
+  printf("%-8s", "threads");
+  for (j = 0; j < np; j++)
+    printf(" %14s", ps[j]->name);
+  printf("   (lookups/sec)\n");
+  for (i = 1, t = 0; i <= maxthreads; i *= 2, t++) {
+    printf("%-8d", i);
+    for (j = 0; j < np; j++)
+      printf(" %14.0f", rate[j][t]);
+    printf("\n");
+  }
+  exit(0);
+}
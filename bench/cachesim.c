@@ -0,0 +1,296 @@
+/*
+ * cachesim.c - trace-driven hit ratios of the cache's eviction policies
+ *
+ * usage: cachesim [-c cache-bytes] [-o object-bytes] [-p policy]
+ *                 [-n requests] [-k keys] [-a zipf-alpha] [-s scan-every]
+ *                 [-z gzip-level] [-f text-file] [trace]
+ *
+ * Replays a trace against the proxy's own cache.c once per eviction
+ * policy (or only -p policy): every request is a lookup, and a miss
+ * inserts the object.  Prints the hit ratio and byte hit ratio of each.
+ *
+ * A trace has one request per line, either "key [size]" or an access
+ * log line, from which the URL of "GET url" is taken.  Sizes default to
+ * 4096 bytes.  Without a trace, n requests are drawn from a Zipf
+ * distribution over k keys, and every scan-every requests a scan of k
+ * one-time keys runs through - the pattern that flushes a plain LRU.
+ *
+ * With -z, every object is a text/plain response cut from text-file
+ * (by default the proxy's csapp.c, in the directory above cachesim's),
+ * each miss is cached through a fill as the proxy does it, and each
+ * policy runs twice: with the cache gzipping text at gzip-level, and
+ * without.  Each hit on a gzipped object inflates it, as for a client
+ * that does not take gzip, so the CPU seconds printed for a run are its
+ * whole cost.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/resource.h>
+#include "../cache.h"
+#include "../policy.h"
+#include "../gzip.h"
+#include "../http.h"
+
+struct request {
+  char *key;
+  size_t size;
+};
+
+static struct request *reqs;
+static long nreqs, maxreqs;
+
+static void add_request(const char *key, size_t size)
+{
+  if (nreqs == maxreqs) {
+    maxreqs = maxreqs ? 2 * maxreqs : 4096;
+    reqs = realloc(reqs, maxreqs * sizeof(struct request));
+  }
+  reqs[nreqs].key = strdup(key);
+  reqs[nreqs].size = size;
+  nreqs++;
+}
+
+static void read_trace(const char *path)
+{
+  char line[8192], key[8192], *p;
+  long size;
+  FILE *fp;
+
+  if (!(fp = fopen(path, "r"))) {
+    perror(path);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    size = 4096;
+    if ((p = strstr(line, "GET "))) {
+      if (sscanf(p + 4, "%8191s", key) != 1)
+        continue;
+    } else if (sscanf(line, "%8191s %ld", key, &size) < 1)
+      continue;
+    add_request(key, size > 0 ? size : 1);
+  }
+  fclose(fp);
+}
+
+static unsigned long rng = 0x9e3779b97f4a7c15UL;
+
+static double uniform(void)
+{
+  rng ^= rng << 13;                     /* xorshift64 */
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* n Zipf(alpha) requests over k keys, a k-key scan every scan requests */
+static void synthesize(long n, long k, double alpha, long scan)
+{
+  double *cdf = malloc(k * sizeof(double)), sum = 0, u;
+  long i, j, lo, hi, nscan = 0;
+  char key[64];
+
+  for (i = 0; i < k; i++)
+    cdf[i] = sum += 1 / pow(i + 1, alpha);
+  for (i = 0; i < n; i++) {
+    if (scan > 0 && i > 0 && i % scan == 0)
+      for (j = 0; j < k; j++, nscan++) {
+        snprintf(key, sizeof(key), "origin.example:80/scan/%ld", nscan);
+        add_request(key, 4096);
+      }
+    u = uniform() * sum;
+    for (lo = 0, hi = k - 1; lo < hi;) {
+      j = (lo + hi) / 2;
+      if (cdf[j] < u)
+        lo = j + 1;
+      else
+        hi = j;
+    }
+    snprintf(key, sizeof(key), "origin.example:80/hot/%ld", lo);
+    add_request(key, 4096);
+  }
+  free(cdf);
+}
+
+static char *text;                      /* -z: bodies are cut from this */
+static size_t text_len;
+
+static void read_text(const char *path)
+{
+  FILE *fp;
+  long n;
+
+  if (!(fp = fopen(path, "r")) || fseek(fp, 0, SEEK_END) < 0 ||
+      (n = ftell(fp)) <= 0) {
+    perror(path);
+    exit(1);
+  }
+  rewind(fp);
+  text = malloc(n);
+  text_len = fread(text, 1, n, fp);
+  fclose(fp);
+}
+
+#define TEXT_HEAD "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n" \
+                  "Content-Length: %zu\r\n\r\n"
+
+/* Writes to out the text response for key, with a size-byte body */
+static size_t text_response(const char *key, size_t size, char *out)
+{
+  size_t off = cache_hash(key, strlen(key)) % text_len, pos, k;
+
+  pos = sprintf(out, TEXT_HEAD, size);
+  for (; size > 0; pos += k, size -= k, off = 0) {
+    k = text_len - off < size ? text_len - off : size;
+    memcpy(out + pos, text + off, k);
+  }
+  return pos;
+}
+
+/* User and system CPU time of the process so far, in seconds */
+static double cpu_seconds(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Sends a text hit as the proxy would to a client without gzip */
+static void text_hit(cache_obj_t *obj, char *scratch)
+{
+  size_t hlen;
+
+  if (obj->plain) {
+    hlen = http_head_len(obj->data, obj->size);
+    gzip_inflate(obj->data + hlen, obj->size - hlen, scratch,
+                 obj->plain - hlen);
+  }
+}
+
+/* Caches a text miss the way the proxy does, through a fill */
+static void text_miss(struct request *r, char *scratch)
+{
+  cache_obj_t *hit;
+  cache_fill_t *fill;
+  size_t len;
+
+  if (cache_join(r->key, &hit, &fill) != CACHE_LEAD)
+    return;
+  if (hit)
+    cache_release(hit);
+  len = text_response(r->key, r->size, scratch);
+  cache_fill_finish(fill, cache_fill_append(fill, scratch, len));
+}
+
+static void simulate(const char *policy, size_t capacity, size_t max_object,
+                     const char *body, int level)
+{
+  long i, hits = 0;
+  size_t bytes = 0, hit_bytes = 0, len;
+  double cpu = cpu_seconds();
+  cache_obj_t *obj;
+
+  /* A fresh cache per run; the previous one is simply abandoned */
+  cache_init(capacity, max_object, 0, policy);
+  cache_gzip(level);
+  for (i = 0; i < nreqs; i++) {
+    bytes += reqs[i].size;
+    if ((obj = cache_lookup(reqs[i].key))) {
+      hits++;
+      hit_bytes += reqs[i].size;
+      if (text)
+        text_hit(obj, (char *)body);
+      cache_release(obj);
+      continue;
+    }
+    /* A text object is cached with its head, which counts to the cap */
+    len = reqs[i].size;
+    if (text)
+      len += snprintf(NULL, 0, TEXT_HEAD, reqs[i].size);
+    if (len <= max_object) {
+      if (text)
+        text_miss(&reqs[i], (char *)body);
+      else
+        cache_insert(reqs[i].key, body, reqs[i].size);
+    }
+  }
+  if (!text) {
+    printf("%-10s %10.4f %10.4f\n", policy, (double)hits / nreqs,
+           (double)hit_bytes / bytes);
+    return;
+  }
+  printf("%-10s %5d %10.4f %10.4f %8.2f\n", policy, level,
+         (double)hits / nreqs, (double)hit_bytes / bytes, cpu_seconds() - cpu);
+}
+
+int main(int argc, char **argv)
+{
+  size_t capacity = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE;
+  long n = 1000000, k = 10000, scan = 0;
+  double alpha = 0.9;
+  char *only = NULL, *body, *textfile = NULL, *slash;
+  char deftext[MAXLINE];
+  int opt, i, level = 0;
+
+  while ((opt = getopt(argc, argv, "c:o:p:n:k:a:s:z:f:")) != -1) {
+    switch (opt) {
+    case 'c': capacity = atol(optarg); break;
+    case 'o': max_object = atol(optarg); break;
+    case 'p': only = optarg; break;
+    case 'n': n = atol(optarg); break;
+    case 'k': k = atol(optarg); break;
+    case 'a': alpha = atof(optarg); break;
+    case 's': scan = atol(optarg); break;
+    case 'z': level = atoi(optarg); break;
+    case 'f': textfile = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-c cache-bytes] [-o object-bytes] "
+              "[-p policy] [-n requests] [-k keys] [-a zipf-alpha] "
+              "[-s scan-every] [-z gzip-level] [-f text-file] [trace]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (only && !policy_find(only)) {
+    fprintf(stderr, "%s: unknown policy %s\n", argv[0], only);
+    exit(1);
+  }
+  if (optind < argc)
+    read_trace(argv[optind]);
+  else
+    synthesize(n, k, alpha, scan);
+  if (nreqs == 0) {
+    fprintf(stderr, "%s: empty trace\n", argv[0]);
+    exit(1);
+  }
+  /* Room for a response, or for a gzipped hit's body inflated */
+  body = calloc(1, max_object + MAXLINE);
+  if (level > 0 && !textfile) {
+    /* The proxy's csapp.c, found from where cachesim is, not the cwd */
+    slash = strrchr(argv[0], '/');
+    snprintf(deftext, sizeof(deftext), "%.*s../csapp.c",
+             slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+    textfile = deftext;
+  }
+  if (level > 0)
+    read_text(textfile);
+
+  printf("%ld requests, cache %lu bytes\n", nreqs, capacity);
+  if (!text)
+    printf("%-10s %10s %10s\n", "policy", "hit-ratio", "byte-ratio");
+  else
+    printf("%-10s %5s %10s %10s %8s\n", "policy", "gzip", "hit-ratio",
+           "byte-ratio", "cpu-s");
+  for (i = 0; policies[i]; i++) {
+    if (only && strcmp(only, policies[i]->name) != 0)
+      continue;
+    if (text)
+      simulate(policies[i]->name, capacity, max_object, body, 0);
+    simulate(policies[i]->name, capacity, max_object, body, level);
+  }
+  exit(0);
+}
@@ -0,0 +1,128 @@
+/*
+ * loadgen.c - closed-loop HTTP load generator for the proxy
+ *
+ * usage: loadgen [-a] [-c clients] [-d secs] <proxy-host> <proxy-port> [url]
+ *
+ * Each client thread repeatedly connects to the proxy, sends
+ * "GET url HTTP/1.0" and reads the response to EOF.  With -a it only
+ * connects and closes, which measures the accept path.  Prints the
+ * completed operations per second.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static char *host, *port, *url = "http://localhost:8000/home.html";
+static int accept_only, duration = 5;
+static volatile int stop;
+static long *counts, *errors;
+
+static int connect_to(void)
+{
+  struct addrinfo hints, *listp, *p;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  if (getaddrinfo(host, port, &hints, &listp) != 0)
+    return -1;
+  for (p = listp; p; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(listp);
+  return fd;
+}
+
+static void *client(void *vargp)
+{
+  long id = (long)vargp;
+  char req[1024], buf[65536];
+  int fd, len;
+  ssize_t n;
+
+  len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", url);
+  while (!stop) {
+    if ((fd = connect_to()) < 0) {
+      errors[id]++;
+      continue;
+    }
+    if (!accept_only) {
+      if (write(fd, req, len) != len) {
+        errors[id]++;
+        close(fd);
+        continue;
+      }
+      while ((n = read(fd, buf, sizeof(buf))) > 0)
+        ;
+      if (n < 0) {
+        errors[id]++;
+        close(fd);
+        continue;
+      }
+    }
+    close(fd);
+    counts[id]++;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  int opt, nclients = 16;
+  long i, total = 0, errs = 0;
+  pthread_t *tids;
+  struct timeval start, end;
+  double secs;
+
+  while ((opt = getopt(argc, argv, "ac:d:")) != -1) {
+    switch (opt) {
+    case 'a': accept_only = 1; break;
+    case 'c': nclients = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-a] [-c clients] [-d secs] "
+              "<proxy-host> <proxy-port> [url]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (argc - optind < 2) {
+    fprintf(stderr, "usage: %s [-a] [-c clients] [-d secs] "
+            "<proxy-host> <proxy-port> [url]\n", argv[0]);
+    exit(1);
+  }
+  host = argv[optind];
+  port = argv[optind + 1];
+  if (argc - optind > 2)
+    url = argv[optind + 2];
+
+  tids = calloc(nclients, sizeof(pthread_t));
+  counts = calloc(nclients, sizeof(long));
+  errors = calloc(nclients, sizeof(long));
+  gettimeofday(&start, NULL);
+  for (i = 0; i < nclients; i++)
+    pthread_create(&tids[i], NULL, client, (void *)i);
+  sleep(duration);
+  stop = 1;
+  for (i = 0; i < nclients; i++) {
+    pthread_join(tids[i], NULL);
+    total += counts[i];
+    errs += errors[i];
+  }
+  gettimeofday(&end, NULL);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  printf("%s/sec: %.0f (%ld ok, %ld errors, %.1f s)\n",
+         accept_only ? "accepts" : "requests", total / secs, total, errs, secs);
+  return 0;
+}
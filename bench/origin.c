@@ -0,0 +1,96 @@
+/*
+ * origin.c - minimal prethreaded origin server for proxy benchmarks
+ *
+ * usage: origin [-t threads] [-s body-bytes] [-l latency-ms] <port>
+ *
+ * Answers every request with a fixed 200 response of the given size,
+ * so the proxy rather than the origin is the bottleneck (tiny forks a
+ * process per request).  With -l it waits before answering, like a
+ * slow backend.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+static int listenfd;
+static char *response;
+static size_t response_len;
+static int latency_ms;
+
+static void *server(void *vargp)
+{
+  char buf[8192];
+  ssize_t n;
+  size_t got, sent;
+  int fd;
+
+  while (1) {
+    if ((fd = accept(listenfd, NULL, NULL)) < 0)
+      continue;
+    /* Read until the end of the request headers */
+    got = 0;
+    while ((n = read(fd, buf + got, sizeof(buf) - 1 - got)) > 0) {
+      got += n;
+      buf[got] = '\0';
+      if (strstr(buf, "\r\n\r\n") || got == sizeof(buf) - 1)
+        break;
+    }
+    if (latency_ms)
+      usleep(latency_ms * 1000);
+    for (sent = 0; n > 0 && sent < response_len; sent += n)
+      n = write(fd, response + sent, response_len - sent);
+    close(fd);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  struct addrinfo hints, *p;
+  int opt, i, nthreads = 8, optval = 1;
+  size_t size = 1024, hlen;
+  pthread_t tid;
+
+  while ((opt = getopt(argc, argv, "t:s:l:")) != -1) {
+    switch (opt) {
+    case 't': nthreads = atoi(optarg); break;
+    case 's': size = atol(optarg); break;
+    case 'l': latency_ms = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-s body-bytes] "
+              "[-l latency-ms] <port>\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-t threads] [-s body-bytes] "
+            "[-l latency-ms] <port>\n", argv[0]);
+    exit(1);
+  }
+
+  response = malloc(size + 256);
+  hlen = sprintf(response, "HTTP/1.0 200 OK\r\nServer: origin\r\n"
+                 "Content-type: text/plain\r\nContent-length: %zu\r\n\r\n",
+                 size);
+  memset(response + hlen, 'x', size);
+  response_len = hlen + size;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, argv[optind], &hints, &p) != 0 ||
+      (listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0 ||
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) ||
+      bind(listenfd, p->ai_addr, p->ai_addrlen) || listen(listenfd, 1024)) {
+    perror("origin: listen");
+    exit(1);
+  }
+  for (i = 1; i < nthreads; i++)
+    pthread_create(&tid, NULL, server, NULL);
+  server(NULL);
+  return 0;
+}
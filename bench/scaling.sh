@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# scaling.sh - accepts/sec and requests/sec of 'proxy -m reuseport' as
+#     the number of reactors grows from 1 to N.  The cache is off, so
+#     every request goes through to the origin.
+#
+#     usage: bench/scaling.sh [max-reactors] [secs]
+#
+MAX=${1:-$(nproc)}
+SECS=${2:-5}
+CLIENTS=$((MAX * 16))
+PROXY_PORT=${PROXY_PORT:-28080}
+ORIGIN_PORT=${ORIGIN_PORT:-28081}
+BENCH_DIR=$(dirname $0)
+
+make -s -C ${BENCH_DIR} || exit 1
+make -s -C ${BENCH_DIR}/.. proxy || exit 1
+
+${BENCH_DIR}/origin -t ${CLIENTS} ${ORIGIN_PORT} &
+ORIGIN_PID=$!
+trap "kill ${ORIGIN_PID} 2> /dev/null" EXIT
+sleep 0.5
+
+printf "%-9s %14s %14s\n" reactors accepts/sec requests/sec
+for (( n = 1; n <= MAX; n++ ))
+do
+    ${BENCH_DIR}/../proxy -m reuseport -r ${n} -c 0 ${PROXY_PORT} &
+    PROXY_PID=$!
+    sleep 0.5
+    A=$(${BENCH_DIR}/loadgen -a -c ${CLIENTS} -d ${SECS} localhost \
+        ${PROXY_PORT} | awk '{print $2}')
+    R=$(${BENCH_DIR}/loadgen -c ${CLIENTS} -d ${SECS} localhost ${PROXY_PORT} \
+        http://localhost:${ORIGIN_PORT}/ | awk '{print $2}')
+    printf "%-9d %14s %14s\n" ${n} ${A} ${R}
+    kill ${PROXY_PID}
+    wait ${PROXY_PID} 2> /dev/null
+done
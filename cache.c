@@ -0,0 +1,1891 @@
+/*
+ * cache.c - in-memory web object cache shared by all connections
+ *
+ * The index is split into CACHE_SHARDS shards picked by the top bits
+ * of a wyhash of the key, and each shard has its own lock, so lookups
+ * of different keys rarely touch the same lock or the same cache lines.
+ * A shard is an open-addressing table in the Swiss-table style: slots
+ * are grouped sixteen to a cache-line-aligned group, and each group
+ * keeps one control byte per slot (empty, deleted, or seven bits of
+ * the hash).  A probe compares all sixteen control bytes of a group at
+ * once with SSE2 and only looks at the keys of slots whose tag matches.
+ *
+ * Which object leaves first is up to a pluggable eviction policy
+ * (policy.c), whose lists are guarded by the policy lock.  Evicted
+ * objects are spilled to the disk tier (disk.c) when there is one.  The lock
+ * order is shard, then policy; eviction takes a victim from the policy
+ * under the policy lock alone and then removes it from its shard, so
+ * no thread ever holds two shard locks.  Inserts evict until the new
+ * object fits in the budget.
+ *
+ * Lookups return a referenced object.  Its bytes stay valid until
+ * cache_release(), even if it is evicted or replaced in the meantime.
+ * A shard slot holds the cache's own reference.  Each object carries
+ * the time it goes stale (from http_freshness()), and a lookup that
+ * finds a stale copy treats it as a miss; the copy stays until the
+ * refetched response replaces it or the policy evicts it.  The leader
+ * of that refetch gets the stale copy, to revalidate it with the
+ * origin rather than download it again.  Within its stale window a
+ * stale copy is still a hit, and the first such hit also leads a
+ * background refresh (at most refresh_max at once); the others are
+ * sent the stale copy without waiting for it.
+ *
+ * Misses are collapsed: cache_join() records the first miss for a key
+ * as an in-flight fill on the key's shard, and later misses for that
+ * key follow it instead of fetching too.  The leader appends the
+ * response to the fill as it arrives and each follower streams it out
+ * at its own pace, so followers get their first byte as soon as the
+ * leader does.  When the fill completes, the response becomes an
+ * ordinary cached object.  Blocking followers sleep on a futex in the
+ * fill (which works across processes in shared mode); non-blocking
+ * ones register an eventfd to be written instead.
+ *
+ * Origins that could not be resolved or connected to are remembered for
+ * a while (cache_origin_failed()), in a small direct-mapped table with
+ * a word per slot: the top half of the hash of "host:port" and the time
+ * until which it counts as down.  A word is read and written whole, so
+ * the table needs no lock.  Error responses from live origins are
+ * ordinary objects with short lifetimes (conn.c).
+ *
+ * With cache_gzip() on, a completed fill whose response is text is
+ * stored with its body gzipped (gzip.c), when that saves at least an
+ * eighth, so that the budget holds more of a text-heavy working set.
+ * Its size in the budget is the gzipped one.  Readers check obj->plain
+ * and send the body as it is or inflate it; an object spilled to the
+ * disk tier is inflated first, since the tier sends its bytes as they
+ * are.
+ *
+ * Each shard also keeps a crit-bit tree (radix.c) of its objects' keys,
+ * updated under the shard lock it already holds, so that the objects
+ * under a URL prefix can be counted (cache_usage()) or purged
+ * (cache_purge_prefix()) without a scan of the cache: a prefix is
+ * looked up in every shard's tree.  An object the tree cannot take (a
+ * key of 64 KB or more, or one too deep) is cached all the same, and
+ * while there are any, prefix purges also add a ban to catch them.
+ *
+ * Objects are removed by key with cache_purge(), and by the many with
+ * bans (cache_ban()): a URL prefix or a regex that every object cached
+ * before it is matched against, lazily.  Each object records how many
+ * bans it has been checked against, so a lookup compares that with the
+ * count of bans added and only checks the newer ones, once, when they
+ * differ; a banned object is dropped and the lookup misses.  The bans
+ * are a ring of CACHE_BANS.  When it is full, the oldest are swept:
+ * every object, in memory and in the disk tier, is checked against
+ * them all and they are forgotten.
+ *
+ * In shared mode (the fork model) all of this - the shards, the LRU,
+ * the counters and every object - lives in one MAP_SHARED segment
+ * mapped before the first fork, so pointers are valid in every child.
+ * Objects and shard tables come from a block-managed data area (a
+ * bitmap of fixed-size blocks, each allocation one contiguous run), and
+ * process-shared robust mutexes replace the thread locks.  If a child
+ * dies holding one, what it guarded may be half updated, so it is
+ * dropped; the objects it held are leaked rather than freed under
+ * another child still sending them.
+ */
+#include "cache.h"
+#include "policy.h"
+#include "radix.h"
+#include "disk.h"
+#include "gzip.h"
+#include "http.h"
+#include <limits.h>
+#include <regex.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS  (1 << CACHE_SHARD_BITS)
+#define GROUP_SLOTS   16
+#define CTRL_EMPTY    ((signed char)0x80)
+#define CTRL_DELETED  ((signed char)0xfe)  /* full slots hold 0..127 */
+#define FILL_CHUNK    (16 * 1024)       /* streaming fill buffer unit */
+#define ORIGIN_SLOTS  256               /* failed origins remembered */
+#define CACHE_BANS    64                /* bans checked lazily, at most */
+#define BAN_PATTERN   512
+#define ARENA_BLOCK   1024              /* shared-mode allocation unit */
+#define WORD_BITS     (8 * sizeof(unsigned long))
+
+/* Block allocator for the shared data area */
+struct arena {
+  pthread_mutex_t lock;                 /* robust, process-shared */
+  char *base;
+  size_t nblocks;
+  size_t hint;                          /* where the next search starts */
+  unsigned long *map;                   /* one bit per block, 1 = used */
+};
+
+/* Allocations remember their length in front of the user bytes */
+struct arena_hdr {
+  size_t nblocks;
+  size_t pad;
+};
+
+/* Sixteen slots; the control bytes share the first cache line */
+struct group {
+  signed char ctrl[GROUP_SLOTS];
+  cache_obj_t *slot[GROUP_SLOTS];
+} __attribute__((aligned(64)));
+
+/*
+ * A miss being fetched.  The response grows as a list of fixed-size
+ * chunks that followers read while the leader appends: a chunk is
+ * linked before len covers it, and bytes below len never change.
+ */
+struct fill_chunk {
+  struct fill_chunk *next;
+  char data[FILL_CHUNK];
+};
+
+struct cache_fill {
+  char *key;
+  size_t keylen;
+  unsigned long hash;
+  int refcnt;                           /* the leader's + followers' */
+  int state;                            /* CACHE_FILLING, ... */
+  unsigned seq;                         /* futex word, bumped on change */
+  int sleepers;                         /* followers in FUTEX_WAIT */
+  pid_t pid;                            /* leader, in shared mode */
+  size_t len;                           /* bytes readable */
+  time_t expires, stale_until;          /* for the object, set by the leader */
+  int refresh;                          /* holds a background refresh slot */
+  struct fill_chunk *head, *tail;
+  pthread_mutex_t lock;                 /* guards waiters; robust if shared */
+  struct cache_waiter *waiters;
+  struct cache_fill *next;              /* shard's in-flight list */
+};
+
+/* A ban: objects cached before it whose keys match are dropped */
+struct ban {
+  int regex;                            /* pattern is a regex, else a prefix */
+  char pattern[BAN_PATTERN];
+};
+
+struct shard {
+  pthread_rwlock_t rwlock;              /* thread mode */
+  pthread_mutex_t lock;                 /* shared mode, robust */
+  void *mem;                            /* allocation holding groups */
+  struct group *groups;
+  size_t ngroups;                       /* a power of 2 */
+  size_t used, deleted;
+  struct cache_fill *fills;             /* in-flight misses, few */
+  struct radix index;                   /* its objects' keys, by prefix */
+} __attribute__((aligned(64)));
+
+struct cache {
+  size_t capacity, max_object;
+  int shared;
+  pthread_mutex_t policy_lock;          /* robust in shared mode */
+  struct arena arena;                   /* shared mode */
+  struct policy policy;
+  unsigned policy_gen;                  /* carried by the policy's objects */
+  int refresh_max, refreshing;          /* background refreshes */
+  int gzip_level;                       /* gzip text bodies, 0 = don't */
+  unsigned long down[ORIGIN_SLOTS];     /* failed origins: hash | until */
+  pthread_mutex_t ban_lock;             /* robust in shared mode */
+  unsigned long bans;                   /* added; n is ban[n % CACHE_BANS] */
+  unsigned long bans_swept;             /* applied to every object */
+  struct ban ban[CACHE_BANS];
+  time_t started;
+  int indexing;                         /* shards' URL indexes are kept */
+  long unindexed;                       /* objects they lack */
+  struct cache_stats stats;
+  struct shard shards[CACHE_SHARDS];
+};
+
+static struct cache *cache;
+
+/* Ban regexes compiled in this process: ban_re[i] is ban ban_re_n[i]'s */
+static regex_t ban_re[CACHE_BANS];
+static unsigned long ban_re_n[CACHE_BANS];
+
+#define STAT_ADD(field, n) \
+  __atomic_add_fetch(&cache->stats.field, (n), __ATOMIC_RELAXED)
+
+static void shard_reset(struct shard *s);
+static void policy_reset(void);
+static void cache_fill_release(cache_fill_t *f);
+
+/*
+ * wyhash (Wang Yi, public domain), final version 4 with the default
+ * secret: a multiply-and-fold hash that reads the key 8 bytes at a time.
+ */
+static const unsigned long wyp[4] = {
+  0xa0761d6478bd642fUL, 0xe7037ed1a0b428dbUL,
+  0x8ebc6af09c88c6e3UL, 0x589965cc75374cc3UL
+};
+
+static void wymum(unsigned long *a, unsigned long *b)
+{
+  __uint128_t r = (__uint128_t)*a * *b;
+
+  *a = (unsigned long)r;
+  *b = (unsigned long)(r >> 64);
+}
+
+static unsigned long wymix(unsigned long a, unsigned long b)
+{
+  wymum(&a, &b);
+  return a ^ b;
+}
+
+static unsigned long wyr8(const unsigned char *p)
+{
+  unsigned long v;
+
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static unsigned long wyr4(const unsigned char *p)
+{
+  unsigned int v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static unsigned long wyr3(const unsigned char *p, size_t k)
+{
+  return ((unsigned long)p[0] << 16) | ((unsigned long)p[k >> 1] << 8) |
+         p[k - 1];
+}
+
+unsigned long cache_hash(const char *key, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)key;
+  unsigned long seed = wymix(wyp[0], wyp[1]), a, b, see1, see2;
+  size_t i = len;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else
+      a = b = 0;
+  } else {
+    if (i > 48) {
+      see1 = see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+  a ^= wyp[1];
+  b ^= seed;
+  wymum(&a, &b);
+  return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+static void robust_mutex_init(pthread_mutex_t *mu)
+{
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(mu, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+/* Locks a robust mutex; returns 1 if its previous owner died holding it */
+static int robust_lock(pthread_mutex_t *mu)
+{
+  if (pthread_mutex_lock(mu) == EOWNERDEAD) {
+    pthread_mutex_consistent(mu);
+    return 1;
+  }
+  return 0;
+}
+
+static struct shard *shard_of(unsigned long h)
+{
+  return &cache->shards[h >> (64 - CACHE_SHARD_BITS)];
+}
+
+static void shard_rdlock(struct shard *s)
+{
+  if (!cache->shared)
+    pthread_rwlock_rdlock(&s->rwlock);
+  else if (robust_lock(&s->lock))
+    shard_reset(s);
+}
+
+static void shard_wrlock(struct shard *s)
+{
+  if (!cache->shared)
+    pthread_rwlock_wrlock(&s->rwlock);
+  else if (robust_lock(&s->lock))
+    shard_reset(s);
+}
+
+static void shard_unlock(struct shard *s)
+{
+  if (cache->shared)
+    pthread_mutex_unlock(&s->lock);
+  else
+    pthread_rwlock_unlock(&s->rwlock);
+}
+
+static void policy_lock(void)
+{
+  if (!cache->shared)
+    pthread_mutex_lock(&cache->policy_lock);
+  else if (robust_lock(&cache->policy_lock))
+    policy_reset();
+}
+
+static void policy_unlock(void)
+{
+  pthread_mutex_unlock(&cache->policy_lock);
+}
+
+/* Unindexes obj, if indexed; caller holds its shard s */
+static void index_del(struct shard *s, cache_obj_t *obj)
+{
+  if (obj->unindexed) {
+    obj->unindexed = 0;
+    __atomic_add_fetch(&cache->unindexed, -1, __ATOMIC_RELAXED);
+  } else if (cache->indexing) {
+    radix_remove(&s->index, obj);
+  }
+}
+
+/*
+ * Indexes obj's key in its shard s, which the caller holds locked, in
+ * place of old, the object it replaces, if any.  An object the tree
+ * cannot take is only counted, for prefix purges to ban instead.
+ */
+static void index_add(struct shard *s, cache_obj_t *obj, cache_obj_t *old)
+{
+  if (old && old->unindexed)
+    index_del(s, old);
+  if (cache->indexing && radix_insert(&s->index, obj) < 0) {
+    if (old)
+      index_del(s, old);                /* not replaced, then */
+    obj->unindexed = 1;
+    __atomic_add_fetch(&cache->unindexed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* The ring is written before the count of bans, so a dead owner is harmless */
+static void ban_lock(void)
+{
+  if (!cache->shared)
+    pthread_mutex_lock(&cache->ban_lock);
+  else
+    robust_lock(&cache->ban_lock);
+}
+
+static void ban_unlock(void)
+{
+  pthread_mutex_unlock(&cache->ban_lock);
+}
+
+static int block_used(struct arena *a, size_t i)
+{
+  return (a->map[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+}
+
+static void blocks_mark(struct arena *a, size_t i, size_t n, int used)
+{
+  for (; n > 0; i++, n--) {
+    if (used)
+      a->map[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+    else
+      a->map[i / WORD_BITS] &= ~(1UL << (i % WORD_BITS));
+  }
+}
+
+/* First fit over the block bitmap, starting after the last allocation */
+static void *arena_alloc(struct arena *a, size_t size)
+{
+  size_t n = (size + sizeof(struct arena_hdr) + ARENA_BLOCK - 1) / ARENA_BLOCK;
+  size_t i, run = 0, start = 0, scanned;
+  struct arena_hdr *h = NULL;
+
+  robust_lock(&a->lock);
+  i = a->hint;
+  for (scanned = 0; scanned < a->nblocks + n; scanned++, i++) {
+    if (i >= a->nblocks) {
+      i = 0;                            /* runs do not wrap around */
+      run = 0;
+    }
+    if (block_used(a, i)) {
+      run = 0;
+      continue;
+    }
+    if (run++ == 0)
+      start = i;
+    if (run == n) {
+      blocks_mark(a, start, n, 1);
+      a->hint = start + n;
+      h = (struct arena_hdr *)(a->base + start * ARENA_BLOCK);
+      h->nblocks = n;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+  return h ? h + 1 : NULL;
+}
+
+static void arena_free(struct arena *a, void *p)
+{
+  struct arena_hdr *h = (struct arena_hdr *)p - 1;
+
+  robust_lock(&a->lock);
+  blocks_mark(a, ((char *)h - a->base) / ARENA_BLOCK, h->nblocks, 0);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/* Object and table memory: the shared data area in shared mode, else heap */
+static void *cache_mem_alloc(size_t size)
+{
+  return cache->shared ? arena_alloc(&cache->arena, size) : malloc(size);
+}
+
+static void cache_mem_free(void *p)
+{
+  if (cache->shared)
+    arena_free(&cache->arena, p);
+  else
+    free(p);
+}
+/* Bit i set where the control byte of slot i equals c */
+static unsigned group_match(const struct group *g, signed char c)
+{
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *)g->ctrl);
+
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+  unsigned m = 0;
+  int i;
+
+  for (i = 0; i < GROUP_SLOTS; i++)
+    m |= (unsigned)(g->ctrl[i] == c) << i;
+  return m;
+#endif
+}
+
+/* Bit i set where slot i is empty or deleted (control byte negative) */
+static unsigned group_match_free(const struct group *g)
+{
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_load_si128((const __m128i *)g->ctrl));
+#else
+  unsigned m = 0;
+  int i;
+
+  for (i = 0; i < GROUP_SLOTS; i++)
+    m |= (unsigned)(g->ctrl[i] < 0) << i;
+  return m;
+#endif
+}
+
+/*
+ * Probe sequence: groups g, g+1, g+3, g+6, ... (triangular numbers),
+ * which visits every group of a power-of-2 table once.
+ */
+#define H1(h) ((h) >> 7)
+#define H2(h) ((signed char)((h) & 0x7f))
+
+/* Finds key in s; returns its slot number or -1.  Caller holds s. */
+static long shard_find(struct shard *s, const char *key, size_t len,
+                       unsigned long h)
+{
+  size_t mask = s->ngroups - 1, g = H1(h) & mask, step;
+  struct group *gr;
+  cache_obj_t *obj;
+  unsigned m;
+  int i;
+
+  for (step = 1; step <= s->ngroups; step++) {
+    gr = &s->groups[g];
+    for (m = group_match(gr, H2(h)); m; m &= m - 1) {
+      i = __builtin_ctz(m);
+      obj = gr->slot[i];
+      if (obj->hash == h && obj->keylen == len &&
+          memcmp(obj->key, key, len) == 0)
+        return g * GROUP_SLOTS + i;
+    }
+    if (group_match(gr, CTRL_EMPTY))
+      break;
+    g = (g + step) & mask;
+  }
+  return -1;
+}
+
+/* Puts obj in the first free slot of its probe sequence */
+static void shard_place(struct shard *s, cache_obj_t *obj)
+{
+  size_t mask = s->ngroups - 1, g = H1(obj->hash) & mask, step;
+  struct group *gr;
+  unsigned m;
+  int i;
+
+  for (step = 1; !(m = group_match_free(&s->groups[g])); step++)
+    g = (g + step) & mask;
+  gr = &s->groups[g];
+  i = __builtin_ctz(m);
+  if (gr->ctrl[i] == CTRL_DELETED)
+    s->deleted--;
+  gr->ctrl[i] = H2(obj->hash);
+  gr->slot[i] = obj;
+  s->used++;
+}
+
+/* Allocates an empty table of n groups for s; returns 0 if out of memory */
+static int shard_alloc(struct shard *s, size_t n)
+{
+  void *mem = cache_mem_alloc((n + 1) * sizeof(struct group));
+  size_t i;
+
+  if (!mem)
+    return 0;
+  s->mem = mem;
+  s->groups = (struct group *)(((unsigned long)mem + 63) & ~63UL);
+  s->ngroups = n;
+  s->used = s->deleted = 0;
+  for (i = 0; i < n; i++)
+    memset(s->groups[i].ctrl, CTRL_EMPTY, GROUP_SLOTS);
+  return 1;
+}
+
+/*
+ * Makes room for one more slot, keeping the table at most 7/8 full
+ * counting deleted slots.  Rehashes in place (dropping the deleted
+ * slots) when that is enough, else doubles.  Caller holds s for writing.
+ */
+static int shard_reserve(struct shard *s)
+{
+  size_t slots = s->ngroups * GROUP_SLOTS, n, i;
+  struct group *old = s->groups;
+  void *oldmem = s->mem;
+  size_t oldn = s->ngroups;
+  int j;
+
+  if ((s->used + s->deleted + 1) * 8 <= slots * 7)
+    return 1;
+  n = (s->used + 1) * 2 > slots ? s->ngroups * 2 : s->ngroups;
+  if (!shard_alloc(s, n))
+    return 0;
+  for (i = 0; i < oldn; i++)
+    for (j = 0; j < GROUP_SLOTS; j++)
+      if (old[i].ctrl[j] >= 0)
+        shard_place(s, old[i].slot[j]);
+  cache_mem_free(oldmem);
+  return 1;
+}
+
+static void shard_erase(struct shard *s, long pos)
+{
+  struct group *gr = &s->groups[pos / GROUP_SLOTS];
+
+  /* A probe stops at a group with an empty slot, so this one may
+   * become empty too; otherwise later keys may have probed past it. */
+  if (group_match(gr, CTRL_EMPTY)) {
+    gr->ctrl[pos % GROUP_SLOTS] = CTRL_EMPTY;
+  } else {
+    gr->ctrl[pos % GROUP_SLOTS] = CTRL_DELETED;
+    s->deleted++;
+  }
+  s->used--;
+}
+
+#define SLOT(s, pos) \
+  ((s)->groups[(pos) / GROUP_SLOTS].slot[(pos) % GROUP_SLOTS])
+
+/* A dead child left shard s inconsistent: start over with it empty */
+static void shard_reset(struct shard *s)
+{
+  size_t i;
+
+  fprintf(stderr, "cache: lock owner died, dropping %lu objects\n", s->used);
+  for (i = 0; i < s->ngroups; i++)
+    memset(s->groups[i].ctrl, CTRL_EMPTY, GROUP_SLOTS);
+  s->used = s->deleted = 0;
+  s->fills = NULL;                      /* followers time out on them */
+  radix_init(&s->index, cache_mem_alloc);
+}
+
+/*
+ * cache_init - set up the cache.  A zero capacity disables it.  With
+ *     shared set, everything is placed in a MAP_SHARED segment so that
+ *     processes forked afterwards all see the same cache.
+ */
+void cache_init(size_t capacity, size_t max_object, int shared,
+                const char *policy)
+{
+  size_t nblocks, mapwords, len, ngroups;
+  char *seg;
+  int i;
+
+  if (!shared) {
+    cache = Calloc(1, sizeof(struct cache));
+    pthread_mutex_init(&cache->policy_lock, NULL);
+    pthread_mutex_init(&cache->ban_lock, NULL);
+    for (i = 0; i < CACHE_SHARDS; i++)
+      pthread_rwlock_init(&cache->shards[i].rwlock, NULL);
+  } else {
+    /* Room for block rounding and the shard tables on top of the budget */
+    nblocks = (capacity + capacity / 4) / ARENA_BLOCK;
+    nblocks += nblocks / 16 + 8 * CACHE_SHARDS;
+    nblocks += capacity / 256 / ARENA_BLOCK + 2;  /* policy metadata */
+    nblocks += capacity / 8 / ARENA_BLOCK;        /* URL index nodes */
+    mapwords = (nblocks + WORD_BITS - 1) / WORD_BITS;
+    len = sizeof(struct cache) + mapwords * sizeof(unsigned long) +
+          nblocks * ARENA_BLOCK;
+    seg = Mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+               -1, 0);
+    cache = (struct cache *)seg;        /* the mapping is zero filled */
+    cache->shared = 1;
+    robust_mutex_init(&cache->policy_lock);
+    robust_mutex_init(&cache->ban_lock);
+    robust_mutex_init(&cache->arena.lock);
+    for (i = 0; i < CACHE_SHARDS; i++)
+      robust_mutex_init(&cache->shards[i].lock);
+    cache->arena.map = (unsigned long *)(seg + sizeof(struct cache));
+    cache->arena.base = (char *)(cache->arena.map + mapwords);
+    cache->arena.nblocks = nblocks;
+  }
+  cache->capacity = capacity;
+  cache->max_object = max_object < capacity ? max_object : capacity;
+  cache->policy_gen = 1;
+  cache->started = time(NULL);
+  cache->indexing = 1;
+  cache->policy.ops = policy_find(policy);
+  if (!cache->policy.ops)
+    app_error("cache_init: unknown eviction policy");
+  if (cache->policy.ops->init(&cache->policy, capacity, cache_mem_alloc) < 0)
+    unix_error("cache_init: policy");
+
+  /* Start each shard with room for its share of 4 KB objects */
+  for (ngroups = 1; ngroups * GROUP_SLOTS * CACHE_SHARDS * 4096 < capacity;)
+    ngroups *= 2;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    if (!shard_alloc(&cache->shards[i], ngroups))
+      unix_error("cache_init: shard table");
+    radix_init(&cache->shards[i].index, cache_mem_alloc);
+  }
+}
+
+int cache_enabled(void)
+{
+  return cache->capacity > 0;
+}
+
+size_t cache_max_object(void)
+{
+  return cache->max_object;
+}
+
+void cache_release(cache_obj_t *obj)
+{
+  if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    cache_mem_free(obj);
+}
+
+/* Policy wrappers; caller holds the policy lock */
+static int policy_tracks(cache_obj_t *obj)
+{
+  return obj->policy_gen == cache->policy_gen;
+}
+
+static void policy_untrack(cache_obj_t *obj)
+{
+  obj->policy_gen = 0;
+  STAT_ADD(objects, -1);
+  STAT_ADD(bytes, -(long)obj->size);
+  if (obj->plain) {
+    STAT_ADD(gzipped, -1);
+    STAT_ADD(gzip_saved, -(long)(obj->plain - obj->size));
+  }
+}
+
+static void policy_remove(cache_obj_t *obj)
+{
+  if (policy_tracks(obj)) {
+    cache->policy.ops->remove(&cache->policy, obj);
+    policy_untrack(obj);
+  }
+}
+
+static void policy_insert(cache_obj_t *obj)
+{
+  cache->policy.ops->insert(&cache->policy, obj);
+  obj->policy_gen = cache->policy_gen;
+  STAT_ADD(objects, 1);
+  STAT_ADD(bytes, obj->size);
+  if (obj->plain) {
+    STAT_ADD(gzipped, 1);
+    STAT_ADD(gzip_saved, obj->plain - obj->size);
+  }
+}
+
+/*
+ * Tells the policy key h was looked up, and obj (if any) hit.  Policies
+ * with lockless hits and no record() never take the policy lock here.
+ */
+static void policy_access(unsigned long h, cache_obj_t *obj)
+{
+  const struct policy_ops *ops = cache->policy.ops;
+
+  if (ops->lockless_hit && obj)
+    ops->hit(&cache->policy, obj);
+  if (!ops->record && (!obj || ops->lockless_hit))
+    return;
+  policy_lock();
+  if (ops->record)
+    ops->record(&cache->policy, h);
+  if (obj && !ops->lockless_hit && policy_tracks(obj))
+    ops->hit(&cache->policy, obj);
+  policy_unlock();
+}
+
+/*
+ * A dead child left the policy's lists inconsistent: empty them.
+ * Bumping the generation untracks every object at once; those still in
+ * a shard are never evicted, only replaced.
+ */
+static void policy_reset(void)
+{
+  fprintf(stderr, "cache: lock owner died, dropping %ld objects\n",
+          cache->stats.objects);
+  memset(cache->policy.q, 0, sizeof(cache->policy.q));
+  cache->policy_gen++;
+  cache->stats.objects = cache->stats.bytes = 0;
+}
+
+/* Removes obj from its shard if it is still the one cached there */
+static void shard_remove(cache_obj_t *obj)
+{
+  struct shard *s = shard_of(obj->hash);
+  long pos;
+
+  shard_wrlock(s);
+  pos = shard_find(s, obj->key, obj->keylen, obj->hash);
+  if (pos >= 0 && SLOT(s, pos) == obj) {
+    shard_erase(s, pos);
+    cache_release(obj);
+  }
+  index_del(s, obj);                    /* even if a dead child lost it */
+  shard_unlock(s);
+}
+
+/* Whether obj has outlived its freshness lifetime at now */
+static int obj_stale(cache_obj_t *obj, time_t now)
+{
+  return obj->expires && obj->expires <= now;
+}
+
+/* Whether obj has to be checked against bans added since it last was */
+static int obj_unchecked(cache_obj_t *obj)
+{
+  return __atomic_load_n(&obj->bans, __ATOMIC_RELAXED) !=
+         __atomic_load_n(&cache->bans, __ATOMIC_RELAXED);
+}
+
+/* Spills obj to the disk tier, which keeps responses as they are sent */
+static void obj_spill(cache_obj_t *obj)
+{
+  size_t hlen;
+  char *resp;
+  long t;
+
+  if (!obj->plain) {
+    disk_put(obj->key, obj->hash, obj->data, obj->size, obj->expires);
+    return;
+  }
+  if (!disk_enabled())
+    return;
+  t = gzip_cpu_us();
+  hlen = http_head_len(obj->data, obj->size);
+  resp = Malloc(obj->plain);
+  memcpy(resp, obj->data, hlen);
+  if (gzip_inflate(obj->data + hlen, obj->size - hlen, resp + hlen,
+                   obj->plain - hlen))
+    disk_put(obj->key, obj->hash, resp, obj->plain, obj->expires);
+  STAT_ADD(inflate_us, gzip_cpu_us() - t);
+  free(resp);
+}
+
+/*
+ * Evicts the policy's victims until need more bytes fit in the budget,
+ * or evicts one regardless with force set.  Returns 0 if there was
+ * nothing to evict.
+ */
+static int cache_evict(size_t need, int force)
+{
+  cache_obj_t *victim;
+
+  for (;;) {
+    policy_lock();
+    if (!force && (size_t)cache->stats.bytes + need <= cache->capacity) {
+      policy_unlock();
+      return 1;
+    }
+    if (!(victim = cache->policy.ops->evict(&cache->policy))) {
+      policy_unlock();
+      return 0;
+    }
+    /* Still in its shard, which holds a reference, while tracked */
+    policy_untrack(victim);
+    __atomic_add_fetch(&victim->refcnt, 1, __ATOMIC_RELAXED);
+    policy_unlock();
+    STAT_ADD(evictions, 1);
+    shard_remove(victim);
+    /* Adopted objects never hit, so never checked, and stale or banned
+     * ones are not worth it */
+    if (!__atomic_load_n(&victim->verify, __ATOMIC_RELAXED) &&
+        !obj_stale(victim, time(NULL)) &&
+        !(obj_unchecked(victim) && cache_banned(victim->key, victim->bans)))
+      obj_spill(victim);
+    cache_release(victim);
+    if (force)
+      return 1;
+  }
+}
+
+/* Returns the object for key in s with a reference held; caller holds s */
+static cache_obj_t *shard_get(struct shard *s, const char *key, size_t len,
+                              unsigned long h)
+{
+  cache_obj_t *obj;
+  long pos;
+
+  if ((pos = shard_find(s, key, len, h)) < 0)
+    return NULL;
+  obj = SLOT(s, pos);
+  __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+  return obj;
+}
+
+/*
+ * Checks an adopted object's bytes against their checksum on its first
+ * hit.  A corrupt object is dropped, and the caller's reference with it.
+ */
+static int obj_verify(cache_obj_t *obj)
+{
+  if ((cache_hash(obj->data, obj->size) | 1) == obj->verify) {
+    __atomic_store_n(&obj->verify, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+  fprintf(stderr, "cache: dropping corrupt object %s\n", obj->key);
+  policy_lock();
+  policy_remove(obj);
+  policy_unlock();
+  shard_remove(obj);
+  cache_release(obj);
+  return 0;
+}
+
+/*
+ * Whether ban n matches key.  Regexes are matched against the key
+ * without the "#..." of a segment or head entry, and compiled once per
+ * process.  Caller holds the ban lock.
+ */
+static int ban_match(unsigned long n, const char *key)
+{
+  struct ban *b = &cache->ban[n % CACHE_BANS];
+  regex_t *re = &ban_re[n % CACHE_BANS];
+  regmatch_t m;
+
+  if (!b->regex)
+    return strncmp(key, b->pattern, strlen(b->pattern)) == 0;
+  if (ban_re_n[n % CACHE_BANS] != n) {
+    if (ban_re_n[n % CACHE_BANS])
+      regfree(re);
+    ban_re_n[n % CACHE_BANS] = 0;
+    if (regcomp(re, b->pattern, REG_EXTENDED | REG_NOSUB) != 0)
+      return 0;                         /* cache_ban() checked it */
+    ban_re_n[n % CACHE_BANS] = n;
+  }
+  m.rm_so = 0;
+  m.rm_eo = strcspn(key, "#");
+  return regexec(re, key, 1, &m, REG_STARTEND) == 0;
+}
+
+/*
+ * cache_banned - whether a ban added after the first seen matches key.
+ *     Bans already swept are gone, so anything not checked against them
+ *     counts as banned.
+ */
+int cache_banned(const char *key, unsigned long seen)
+{
+  unsigned long n;
+  int banned = 0;
+
+  ban_lock();
+  if (seen < cache->bans_swept)
+    banned = 1;
+  for (n = seen + 1; !banned && n <= cache->bans; n++)
+    banned = ban_match(n, key);
+  ban_unlock();
+  return banned;
+}
+
+/*
+ * Checks obj against the bans added since it was last checked.  A
+ * banned object is dropped, and the caller's reference with it.
+ */
+static int obj_unbanned(cache_obj_t *obj)
+{
+  unsigned long bans = __atomic_load_n(&cache->bans, __ATOMIC_ACQUIRE);
+
+  if (!cache_banned(obj->key, obj->bans)) {
+    __atomic_store_n(&obj->bans, bans, __ATOMIC_RELAXED);
+    return 1;
+  }
+  policy_lock();
+  policy_remove(obj);
+  policy_unlock();
+  shard_remove(obj);
+  cache_release(obj);
+  STAT_ADD(banned, 1);
+  return 0;
+}
+
+/*
+ * Drops the caller's reference to obj if it is stale at now, setting
+ * *stale.  Returns obj, or NULL if it was dropped (or NULL already).
+ */
+static cache_obj_t *obj_fresh(cache_obj_t *obj, time_t now, int *stale)
+{
+  if (obj && obj_stale(obj, now)) {
+    cache_release(obj);                 /* its shard holds another */
+    *stale = 1;
+    return NULL;
+  }
+  return obj;
+}
+
+/*
+ * Returns the fresh object cached under key with a reference held, or
+ * NULL.  A stale copy counts as a miss (and as "expired").
+ */
+cache_obj_t *cache_lookup(const char *key)
+{
+  size_t len = strlen(key);
+  unsigned long h = cache_hash(key, len);
+  struct shard *s;
+  cache_obj_t *obj;
+  int stale = 0;
+
+  if (!cache_enabled())
+    return NULL;
+  s = shard_of(h);
+  shard_rdlock(s);
+  obj = obj_fresh(shard_get(s, key, len, h), time(NULL), &stale);
+  shard_unlock(s);
+  STAT_ADD(expired, stale);
+  if (obj && __atomic_load_n(&obj->verify, __ATOMIC_RELAXED) &&
+      !obj_verify(obj))
+    obj = NULL;
+  if (obj && obj_unchecked(obj) && !obj_unbanned(obj))
+    obj = NULL;
+  if (obj)
+    __atomic_add_fetch(&obj->hits, 1, __ATOMIC_RELAXED);
+  policy_access(h, obj);
+  STAT_ADD(hits, obj != NULL);
+  STAT_ADD(misses, obj == NULL);
+  return obj;
+}
+
+/* Allocates an object for key with room for size bytes of data */
+static cache_obj_t *obj_alloc(const char *key, size_t len, unsigned long h,
+                              size_t size)
+{
+  cache_obj_t *obj;
+
+  cache_evict(size, 0);
+  /* The shared data area can be fragmented even under budget */
+  while (!(obj = cache_mem_alloc(sizeof(cache_obj_t) + len + 1 + size)) &&
+         cache_evict(0, 1))
+    ;
+  if (!obj)
+    return NULL;
+  memset(obj, 0, sizeof(cache_obj_t));
+  obj->key = (char *)(obj + 1);
+  memcpy(obj->key, key, len + 1);
+  obj->keylen = len;
+  obj->hash = h;
+  obj->data = obj->key + len + 1;
+  obj->size = size;
+  obj->refcnt = 1;
+  return obj;
+}
+
+/* Makes obj the cached copy for its key, replacing any older one */
+static void obj_publish(cache_obj_t *obj)
+{
+  struct shard *s = shard_of(obj->hash);
+  cache_obj_t *old = NULL;
+  long pos;
+
+  obj->status = http_status(obj->data, http_head_len(obj->data, obj->size));
+  shard_wrlock(s);
+  /* Under the shard lock, so that a sweep either sees it or need not */
+  obj->bans = __atomic_load_n(&cache->bans, __ATOMIC_ACQUIRE);
+  if ((pos = shard_find(s, obj->key, obj->keylen, obj->hash)) >= 0) {
+    old = SLOT(s, pos);
+    SLOT(s, pos) = obj;
+  } else if (shard_reserve(s)) {
+    shard_place(s, obj);
+  } else {
+    shard_unlock(s);
+    cache_mem_free(obj);
+    return;
+  }
+  index_add(s, obj, old);
+  policy_lock();
+  if (old)
+    policy_remove(old);
+  policy_insert(obj);
+  policy_unlock();
+  shard_unlock(s);
+  if (old)
+    cache_release(old);
+  STAT_ADD(inserts, 1);
+
+  /* Concurrent inserts may have overshot the budget together */
+  cache_evict(0, 0);
+}
+
+/*
+ * cache_insert - cache a copy of a response under key, replacing any
+ *     older copy and evicting objects as the policy picks to make room.
+ *     Objects over the per-object cap are ignored.
+ */
+void cache_insert(const char *key, const char *data, size_t size)
+{
+  cache_store(key, data, size, 0, 0);
+}
+
+/*
+ * cache_store - cache_insert() a copy that goes stale at expires, and
+ *     may be served stale until stale_until
+ */
+void cache_store(const char *key, const char *data, size_t size,
+                 time_t expires, time_t stale_until)
+{
+  size_t len = strlen(key);
+  cache_obj_t *obj;
+
+  if (!cache_enabled() || size > cache->max_object)
+    return;
+  if ((obj = obj_alloc(key, len, cache_hash(key, len), size))) {
+    memcpy(obj->data, data, size);
+    obj->expires = expires;
+    obj->stale_until = stale_until;
+    obj_publish(obj);
+  }
+}
+
+/*
+ * cache_adopt - cache size bytes at data under key without copying
+ *     them; data must stay mapped for good.  plain is the size of the
+ *     response ungzipped if its body is gzipped, else 0.  sum is
+ *     cache_hash() of the bytes, checked on the object's first hit,
+ *     and expires its end of freshness.  Returns 0 once the budget is
+ *     full, so that a loader knows to stop.
+ */
+int cache_adopt(const char *key, const char *data, size_t size,
+                size_t plain, unsigned long sum, time_t expires,
+                time_t stale_until)
+{
+  size_t len = strlen(key);
+  cache_obj_t *obj;
+
+  if (!cache_enabled() || size > cache->max_object)
+    return 1;
+  if ((size_t)cache->stats.bytes + size > cache->capacity ||
+      !(obj = obj_alloc(key, len, cache_hash(key, len), 0)))
+    return 0;
+  obj->data = (char *)data;
+  obj->size = size;
+  obj->plain = plain;
+  obj->verify = sum | 1;
+  obj->expires = expires;
+  obj->stale_until = stale_until;
+  obj_publish(obj);
+  return 1;
+}
+
+/*
+ * cache_walk - call fn on every cached object, outside the cache's
+ *     locks.  fn returns 1 to keep the reference it is handed (and
+ *     cache_release() it later), else 0.  Banned objects are dropped
+ *     instead.
+ */
+void cache_walk(int (*fn)(cache_obj_t *obj, void *arg), void *arg)
+{
+  cache_obj_t **objs;
+  struct shard *s;
+  size_t pos, n, i;
+  int sh;
+
+  if (!cache_enabled())
+    return;
+  for (sh = 0; sh < CACHE_SHARDS; sh++) {
+    s = &cache->shards[sh];
+    shard_rdlock(s);
+    objs = Malloc((s->used + 1) * sizeof(cache_obj_t *));
+    for (pos = n = 0; pos < s->ngroups * GROUP_SLOTS; pos++)
+      if (s->groups[pos / GROUP_SLOTS].ctrl[pos % GROUP_SLOTS] >= 0) {
+        objs[n] = SLOT(s, pos);
+        __atomic_add_fetch(&objs[n++]->refcnt, 1, __ATOMIC_RELAXED);
+      }
+    shard_unlock(s);
+    for (i = 0; i < n; i++)
+      if ((!obj_unchecked(objs[i]) || obj_unbanned(objs[i])) &&
+          !fn(objs[i], arg))
+        cache_release(objs[i]);
+    free(objs);
+  }
+}
+
+/*
+ * cache_purge - remove the object cached under key, and its copy in the
+ *     disk tier.  Returns 1 if there was either.
+ */
+int cache_purge(const char *key)
+{
+  size_t len = strlen(key);
+  unsigned long h = cache_hash(key, len);
+  struct shard *s;
+  cache_obj_t *obj = NULL;
+  long pos;
+  int found;
+
+  if (!cache_enabled())
+    return 0;
+  s = shard_of(h);
+  shard_wrlock(s);
+  if ((pos = shard_find(s, key, len, h)) >= 0) {
+    obj = SLOT(s, pos);
+    shard_erase(s, pos);
+    index_del(s, obj);
+    policy_lock();
+    policy_remove(obj);
+    policy_unlock();
+  }
+  shard_unlock(s);
+  found = disk_remove(key);
+  if (obj) {
+    cache_release(obj);
+    found = 1;
+  }
+  STAT_ADD(purged, found);
+  return found;
+}
+
+/*
+ * cache_purge_prefix - remove every object whose key starts with
+ *     prefix at once, and ban them from the disk tier, which is not
+ *     indexed, and from memory too while any object is unindexed.
+ *     Returns how many were removed from memory.
+ */
+long cache_purge_prefix(const char *prefix)
+{
+  cache_obj_t *objs[256];
+  struct shard *s;
+  long purged = 0, pos;
+  int n, m, i, j;
+
+  if (!cache_enabled())
+    return 0;
+  if (disk_enabled() || !cache->indexing ||
+      __atomic_load_n(&cache->unindexed, __ATOMIC_RELAXED) > 0)
+    cache_ban(prefix, 0);
+  if (!cache->indexing)
+    return 0;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    s = &cache->shards[i];
+    do {
+      shard_wrlock(s);
+      n = radix_collect(&s->index, prefix, objs, 256);
+      policy_lock();
+      for (j = m = 0; j < n; j++) {
+        radix_remove(&s->index, objs[j]);
+        if ((pos = shard_find(s, objs[j]->key, objs[j]->keylen,
+                              objs[j]->hash)) >= 0 && SLOT(s, pos) == objs[j]) {
+          shard_erase(s, pos);
+          policy_remove(objs[j]);
+          objs[m++] = objs[j];
+        }
+      }
+      policy_unlock();
+      shard_unlock(s);
+      for (j = 0; j < m; j++)
+        cache_release(objs[j]);         /* the shard's reference */
+      purged += m;
+    } while (n == 256);
+  }
+  STAT_ADD(purged, purged);
+  return purged;
+}
+
+/*
+ * cache_usage - count the objects whose keys start with prefix, and
+ *     their bytes; unindexed objects are not counted.  Returns -1 if
+ *     the URL index is off.
+ */
+int cache_usage(const char *prefix, long *objects, long *bytes)
+{
+  struct shard *s;
+  long o, b;
+  int i;
+
+  *objects = *bytes = 0;
+  if (!cache->indexing)
+    return -1;
+  if (!cache_enabled())
+    return 0;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    s = &cache->shards[i];
+    shard_rdlock(s);
+    radix_usage(&s->index, prefix, &o, &b);
+    shard_unlock(s);
+    *objects += o;
+    *bytes += b;
+  }
+  return 0;
+}
+
+/*
+ * cache_url_index - keep the URL index up to date or, with on 0, not,
+ *     to measure what it costs.  Call before anything is cached.
+ */
+void cache_url_index(int on)
+{
+  cache->indexing = on;
+}
+
+/* Checked by cache_walk() itself */
+static int sweep_one(cache_obj_t *obj, void *arg)
+{
+  return 0;
+}
+
+/*
+ * cache_ban - drop every object cached from now back whose key starts
+ *     with pattern, or matches it as an extended regex if regex is set.
+ *     Returns -1 if the pattern is too long or not a valid regex.
+ */
+int cache_ban(const char *pattern, int regex)
+{
+  unsigned long n;
+  regex_t re;
+  struct ban *b;
+
+  if (strlen(pattern) >= BAN_PATTERN)
+    return -1;
+  if (regex) {
+    if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0)
+      return -1;
+    regfree(&re);
+  }
+  for (;;) {
+    ban_lock();
+    if (cache->bans - cache->bans_swept < CACHE_BANS)
+      break;
+    /* The ring is full: check everything against it and forget it */
+    n = cache->bans;
+    ban_unlock();
+    cache_walk(sweep_one, NULL);
+    disk_sweep();
+    ban_lock();
+    if (cache->bans_swept < n)
+      cache->bans_swept = n;
+    ban_unlock();
+  }
+  n = cache->bans + 1;
+  b = &cache->ban[n % CACHE_BANS];
+  b->regex = regex;
+  strcpy(b->pattern, pattern);
+  __atomic_store_n(&cache->bans, n, __ATOMIC_RELEASE);
+  ban_unlock();
+  STAT_ADD(bans, 1);
+  return 0;
+}
+
+/* cache_bans - how many bans there have been, for cache_banned() */
+unsigned long cache_bans(void)
+{
+  return __atomic_load_n(&cache->bans, __ATOMIC_ACQUIRE);
+}
+
+struct hottest {
+  cache_obj_t **top;
+  int n, max;
+};
+
+/* Keeps obj in the list, sorted by hits, if it is among the hottest */
+static int hottest_one(cache_obj_t *obj, void *arg)
+{
+  struct hottest *h = arg;
+  unsigned hits = __atomic_load_n(&obj->hits, __ATOMIC_RELAXED);
+  int i;
+
+  if (h->n == h->max && hits <= h->top[h->n - 1]->hits)
+    return 0;
+  if (h->n == h->max)
+    cache_release(h->top[--h->n]);
+  for (i = h->n++; i > 0 && h->top[i - 1]->hits < hits; i--)
+    h->top[i] = h->top[i - 1];
+  h->top[i] = obj;
+  return 1;
+}
+
+/*
+ * cache_hottest - fill top with up to n of the cached objects that have
+ *     answered the most lookups, most first, with references held.
+ *     Returns how many.
+ */
+int cache_hottest(cache_obj_t **top, int n)
+{
+  struct hottest h = { top, 0, n };
+
+  if (n > 0)
+    cache_walk(hottest_one, &h);
+  return h.n;
+}
+
+/*
+ * cache_refresh_limit - allow max background refreshes at once.  With
+ *     none allowed (the default), stale copies are never served.
+ */
+void cache_refresh_limit(int max)
+{
+  cache->refresh_max = max;
+}
+
+/*
+ * cache_gzip - store text responses that complete a fill with their
+ *     bodies gzipped at level (1 to 9), or not at all with 0
+ */
+void cache_gzip(int level)
+{
+  cache->gzip_level = level;
+}
+
+/* Claims a background refresh slot; returns 0 if all are taken */
+static int refresh_slot(void)
+{
+  if (__atomic_add_fetch(&cache->refreshing, 1, __ATOMIC_RELAXED) <=
+      cache->refresh_max)
+    return 1;
+  __atomic_sub_fetch(&cache->refreshing, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Starts a fill for key on s; caller holds s for writing */
+static cache_fill_t *fill_new(struct shard *s, const char *key, size_t len,
+                              unsigned long h)
+{
+  cache_fill_t *f;
+
+  if (!(f = cache_mem_alloc(sizeof(cache_fill_t) + len + 1)))
+    return NULL;
+  memset(f, 0, sizeof(cache_fill_t));
+  f->key = (char *)(f + 1);
+  memcpy(f->key, key, len + 1);
+  f->keylen = len;
+  f->hash = h;
+  f->refcnt = 1;
+  f->pid = getpid();
+  if (cache->shared)
+    robust_mutex_init(&f->lock);
+  else
+    pthread_mutex_init(&f->lock, NULL);
+  f->next = s->fills;
+  s->fills = f;
+  return f;
+}
+
+/*
+ * cache_join - look key up, and on a miss either start a fill for it
+ *     (CACHE_LEAD) or join the one already in flight (CACHE_FOLLOW).
+ *     Returns CACHE_MISS when the cache is off or out of memory.  A
+ *     stale copy within its stale window is returned as CACHE_STALE,
+ *     with a fill to refresh it in the background unless one is in
+ *     flight or too many are; past the window it counts as a miss, a
+ *     leader gets it in *hit, and the fill's object replaces it.  A
+ *     follower counts as collapsed here, and as a hit or a miss when
+ *     it leaves the fill.
+ */
+int cache_join(const char *key, cache_obj_t **hit, cache_fill_t **fill)
+{
+  size_t len = strlen(key);
+  unsigned long h = cache_hash(key, len);
+  struct shard *s;
+  cache_fill_t *f;
+  cache_obj_t *old = NULL;
+  time_t now = time(NULL);
+  int rc = CACHE_MISS;
+
+  *hit = NULL;
+  *fill = NULL;
+  if (!cache_enabled())
+    return CACHE_MISS;
+  s = shard_of(h);
+  shard_rdlock(s);
+  *hit = shard_get(s, key, len, h);
+  shard_unlock(s);
+  if (*hit && __atomic_load_n(&(*hit)->verify, __ATOMIC_RELAXED) &&
+      !obj_verify(*hit))
+    *hit = NULL;                        /* dropped it */
+  if (*hit && obj_unchecked(*hit) && !obj_unbanned(*hit))
+    *hit = NULL;
+  if (*hit && obj_stale(*hit, now)) {
+    old = *hit;
+    *hit = NULL;
+  }
+  if (*hit) {
+    rc = CACHE_HIT;
+  } else {
+    shard_wrlock(s);
+    if (!old && (*hit = shard_get(s, key, len, h))) {
+      /* Cached since we looked: start over with it */
+      shard_unlock(s);
+      cache_release(*hit);
+      return cache_join(key, hit, fill);
+    }
+    for (f = s->fills; f; f = f->next)
+      if (f->hash == h && f->keylen == len && memcmp(f->key, key, len) == 0)
+        break;
+    if (old && now < old->stale_until && cache->refresh_max > 0) {
+      rc = CACHE_STALE;
+      *hit = old;
+      old = NULL;
+      if (!f && refresh_slot()) {
+        if ((*fill = fill_new(s, key, len, h)))
+          (*fill)->refresh = 1;
+        else
+          __atomic_sub_fetch(&cache->refreshing, 1, __ATOMIC_RELAXED);
+      }
+    } else if (f) {
+      __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_RELAXED);
+      *fill = f;
+      rc = CACHE_FOLLOW;
+    } else if ((*fill = fill_new(s, key, len, h))) {
+      rc = CACHE_LEAD;
+    }
+    shard_unlock(s);
+  }
+  if (rc == CACHE_HIT || rc == CACHE_STALE)
+    __atomic_add_fetch(&(*hit)->hits, 1, __ATOMIC_RELAXED);
+  policy_access(h, *hit);
+  STAT_ADD(hits, rc == CACHE_HIT || rc == CACHE_STALE);
+  STAT_ADD(misses, rc == CACHE_LEAD || rc == CACHE_MISS);
+  STAT_ADD(collapsed, rc == CACHE_FOLLOW);
+  STAT_ADD(expired, old != NULL || rc == CACHE_STALE);
+  STAT_ADD(served_stale, rc == CACHE_STALE);
+  STAT_ADD(refreshes, rc == CACHE_STALE && *fill);
+  /* Only the leader revalidates */
+  if (old && rc == CACHE_LEAD)
+    *hit = old;
+  else if (old)
+    cache_release(old);
+  return rc;
+}
+
+/*
+ * Locks f's list of waiters.  A child that died holding it can only
+ * have been a non-blocking engine's, which the fork model has none of.
+ */
+static void fill_lock(cache_fill_t *f)
+{
+  if (!cache->shared)
+    pthread_mutex_lock(&f->lock);
+  else
+    robust_lock(&f->lock);
+}
+
+static void fill_unlock(cache_fill_t *f)
+{
+  pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * Wakes f's followers; state is the new state, or CACHE_FILLING for
+ * data.  Only a new state takes the shard lock, to make f unjoinable;
+ * appended data takes just f's own lock, so readers of the shard are
+ * not held up once per chunk of a streaming response.
+ */
+static void fill_notify(cache_fill_t *f, int state)
+{
+  struct shard *s = shard_of(f->hash);
+  struct cache_fill **pp;
+  struct cache_waiter *w;
+  unsigned long one = 1;
+
+  if (state != CACHE_FILLING) {
+    shard_wrlock(s);
+    for (pp = &s->fills; *pp; pp = &(*pp)->next)
+      if (*pp == f) {
+        *pp = f->next;
+        break;
+      }
+    __atomic_store_n(&f->state, state, __ATOMIC_RELEASE);
+    shard_unlock(s);
+  }
+  __atomic_add_fetch(&f->seq, 1, __ATOMIC_RELEASE);
+  if (__atomic_load_n(&f->sleepers, __ATOMIC_ACQUIRE))
+    syscall(SYS_futex, &f->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  fill_lock(f);
+  for (w = f->waiters; w; w = w->next)
+    write(w->fd, &one, sizeof(one));
+  fill_unlock(f);
+}
+
+/*
+ * cache_fill_fits - whether a response of size bytes can go through a
+ *     fill.  Followers may be streaming it, so a fill is not given up
+ *     at the object cap, but one larger than the whole budget would be
+ *     cut off under them.
+ */
+int cache_fill_fits(size_t size)
+{
+  return size <= cache->capacity;
+}
+
+/*
+ * cache_fill_expires - the leader learned when the response goes stale,
+ *     and until when it may be served stale
+ */
+void cache_fill_expires(cache_fill_t *f, time_t expires, time_t stale_until)
+{
+  f->expires = expires;
+  f->stale_until = stale_until;
+}
+
+/*
+ * cache_fill_append - the leader received n more response bytes.
+ *     Returns 0 if they were not taken: the response outgrew the
+ *     object cap with nobody following, or outgrew the whole cache
+ *     budget; the leader should then give the fill up.
+ */
+int cache_fill_append(cache_fill_t *f, const char *data, size_t n)
+{
+  size_t len = f->len, off, k;
+  struct fill_chunk *ck;
+
+  if (len + n > cache->capacity ||
+      (len + n > cache->max_object &&
+       __atomic_load_n(&f->refcnt, __ATOMIC_ACQUIRE) == 1))
+    return 0;
+  while (n > 0) {
+    off = len % FILL_CHUNK;
+    if (off == 0) {                     /* the tail chunk is full */
+      if (!(ck = cache_mem_alloc(sizeof(struct fill_chunk))))
+        return 0;
+      ck->next = NULL;
+      if (f->tail)
+        f->tail->next = ck;
+      else
+        f->head = ck;
+      f->tail = ck;
+    }
+    k = FILL_CHUNK - off < n ? FILL_CHUNK - off : n;
+    memcpy(f->tail->data + off, data, k);
+    data += k;
+    n -= k;
+    len += k;
+  }
+  __atomic_store_n(&f->len, len, __ATOMIC_RELEASE);
+  fill_notify(f, CACHE_FILLING);
+  return 1;
+}
+
+/* Copies the response in f to out */
+static void fill_copy(cache_fill_t *f, char *out)
+{
+  struct fill_chunk *ck;
+  size_t off, k;
+
+  for (ck = f->head, off = 0; off < f->len; ck = ck->next, off += k) {
+    k = f->len - off < FILL_CHUNK ? f->len - off : FILL_CHUNK;
+    memcpy(out + off, ck->data, k);
+  }
+}
+
+/*
+ * Returns a new object holding the response in f with its body
+ * gzipped, if the cache gzips, the response is text (its head in the
+ * first chunk) and gzip saves at least an eighth of the body; else
+ * NULL.
+ */
+static cache_obj_t *fill_gzip(cache_fill_t *f)
+{
+  cache_obj_t *obj = NULL;
+  size_t hlen, blen, zlen;
+  char *resp, *z;
+  long t;
+
+  if (!cache->gzip_level || !f->head ||
+      !(hlen = http_head_len(f->head->data,
+                             f->len < FILL_CHUNK ? f->len : FILL_CHUNK)) ||
+      !gzip_wanted(f->head->data, f->len - hlen))
+    return NULL;
+  t = gzip_cpu_us();
+  resp = Malloc(f->len);
+  fill_copy(f, resp);
+  blen = f->len - hlen;
+  z = Malloc(blen);
+  if ((zlen = gzip_deflate(resp + hlen, blen, cache->gzip_level, z,
+                           blen - blen / 8)) &&
+      (obj = obj_alloc(f->key, f->keylen, f->hash, hlen + zlen))) {
+    memcpy(obj->data, resp, hlen);
+    memcpy(obj->data + hlen, z, zlen);
+    obj->plain = f->len;
+  }
+  STAT_ADD(deflate_us, gzip_cpu_us() - t);
+  free(resp);
+  free(z);
+  return obj;
+}
+
+/*
+ * cache_fill_finish - the leader is done with f.  If ok, the response
+ *     is complete and, if small enough, cached; otherwise the fetch
+ *     failed or was given up, and followers that have not sent anything
+ *     yet should fetch for themselves.
+ */
+void cache_fill_finish(cache_fill_t *f, int ok)
+{
+  cache_obj_t *obj;
+
+  if (ok && f->len <= cache->max_object &&
+      ((obj = fill_gzip(f)) ||
+       (obj = obj_alloc(f->key, f->keylen, f->hash, f->len)))) {
+    if (!obj->plain)
+      fill_copy(f, obj->data);
+    obj->expires = f->expires;
+    obj->stale_until = f->stale_until;
+    obj_publish(obj);
+  }
+  if (f->refresh)
+    __atomic_sub_fetch(&cache->refreshing, 1, __ATOMIC_RELAXED);
+  fill_notify(f, ok ? CACHE_FILLED : CACHE_FILL_FAILED);
+  cache_fill_release(f);
+}
+
+/*
+ * cache_fill_read - returns how many response bytes past cur->pos are
+ *     available in one piece, pointing *p at them, and advances cur.
+ */
+size_t cache_fill_read(cache_fill_t *f, struct cache_cursor *cur,
+                       const char **p)
+{
+  size_t len = __atomic_load_n(&f->len, __ATOMIC_ACQUIRE), off, n;
+
+  if (cur->pos == len)
+    return 0;
+  off = cur->pos % FILL_CHUNK;
+  if (!cur->chunk)
+    cur->chunk = f->head;
+  else if (off == 0)
+    cur->chunk = ((struct fill_chunk *)cur->chunk)->next;
+  n = len - cur->pos < FILL_CHUNK - off ? len - cur->pos : FILL_CHUNK - off;
+  *p = ((struct fill_chunk *)cur->chunk)->data + off;
+  cur->pos += n;
+  return n;
+}
+
+int cache_fill_state(cache_fill_t *f)
+{
+  return __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+}
+
+/* Changes whenever f has more data or a new state */
+unsigned cache_fill_seq(cache_fill_t *f)
+{
+  return __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+}
+
+/* A leader in another process that died leaves its fill running forever */
+static int fill_orphaned(cache_fill_t *f)
+{
+  return cache->shared && f->pid != getpid() && kill(f->pid, 0) < 0 &&
+         errno == ESRCH;
+}
+
+/* Blocks until f's sequence number moves on from seq */
+void cache_fill_wait(cache_fill_t *f, unsigned seq)
+{
+  struct timespec ts = { 1, 0 };
+
+  __atomic_add_fetch(&f->sleepers, 1, __ATOMIC_ACQ_REL);
+  while (cache_fill_seq(f) == seq) {
+    if (syscall(SYS_futex, &f->seq, FUTEX_WAIT, seq, &ts, NULL, 0) < 0 &&
+        errno == ETIMEDOUT && fill_orphaned(f) &&
+        __atomic_exchange_n(&f->pid, 0, __ATOMIC_ACQ_REL) != 0)
+      cache_fill_finish(f, 0);          /* for the dead leader */
+  }
+  __atomic_sub_fetch(&f->sleepers, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Has w->fd written to whenever f changes */
+void cache_fill_watch(cache_fill_t *f, struct cache_waiter *w)
+{
+  fill_lock(f);
+  w->next = f->waiters;
+  f->waiters = w;
+  fill_unlock(f);
+}
+
+/*
+ * cache_fill_leave - a follower is done with f: stops watching it with
+ *     w (if not NULL) and drops its reference.  served says whether
+ *     its response came from the fill, for the hit and miss counts.
+ */
+void cache_fill_leave(cache_fill_t *f, struct cache_waiter *w, int served)
+{
+  struct cache_waiter **pp;
+
+  if (w) {
+    fill_lock(f);
+    for (pp = &f->waiters; *pp; pp = &(*pp)->next)
+      if (*pp == w) {
+        *pp = w->next;
+        break;
+      }
+    fill_unlock(f);
+  }
+  STAT_ADD(hits, served != 0);
+  STAT_ADD(misses, served == 0);
+  cache_fill_release(f);
+}
+
+static void cache_fill_release(cache_fill_t *f)
+{
+  struct fill_chunk *ck;
+
+  if (__atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  while ((ck = f->head)) {
+    f->head = ck->next;
+    cache_mem_free(ck);
+  }
+  pthread_mutex_destroy(&f->lock);
+  cache_mem_free(f);
+}
+
+/* cache_revalidated - count a stale copy that a 304 made fresh again */
+void cache_revalidated(void)
+{
+  STAT_ADD(revalidated, 1);
+}
+
+/* cache_not_modified - count a 304 sent from the cache to a client */
+void cache_not_modified(void)
+{
+  STAT_ADD(not_modified, 1);
+}
+
+/* cache_partial - count a Range request answered from the cache */
+void cache_partial(void)
+{
+  STAT_ADD(partial, 1);
+}
+
+/* Hashes "host:port" with the host's case folded */
+static unsigned long origin_hash(const char *host, const char *port)
+{
+  char key[MAXLINE], *p;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  for (p = key; *p != ':'; p++)
+    *p = tolower((unsigned char)*p);
+  return cache_hash(key, strlen(key));
+}
+
+/*
+ * cache_origin_failed - remember that host:port could not be resolved
+ *     or connected to, for ttl seconds
+ */
+void cache_origin_failed(const char *host, const char *port, int ttl)
+{
+  unsigned long h = origin_hash(host, port);
+
+  if (ttl <= 0)
+    return;
+  __atomic_store_n(&cache->down[h % ORIGIN_SLOTS],
+                   (h & ~0xffffffffUL) | (unsigned)(time(NULL) + ttl),
+                   __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_origin_down - whether host:port failed within the ttl it was
+ *     given; cache_origin_failed() for a newer failure of another
+ *     origin in the same slot forgets it early
+ */
+int cache_origin_down(const char *host, const char *port)
+{
+  unsigned long h = origin_hash(host, port), v;
+
+  v = __atomic_load_n(&cache->down[h % ORIGIN_SLOTS], __ATOMIC_RELAXED);
+  return v && (v & ~0xffffffffUL) == (h & ~0xffffffffUL) &&
+         (unsigned)v > (unsigned)time(NULL);
+}
+
+/* cache_negative - count a request answered by a remembered failure */
+void cache_negative(void)
+{
+  STAT_ADD(negative, 1);
+}
+
+/* cache_inflated - count us of CPU time spent inflating a gzipped hit */
+void cache_inflated(long us)
+{
+  STAT_ADD(inflate_us, us);
+}
+
+void cache_get_stats(struct cache_stats *st)
+{
+  st->hits = __atomic_load_n(&cache->stats.hits, __ATOMIC_RELAXED);
+  st->misses = __atomic_load_n(&cache->stats.misses, __ATOMIC_RELAXED);
+  st->collapsed = __atomic_load_n(&cache->stats.collapsed, __ATOMIC_RELAXED);
+  st->inserts = __atomic_load_n(&cache->stats.inserts, __ATOMIC_RELAXED);
+  st->evictions = __atomic_load_n(&cache->stats.evictions, __ATOMIC_RELAXED);
+  st->expired = __atomic_load_n(&cache->stats.expired, __ATOMIC_RELAXED);
+  st->revalidated = __atomic_load_n(&cache->stats.revalidated,
+                                    __ATOMIC_RELAXED);
+  st->not_modified = __atomic_load_n(&cache->stats.not_modified,
+                                     __ATOMIC_RELAXED);
+  st->served_stale = __atomic_load_n(&cache->stats.served_stale,
+                                     __ATOMIC_RELAXED);
+  st->refreshes = __atomic_load_n(&cache->stats.refreshes, __ATOMIC_RELAXED);
+  st->partial = __atomic_load_n(&cache->stats.partial, __ATOMIC_RELAXED);
+  st->negative = __atomic_load_n(&cache->stats.negative, __ATOMIC_RELAXED);
+  st->gzipped = __atomic_load_n(&cache->stats.gzipped, __ATOMIC_RELAXED);
+  st->gzip_saved = __atomic_load_n(&cache->stats.gzip_saved, __ATOMIC_RELAXED);
+  st->deflate_us = __atomic_load_n(&cache->stats.deflate_us, __ATOMIC_RELAXED);
+  st->inflate_us = __atomic_load_n(&cache->stats.inflate_us, __ATOMIC_RELAXED);
+  st->purged = __atomic_load_n(&cache->stats.purged, __ATOMIC_RELAXED);
+  st->bans = __atomic_load_n(&cache->stats.bans, __ATOMIC_RELAXED);
+  st->banned = __atomic_load_n(&cache->stats.banned, __ATOMIC_RELAXED);
+  st->objects = __atomic_load_n(&cache->stats.objects, __ATOMIC_RELAXED);
+  st->bytes = __atomic_load_n(&cache->stats.bytes, __ATOMIC_RELAXED);
+  st->since = cache->started;
+}
@@ -0,0 +1,150 @@
+/*
+ * cache.h - in-memory web object cache shared by all connections
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include <time.h>
+
+/* Proxy Lab defaults for the total budget and the per-object cap */
+#define MAX_CACHE_SIZE  1049000
+#define MAX_OBJECT_SIZE 102400
+
+/*
+ * A cached response.  data holds the whole response as received from
+ * the origin (status line, headers and body), or, if plain is set, the
+ * head as received and the body gzipped (see cache_gzip()).  The
+ * struct, key and data are one allocation, except for objects adopted
+ * from a snapshot, whose data stays in the snapshot's mapping.  An
+ * object is immutable once inserted and is freed when the last
+ * reference is released.
+ */
+typedef struct cache_obj {
+  char *key;                      /* normalized "host:port/path" */
+  size_t keylen;
+  unsigned long hash;
+  char *data;
+  size_t size;
+  size_t plain;                   /* size ungzipped if gzipped, else 0 */
+  int status;                     /* the response's, read when published */
+  int refcnt;                     /* the cache's own reference + readers */
+  unsigned policy_gen;            /* tracked if it matches the cache's */
+  unsigned char queue;            /* policy's list holding it */
+  unsigned char ref;              /* hit bits, set without the policy lock */
+  unsigned char unindexed;        /* kept out of the URL index */
+  unsigned hits;                  /* lookups it answered, for cache_hottest() */
+  unsigned long bans;             /* bans it has been checked against */
+  unsigned long verify;           /* checksum to check on first hit, or 0 */
+  time_t expires;                 /* stale from then on, 0 = never */
+  time_t stale_until;             /* then may still be sent while refreshed */
+  struct cache_obj *prev, *next;  /* policy's list links */
+} cache_obj_t;
+
+/*
+ * A response being fetched for the cache.  Concurrent misses for the
+ * same key join it instead of going to the origin themselves, and read
+ * the response from it while it downloads.  Opaque outside cache.c.
+ */
+typedef struct cache_fill cache_fill_t;
+
+/* A non-blocking follower's wakeup: the fill writes 1 to fd on change */
+struct cache_waiter {
+  int fd;                         /* eventfd */
+  struct cache_waiter *next;
+};
+
+/* A follower's read position in a fill */
+struct cache_cursor {
+  size_t pos;                     /* bytes read so far */
+  void *chunk;                    /* chunk holding pos, private */
+};
+
+/* Results of cache_join() */
+#define CACHE_MISS   0            /* fetch without caching */
+#define CACHE_HIT    1            /* *hit is the cached object */
+#define CACHE_LEAD   2            /* fetch into *fill, then finish it;
+                                     revalidate *hit, a stale copy, if set */
+#define CACHE_FOLLOW 3            /* stream the response from *fill */
+#define CACHE_STALE  4            /* *hit is stale but may be sent; then
+                                     refresh it into *fill, if set */
+
+/* States of a fill */
+#define CACHE_FILLING     0
+#define CACHE_FILLED      1       /* complete; the whole response is there */
+#define CACHE_FILL_FAILED 2       /* given up; fetch it yourself */
+
+/* Counters, updated atomically */
+struct cache_stats {
+  long hits;
+  long misses;
+  long collapsed;                 /* misses that joined another's fetch */
+  long inserts;
+  long evictions;
+  long expired;                   /* lookups that found only a stale copy */
+  long revalidated;               /* stale copies the origin said still do */
+  long not_modified;              /* 304s sent to conditional requests */
+  long served_stale;              /* stale copies sent while refreshed */
+  long refreshes;                 /* background refreshes started */
+  long partial;                   /* 206s and 416s sent from the cache */
+  long negative;                  /* errors and failed origins answered
+                                     from the cache */
+  long gzipped;                   /* objects stored gzipped */
+  long gzip_saved;                /* bytes gzip saves on those */
+  long deflate_us;                /* CPU time spent gzipping */
+  long inflate_us;                /* and ungzipping */
+  long purged;                    /* objects removed by cache_purge() and
+                                     cache_purge_prefix() */
+  long bans;                      /* bans added */
+  long banned;                    /* objects they dropped */
+  long objects;
+  long bytes;
+  time_t since;                   /* when counting started */
+};
+
+void cache_init(size_t capacity, size_t max_object, int shared,
+                const char *policy);
+int cache_enabled(void);
+size_t cache_max_object(void);
+cache_obj_t *cache_lookup(const char *key);
+void cache_insert(const char *key, const char *data, size_t size);
+void cache_store(const char *key, const char *data, size_t size,
+                 time_t expires, time_t stale_until);
+int cache_adopt(const char *key, const char *data, size_t size,
+                size_t plain, unsigned long sum, time_t expires,
+                time_t stale_until);
+void cache_walk(int (*fn)(cache_obj_t *obj, void *arg), void *arg);
+void cache_release(cache_obj_t *obj);
+int cache_purge(const char *key);
+long cache_purge_prefix(const char *prefix);
+int cache_usage(const char *prefix, long *objects, long *bytes);
+void cache_url_index(int on);
+int cache_ban(const char *pattern, int regex);
+unsigned long cache_bans(void);
+int cache_banned(const char *key, unsigned long seen);
+int cache_hottest(cache_obj_t **top, int n);
+int cache_join(const char *key, cache_obj_t **hit, cache_fill_t **fill);
+int cache_fill_fits(size_t size);
+void cache_refresh_limit(int max);
+void cache_gzip(int level);
+void cache_origin_failed(const char *host, const char *port, int ttl);
+int cache_origin_down(const char *host, const char *port);
+void cache_fill_expires(cache_fill_t *f, time_t expires, time_t stale_until);
+int cache_fill_append(cache_fill_t *f, const char *data, size_t n);
+void cache_fill_finish(cache_fill_t *f, int ok);
+size_t cache_fill_read(cache_fill_t *f, struct cache_cursor *cur,
+                       const char **p);
+int cache_fill_state(cache_fill_t *f);
+unsigned cache_fill_seq(cache_fill_t *f);
+void cache_fill_wait(cache_fill_t *f, unsigned seq);
+void cache_fill_watch(cache_fill_t *f, struct cache_waiter *w);
+void cache_fill_leave(cache_fill_t *f, struct cache_waiter *w, int served);
+void cache_revalidated(void);
+void cache_not_modified(void);
+void cache_partial(void);
+void cache_negative(void);
+void cache_inflated(long us);
+void cache_get_stats(struct cache_stats *st);
+unsigned long cache_hash(const char *key, size_t len);
+
+#endif /* __CACHE_H__ */
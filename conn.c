@@ -0,0 +1,1755 @@
+/*
+ * conn.c - per-connection state machine for the proxy
+ *
+ * See conn.h.  The request is read into ibuf until the blank line,
+ * rewritten into obuf (HTTP/1.0, Connection: close, our User-Agent)
+ * and sent upstream.  The response is then read back into ibuf and
+ * handed to the client chunk by chunk; while output is pending we do
+ * not read more, so each connection holds at most two MAXBUF buffers
+ * and idle connections hold none.
+ *
+ * A GET is first looked up in the object cache; a hit is answered
+ * straight from the cached bytes without contacting the origin.  A
+ * miss in memory is looked up in the disk tier next.  On a miss, a 200
+ * response is copied into a cache fill as it is relayed and cached when
+ * the origin closes the connection, if small enough and if its headers
+ * allow it (http.c), until it goes stale.
+ * Misses for an object that is already being fetched follow that fill
+ * instead, sending its bytes as they arrive.  If the fill is given up
+ * before a follower has sent anything, it goes to the origin itself.
+ *
+ * PURGE, BAN and GET /__cache from the proxy's own host administer
+ * the cache instead of going anywhere (conn_admin()).
+ *
+ * Once the headers are out, a body that nothing else needs to see is
+ * moved with splice() through a pipe instead of being copied through
+ * ibuf.  Pipes are kept in a small per-thread pool so each response
+ * does not pay for pipe() and the close of both ends.
+ */
+#define _GNU_SOURCE             /* splice */
+#include "conn.h"
+#include "http.h"
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+
+static const char *user_agent_hdr =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
+    "Firefox/10.0.3\r\n";
+
+static void conn_request(conn_t *c);
+static void conn_error(conn_t *c, char *cause, char *errnum, char *shortmsg,
+                       char *longmsg);
+static int conn_connect(conn_t *c);
+static void pipe_put(conn_t *c);
+static void fill_abort(conn_t *c);
+static void conn_follow(conn_t *c);
+static void conn_unfollow(conn_t *c, int served);
+static int oappend(conn_t *c, const char *fmt, ...);
+static int add_validators(conn_t *c);
+static void conn_send_hit(conn_t *c);
+static int conn_range(conn_t *c);
+static int conn_admin(conn_t *c, char *method, char *uri);
+
+#define PIPE_POOL 16            /* idle relay pipes kept per thread */
+#define SPLICE_CHUNK (64 * 1024)
+
+static __thread int pipe_pool[PIPE_POOL][2];
+static __thread int pipe_pooled;
+
+conn_t *conn_new(int cfd, int nonblock)
+{
+  conn_t *c = Calloc(1, sizeof(conn_t));
+  c->cfd = cfd;
+  c->ufd = -1;
+  c->state = CS_READ_REQ;
+  c->nonblock = nonblock;
+  c->pipefd[0] = c->pipefd[1] = -1;
+  c->wakefd = -1;
+  c->disk.fd = -1;
+  return c;
+}
+
+/* Closes both sockets and releases the buffers */
+void conn_free(conn_t *c)
+{
+  pipe_put(c);
+  fill_abort(c);
+  if (c->follow)
+    conn_unfollow(c, c->cursor.pos > 0);
+  if (c->resolve)
+    resolve_release(c->resolve);
+  if (c->ai)
+    freeaddrinfo(c->ai);
+  if (c->wakefd >= 0)
+    close(c->wakefd);
+  if (c->hit)
+    cache_release(c->hit);
+  disk_release(&c->disk);
+  free(c->key);
+  free(c->cond);
+  free(c->parts);
+  free(c->plain);
+  if (c->gz)
+    gzip_close(c->gz);
+  if (c->seg.head)
+    cache_release(c->seg.head);
+  while (c->seg.n > 0)
+    cache_release(c->seg.objs[--c->seg.n]);
+  free(c->seg.buf);
+  if (c->ufd >= 0)
+    close(c->ufd);
+  if (c->cfd >= 0)
+    close(c->cfd);
+  free(c->ibuf);
+  free(c->obuf);
+  free(c);
+}
+
+int conn_want(conn_t *c)
+{
+  switch (c->state) {
+  case CS_READ_REQ:
+    return CW_READ_CLIENT;
+  case CS_CONNECT:
+    return CW_CONNECT;
+  case CS_FOLLOW:
+    return c->olen ? CW_WRITE_CLIENT : CW_WAIT_FILL;
+  case CS_SEND_REQ:
+    return CW_WRITE_UPSTREAM;
+  case CS_RESP_HDRS:
+    return c->olen ? CW_WRITE_CLIENT : CW_READ_UPSTREAM;
+  case CS_RELAY_BODY:
+    if (c->olen)
+      return CW_WRITE_CLIENT;
+    return c->can_splice && !c->lead && !c->seg.fetch ? CW_SPLICE :
+                                                        CW_READ_UPSTREAM;
+  case CS_DISK:
+    if (c->olen)
+      return CW_WRITE_CLIENT;
+    if (!c->disk.len)
+      return CW_DONE;
+    return c->can_sendfile ? CW_SENDFILE : CW_READ_DISK;
+  case CS_FLUSH:
+    return c->olen ? CW_WRITE_CLIENT : CW_DONE;
+  default:
+    return CW_DONE;
+  }
+}
+
+/* Returns where the engine should read to; ibuf is allocated lazily */
+char *conn_rbuf(conn_t *c, size_t *room)
+{
+  if (!c->ibuf)
+    c->ibuf = Malloc(MAXBUF);
+  *room = MAXBUF - 1 - c->ilen; /* keep a byte for the terminator */
+  if (c->state == CS_DISK && *room > c->disk.len)
+    *room = c->disk.len;
+  return c->ibuf + c->ilen;
+}
+
+/* Returns the length of the header block in buf, or 0 if incomplete */
+static size_t header_end(char *buf, size_t len)
+{
+  char *p;
+
+  buf[len] = '\0';
+  if ((p = strstr(buf, "\r\n\r\n")))
+    return p - buf + 4;
+  if ((p = strstr(buf, "\n\n")))
+    return p - buf + 2;
+  return 0;
+}
+
+/* Stops copying the response for the cache; followers fetch themselves */
+static void fill_abort(conn_t *c)
+{
+  if (c->lead) {
+    cache_fill_finish(c->lead, 0);
+    c->lead = NULL;
+  }
+}
+
+/* Appends relayed response bytes to the fill */
+static void fill_append(conn_t *c, char *data, size_t n)
+{
+  if (c->lead && !cache_fill_append(c->lead, data, n))
+    fill_abort(c);
+}
+
+/* The origin closed the connection: the fill is complete */
+static void fill_finish(conn_t *c)
+{
+  if (c->lead) {
+    cache_fill_finish(c->lead, 1);
+    c->lead = NULL;
+  }
+}
+
+/* Errors the origin is likely to repeat for a while */
+static int negative_status(int status)
+{
+  return status == 404 || status == 410 || (status >= 500 && status <= 504);
+}
+
+/* Complete 200 responses are worth keeping, and errors for a while (-e) */
+static int cacheable_status(char *resp, size_t hlen)
+{
+  int status = http_status(resp, hlen);
+
+  return status == 200 || (negative_status(status) && config.negative_ttl > 0);
+}
+
+/* Returns the Content-Length of a terminated header block, or -1 */
+static long content_length(char *hdrs)
+{
+  const char *v;
+  size_t len;
+
+  return (v = http_header(hdrs, "Content-Length", &len)) ? atol(v) : -1;
+}
+
+/*
+ * Whether a response with head hdrs, hlen bytes, may be cached by c's
+ * fill: a shared cache may store it, and it is fresh or can be
+ * revalidated.  Tells the fill when it goes stale, and for how long
+ * after that it may be served while it is refreshed.  An error is kept
+ * for at most config.negative_ttl, and never served stale.
+ */
+static int fill_storable(conn_t *c, const char *hdrs, size_t hlen)
+{
+  time_t now = time(NULL);
+  struct http_fresh f;
+
+  http_freshness(hdrs, now, config.default_ttl, config.stale_window, &f);
+  if (negative_status(http_status(hdrs, hlen))) {
+    if (f.expires > now + config.negative_ttl)
+      f.expires = now + config.negative_ttl;
+    f.stale_until = f.expires;
+  }
+  if (!f.storable || (f.expires <= now && !http_has_validator(hdrs)))
+    return 0;
+  cache_fill_expires(c->lead, f.expires, f.stale_until);
+  return 1;
+}
+
+/*
+ * Whether the response whose hlen-byte head is in ibuf should go
+ * through c's fill: a storable 200 that fits.
+ */
+static int fill_wanted(conn_t *c, size_t hlen)
+{
+  long len = content_length(c->ibuf);
+
+  return cacheable_status(c->ibuf, hlen) &&
+         (len < 0 || cache_fill_fits(hlen + len)) &&
+         fill_storable(c, c->ibuf, hlen);
+}
+
+/*
+ * Sends a 304 for the cached response head resp, of a response with
+ * status status, if the client's request was conditional and it
+ * satisfies it.  The 304 is built in ibuf, whose request was copied
+ * out into obuf and c->cond already.  Returns 0 if the client is to get
+ * the response itself.
+ */
+static int conn_not_modified(conn_t *c, int status, const char *resp)
+{
+  if (!c->cond || status != 200 ||
+      !http_not_modified(c->cond, resp) ||
+      !(c->olen = http_not_modified_head(resp, c->ibuf, MAXBUF)))
+    return 0;
+  c->optr = c->ibuf;
+  c->state = CS_FLUSH;
+  cache_not_modified();
+  return 1;
+}
+
+/* Whether the client asked for a Range */
+static int conn_range(conn_t *c)
+{
+  size_t len;
+
+  return c->cond && http_header(c->cond, "Range", &len);
+}
+
+/*
+ * Answers a Range request from a cached response with status status,
+ * head head and blen bytes of body at body, if it is a 200: a 206 for
+ * one range or several (multipart, built in c->parts), or a 416 if
+ * none is satisfiable.  The head is built in ibuf, as
+ * conn_not_modified() does.  Returns 0 if the whole response is to be
+ * sent instead.
+ */
+static int conn_partial(conn_t *c, int status, const char *head, char *body,
+                        size_t blen)
+{
+  struct http_range r[HTTP_MAX_RANGES];
+  char boundary[64];
+  const char *v;
+  size_t len;
+  int n;
+
+  if (!c->cond || !(v = http_header(c->cond, "Range", &len)) ||
+      status != 200 || !http_if_range(c->cond, head) ||
+      (n = http_ranges(v, len, blen, r)) < 0)
+    return 0;
+  if (n == 0) {
+    c->olen = http_unsatisfiable_head(blen, c->ibuf, MAXBUF);
+  } else if (n == 1) {
+    c->then = body + r->first;
+    c->then_len = r->last - r->first + 1;
+    c->olen = http_partial_head(head, r, 1, blen, NULL, c->then_len, c->ibuf,
+                                MAXBUF);
+  } else {
+    snprintf(boundary, sizeof(boundary), "proxy-%lx-%lx",
+             (unsigned long)time(NULL), (unsigned long)c);
+    c->then = c->parts = http_byteranges(head, body, blen, r, n, boundary,
+                                         &c->then_len);
+    c->olen = http_partial_head(head, r, n, blen, boundary, c->then_len,
+                                c->ibuf, MAXBUF);
+  }
+  if (!c->olen) {
+    c->then_len = 0;
+    return 0;
+  }
+  c->optr = c->ibuf;
+  cache_partial();
+  return 1;
+}
+
+/*
+ * conn_send_cached - send a cached response with status status, its
+ *     head hlen bytes at head and its body blen bytes at body: as a 304
+ *     to a conditional request it satisfies, as a 206 or 416 to a Range
+ *     request, or whole.
+ */
+static void conn_send_cached(conn_t *c, int status, char *head, size_t hlen,
+                             char *body, size_t blen)
+{
+  c->state = CS_FLUSH;
+  if (conn_not_modified(c, status, head) ||
+      conn_partial(c, status, head, body, blen))
+    return;
+  c->optr = head;
+  if (body == head + hlen) {
+    c->olen = hlen + blen;
+    return;
+  }
+  c->olen = hlen;
+  c->then = body;
+  c->then_len = blen;
+}
+
+/*
+ * Points *body at the body of the cached object obj, whose head is hlen
+ * bytes, and sets *blen, inflating a gzipped one whole into c->plain.
+ * Returns 0 if it does not inflate.
+ */
+static int conn_plain_body(conn_t *c, cache_obj_t *obj, size_t hlen,
+                           char **body, size_t *blen)
+{
+  long t;
+  int ok;
+
+  *body = obj->data + hlen;
+  *blen = obj->size - hlen;
+  if (!obj->plain)
+    return 1;
+  t = gzip_cpu_us();
+  free(c->plain);
+  c->plain = Malloc(obj->plain - hlen);
+  ok = gzip_inflate(*body, *blen, c->plain, obj->plain - hlen);
+  cache_inflated(gzip_cpu_us() - t);
+  *body = c->plain;
+  *blen = obj->plain - hlen;
+  return ok;
+}
+
+/* Inflates the next piece of the gzipped body being sent into ibuf */
+static void conn_inflate(conn_t *c)
+{
+  long t = gzip_cpu_us();
+  ssize_t n = gzip_read(c->gz, c->ibuf, MAXBUF);
+
+  cache_inflated(gzip_cpu_us() - t);
+  if (n > 0) {
+    c->then = c->ibuf;
+    c->then_len = n;
+    return;
+  }
+  gzip_close(c->gz);
+  c->gz = NULL;
+  if (n < 0)
+    c->state = CS_DONE;         /* the client sees it by the length */
+}
+
+/*
+ * Sends the cached object in c->hit.  A gzipped body goes as it is to
+ * a client that takes gzip, inflated whole to a Range request, and
+ * otherwise inflated a buffer at a time after the stored head.
+ */
+static void conn_send_hit(conn_t *c)
+{
+  cache_obj_t *obj = c->hit;
+  size_t hlen = http_head_len(obj->data, obj->size), blen;
+  char *body;
+
+  if (obj->status != 200)
+    cache_negative();
+
+  if (!obj->plain) {
+    conn_send_cached(c, obj->status, obj->data, hlen, obj->data + hlen,
+                     obj->size - hlen);
+    return;
+  }
+  c->state = CS_FLUSH;
+  if (conn_not_modified(c, obj->status, obj->data))
+    return;
+  if (conn_range(c)) {
+    if (conn_plain_body(c, obj, hlen, &body, &blen))
+      conn_send_cached(c, obj->status, obj->data, hlen, body, blen);
+    else
+      c->state = CS_DONE;
+    return;
+  }
+  if (c->cond && http_accepts_gzip(c->cond) &&
+      (c->olen = http_gzip_head(obj->data, obj->size - hlen, c->ibuf,
+                                MAXBUF))) {
+    c->optr = c->ibuf;
+    c->then = obj->data + hlen;
+    c->then_len = obj->size - hlen;
+    return;
+  }
+  if (!(c->gz = gzip_open(obj->data + hlen, obj->size - hlen))) {
+    c->state = CS_DONE;
+    return;
+  }
+  c->optr = obj->data;
+  c->olen = hlen;
+  conn_inflate(c);
+}
+
+/* Queues the n response bytes at ibuf for the client; a refresh has none */
+static void conn_relay(conn_t *c, size_t n)
+{
+  if (c->detached) {
+    c->ilen = 0;
+    if (!c->lead)
+      c->state = CS_DONE;       /* not for the cache: stop fetching */
+    return;
+  }
+  c->optr = c->ibuf;
+  c->olen = n;
+}
+
+/*
+ * conn_revalidated - the origin answered our revalidation of the stale
+ *     copy in c->hit with the 304 head of hlen bytes in ibuf.  Sends the
+ *     copy with its head updated from the 304 (or a 304, if the client
+ *     asked conditionally and that fits), and caches the updated copy
+ *     through the fill in place of the stale one.
+ */
+static void conn_revalidated(conn_t *c)
+{
+  cache_obj_t *obj = c->hit;
+  size_t shlen = http_head_len(obj->data, obj->size), len, blen;
+  char *head = c->obuf, *body;
+
+  if (!conn_plain_body(c, obj, shlen, &body, &blen)) {
+    fill_abort(c);
+    c->state = CS_DONE;
+    return;
+  }
+
+  /* The request in obuf is sent; keep the stored head if it outgrows it */
+  if (!(len = http_refresh(obj->data, c->ibuf, c->obuf, MAXBUF))) {
+    head = obj->data;
+    len = shlen;
+  }
+  cache_revalidated();
+  if (c->lead && fill_storable(c, head, len)) {
+    fill_append(c, head, len);
+    fill_append(c, body, blen);
+    fill_finish(c);
+  }
+  fill_abort(c);
+  if (c->detached)
+    c->state = CS_DONE;
+  else
+    conn_send_cached(c, obj->status, head, len, body, blen);
+}
+
+/*
+ * conn_prefetch - the client of a Range request that missed has its
+ *     part of the object.  Lets it go and fetches the whole object for
+ *     the cache, in the background, unless it is cached or being
+ *     fetched by now; a stale copy is revalidated.
+ */
+static void conn_prefetch(conn_t *c)
+{
+  cache_fill_t *fill;
+  int rc;
+
+  c->prefetch = 0;
+  shutdown(c->cfd, SHUT_RDWR);
+  c->detached = 1;
+  pipe_put(c);
+  close(c->ufd);
+  c->ufd = -1;
+  c->ufd_gen++;
+  c->ilen = 0;
+  c->state = CS_DONE;
+  rc = cache_join(c->key, &c->hit, &fill);
+  if (rc == CACHE_FOLLOW)
+    cache_fill_leave(fill, NULL, 0);
+  c->lead = rc == CACHE_FOLLOW ? NULL : fill;
+  if (c->lead && disk_lookup(c->key, &c->disk))
+    disk_release(&c->disk);     /* on disk already */
+  else if (c->lead)
+    c->state = CS_CONNECT;
+  if (c->state != CS_CONNECT) {
+    fill_abort(c);
+    return;
+  }
+  if (c->hit && !http_has_validator(c->hit->data)) {
+    cache_release(c->hit);
+    c->hit = NULL;
+  }
+  /* The request without the client's Range and conditionals */
+  c->olen = c->reqlen;
+  if ((c->hit && add_validators(c)) || oappend(c, "\r\n")) {
+    fill_abort(c);
+    c->state = CS_DONE;
+  }
+}
+
+/* Size of the segments large objects are cached in, or 0 for none */
+static size_t segment_size(void)
+{
+  size_t max = cache_max_object();
+
+  return config.segment_size < max ? config.segment_size : max;
+}
+
+/*
+ * Writes the key of segment n of c's object to key (size bytes), or of
+ * its head entry if n < 0.  Segment keys carry the object's validator
+ * and size, so that segments of different versions never mix.
+ */
+static void segment_key(conn_t *c, long n, char *key, size_t size)
+{
+  const char *v = NULL;
+  size_t len = 0;
+  unsigned long version;
+
+  if (n < 0) {
+    snprintf(key, size, "%s#h", c->key);
+    return;
+  }
+  if (!(v = http_header(c->seg.head->data, "ETag", &len)))
+    v = http_header(c->seg.head->data, "Last-Modified", &len);
+  version = cache_hash(v ? v : "", len) ^ c->seg.total;
+  snprintf(key, size, "%s#%lx.%ld", c->key, version, n);
+}
+
+/*
+ * Remembers the head of an object too large to cache whole from its 200
+ * or 206 response head in ibuf, so that Range requests for it are then
+ * answered from segments.  Returns 1 if the object is that large.
+ */
+static int segment_learn(conn_t *c)
+{
+  char key[MAXLINE + 32], head[MAXBUF];
+  size_t first, last, total, hlen;
+  time_t now = time(NULL);
+  struct http_fresh f;
+  long len;
+
+  if (http_status(c->ibuf, c->ilen) == 206 &&
+      http_content_range(c->ibuf, &first, &last, &total))
+    ;
+  else if (http_status(c->ibuf, c->ilen) == 200 &&
+           (len = content_length(c->ibuf)) >= 0)
+    total = len;
+  else
+    return 0;
+  if (total <= cache_max_object())
+    return 0;
+  http_freshness(c->ibuf, now, config.default_ttl, config.stale_window, &f);
+  if (segment_size() && f.storable && f.expires > now &&
+      (hlen = http_full_head(c->ibuf, total, head, sizeof(head)))) {
+    segment_key(c, -1, key, sizeof(key));
+    cache_store(key, head, hlen, f.expires, f.stale_until);
+  }
+  return 1;
+}
+
+/*
+ * conn_segments - answer a Range request for an object cached in
+ *     segments.  Sends the run of cached segments (at most CONN_SEGS)
+ *     that the range starts in and returns 1; if the first of them is
+ *     not cached, sets up c->seg to fetch it and returns 0.  Also
+ *     returns 0 if the object has no head entry, or the Range is not a
+ *     single satisfiable range that applies to it.
+ */
+static int conn_segments(conn_t *c)
+{
+  struct http_range r[HTTP_MAX_RANGES];
+  struct conn_seg *sg = &c->seg;
+  char key[MAXLINE + 32];
+  cache_obj_t *obj;
+  const char *v;
+  size_t len, end;
+  long i;
+
+  if (!(sg->size = segment_size()))
+    return 0;
+  segment_key(c, -1, key, sizeof(key));
+  if (!(sg->head = cache_lookup(key)))
+    return 0;
+  sg->total = content_length(sg->head->data);
+  v = http_header(c->cond, "Range", &len);
+  if (!http_if_range(c->cond, sg->head->data) ||
+      http_ranges(v, len, sg->total, r) != 1)
+    return 0;
+  sg->pos = r->first;
+  sg->last = r->last;
+  sg->at = sg->pos - sg->pos % sg->size;
+  for (i = sg->at / sg->size; sg->n < CONN_SEGS &&
+       (size_t)i * sg->size <= sg->last; i++) {
+    segment_key(c, i, key, sizeof(key));
+    if (!(obj = cache_lookup(key)))
+      break;
+    sg->objs[sg->n++] = obj;
+  }
+  end = (size_t)i * sg->size - 1;       /* of what is cached */
+  if (sg->n == 0) {
+    end += sg->size;                    /* of the one segment to fetch */
+    sg->fetch = 1;
+  }
+  if (sg->last > end)
+    sg->last = end;
+  if (sg->fetch)
+    return 0;
+  r->first = sg->pos;
+  r->last = sg->last;
+  if (!(c->olen = http_partial_head(sg->head->data, r, 1, sg->total, NULL,
+                                    sg->last - sg->pos + 1, c->ibuf,
+                                    MAXBUF))) {
+    while (sg->n > 0)
+      cache_release(sg->objs[--sg->n]);
+    return 0;
+  }
+  c->optr = c->ibuf;
+  c->state = CS_FLUSH;
+  cache_partial();
+  return 1;
+}
+
+/* Queues the next cached segment of the range for the client */
+static void segment_next(conn_t *c)
+{
+  struct conn_seg *sg = &c->seg;
+  cache_obj_t *obj = sg->objs[sg->i++];
+  size_t off = sg->pos - sg->at;
+
+  c->optr = obj->data + off;
+  c->olen = obj->size - off;
+  if (c->olen > sg->last + 1 - sg->pos)
+    c->olen = sg->last + 1 - sg->pos;
+  sg->pos += c->olen;
+  sg->at += sg->size;
+}
+
+/*
+ * Whether the response whose hlen-byte head is in ibuf is the segment
+ * that c->seg asked for, of the same version, and may be cached; if so
+ * puts the client's 206 head in obuf (the request is sent) to go first.
+ */
+static int segment_start(conn_t *c, size_t hlen)
+{
+  struct conn_seg *sg = &c->seg;
+  size_t first, last, total, end, len;
+  struct http_range r;
+  const char *v, *w;
+  struct http_fresh f;
+  time_t now = time(NULL);
+
+  end = sg->at + sg->size < sg->total ? sg->at + sg->size : sg->total;
+  if (!hlen || http_status(c->ibuf, hlen) != 206 ||
+      !http_content_range(c->ibuf, &first, &last, &total) ||
+      first != sg->at || last != end - 1 || total != sg->total)
+    return 0;
+  v = http_header(sg->head->data, "ETag", &len);
+  w = http_header(c->ibuf, "ETag", &end);
+  if ((v || w) && (!v || !w || len != end || memcmp(v, w, len) != 0))
+    return 0;
+  http_freshness(c->ibuf, now, config.default_ttl, config.stale_window, &f);
+  if (!f.storable || f.expires <= now)
+    return 0;
+  r.first = sg->pos;
+  r.last = sg->last;
+  if (!(c->olen = http_partial_head(sg->head->data, &r, 1, sg->total, NULL,
+                                    sg->last - sg->pos + 1, c->obuf, MAXBUF)))
+    return 0;
+  c->optr = c->obuf;
+  sg->expires = f.expires;
+  sg->stale_until = f.stale_until;
+  sg->cap = last - first + 1;
+  sg->buf = Malloc(sg->cap);
+  cache_partial();
+  return 1;
+}
+
+/*
+ * Keeps the n body bytes at *p of the segment being fetched.  Returns
+ * how many of them, from *p on, go to the client.
+ */
+static size_t segment_body(conn_t *c, char **p, size_t n)
+{
+  struct conn_seg *sg = &c->seg;
+  size_t skip, len;
+
+  if (n > sg->cap - sg->len)
+    n = sg->cap - sg->len;      /* more than asked for: not kept */
+  memcpy(sg->buf + sg->len, *p, n);
+  sg->len += n;
+  sg->at += n;
+  if (sg->pos > sg->last || sg->at <= sg->pos)
+    return 0;
+  skip = n - (sg->at - sg->pos);
+  len = sg->at - sg->pos;
+  if (len > sg->last + 1 - sg->pos)
+    len = sg->last + 1 - sg->pos;
+  *p += skip;
+  sg->pos += len;
+  return len;
+}
+
+/* The segment being fetched is complete if it has all its bytes */
+static void segment_finish(conn_t *c)
+{
+  struct conn_seg *sg = &c->seg;
+  char key[MAXLINE + 32];
+
+  if (sg->len == sg->cap) {
+    segment_key(c, (sg->at - sg->len) / sg->size, key, sizeof(key));
+    cache_store(key, sg->buf, sg->len, sg->expires, sg->stale_until);
+  }
+  free(sg->buf);
+  sg->buf = NULL;
+  sg->fetch = 0;
+}
+
+/* The whole response has been relayed to the client */
+static void conn_relayed(conn_t *c)
+{
+  c->state = CS_FLUSH;
+  if (c->prefetch && !c->olen)
+    conn_prefetch(c);
+}
+
+/* The engine read n bytes (0 on EOF, -1 on error) into conn_rbuf() */
+void conn_read_done(conn_t *c, ssize_t n)
+{
+  size_t hlen;
+  char *p;
+
+  switch (c->state) {
+  case CS_READ_REQ:
+    if (n <= 0) {
+      c->state = CS_DONE;
+      return;
+    }
+    c->ilen += n;
+    if (header_end(c->ibuf, c->ilen))
+      conn_request(c);
+    else if (c->ilen == MAXBUF - 1)
+      conn_error(c, "request", "400", "Bad Request",
+                 "Request headers are too large");
+    return;
+  case CS_RESP_HDRS:
+    if (n < 0 || (n == 0 && c->ilen == 0)) {
+      c->state = CS_DONE;
+      return;
+    }
+    c->ilen += n;
+    /* Headers are relayed as-is; an oversized block is just streamed */
+    if (n == 0) {
+      fill_abort(c);
+      c->state = CS_FLUSH;
+    } else if ((hlen = header_end(c->ibuf, c->ilen)) || c->ilen == MAXBUF - 1) {
+      if (c->hit && hlen && http_status(c->ibuf, hlen) == 304) {
+        conn_revalidated(c);
+        return;
+      }
+      if (c->hit && http_status(c->ibuf, c->ilen) >= 500)
+        fill_abort(c);          /* an error does not replace the copy */
+      if (c->hit) {             /* modified (or failed): drop the copy */
+        cache_release(c->hit);
+        c->hit = NULL;
+      }
+      if (c->prefetch && (!hlen || http_status(c->ibuf, hlen) != 206))
+        c->prefetch = 0;        /* the origin does not do ranges */
+      c->state = CS_RELAY_BODY;
+      if (c->lead && !(hlen && fill_wanted(c, hlen)))
+        fill_abort(c);
+      if (c->seg.fetch && !segment_start(c, hlen))
+        c->seg.fetch = 0;       /* not what was asked for: relay it as is */
+      if (c->seg.fetch) {
+        p = c->ibuf + hlen;
+        c->then_len = segment_body(c, &p, c->ilen - hlen);
+        c->then = p;
+        return;
+      }
+      if (c->key && hlen && !c->lead && segment_learn(c))
+        c->prefetch = 0;        /* too large to cache whole */
+    } else
+      return;
+    fill_append(c, c->ibuf, c->ilen);
+    conn_relay(c, c->ilen);
+    return;
+  case CS_RELAY_BODY:
+    if (n <= 0) {
+      if (n == 0)
+        fill_finish(c);
+      fill_abort(c);
+      if (n == 0 && c->seg.fetch)
+        segment_finish(c);
+      if (n == 0)
+        conn_relayed(c);
+      else
+        c->state = CS_FLUSH;
+      return;
+    }
+    if (c->seg.fetch) {
+      p = c->ibuf;
+      if (!(c->olen = segment_body(c, &p, n)))
+        c->ilen = 0;
+      c->optr = p;
+      return;
+    }
+    fill_append(c, c->ibuf, n);
+    c->ilen = n;
+    conn_relay(c, n);
+    return;
+  case CS_DISK:
+    if (n <= 0) {
+      c->state = CS_DONE;
+      return;
+    }
+    c->disk.off += n;
+    c->disk.len -= n;
+    c->ilen = n;
+    c->optr = c->ibuf;
+    c->olen = n;
+    return;
+  }
+}
+
+/*
+ * conn_iov - point iov at what is to be sent to the current peer: optr,
+ *     and then the then segment, if any, so that a cached response's
+ *     head and body go out in one writev().  Returns the count, at
+ *     most CONN_IOV.
+ */
+int conn_iov(conn_t *c, struct iovec *iov)
+{
+  iov[0].iov_base = c->optr;
+  iov[0].iov_len = c->olen;
+  if (!c->then_len)
+    return 1;
+  iov[1].iov_base = c->then;
+  iov[1].iov_len = c->then_len;
+  return 2;
+}
+
+/* The engine sent n bytes of conn_iov() (-1 on error) */
+void conn_write_done(conn_t *c, ssize_t n)
+{
+  if (n < 0) {
+    c->state = CS_DONE;
+    return;
+  }
+  if ((size_t)n > c->olen) {    /* into then */
+    c->then += n - c->olen;
+    c->then_len -= n - c->olen;
+    n = c->olen;
+  }
+  c->optr += n;
+  c->olen -= n;
+  if (c->olen)
+    return;
+  if (!c->then_len && c->gz)
+    conn_inflate(c);
+  if (c->then_len) {
+    c->optr = c->then;
+    c->olen = c->then_len;
+    c->then_len = 0;
+    return;
+  }
+  if (c->seg.i < c->seg.n) {
+    segment_next(c);
+    return;
+  }
+  if (c->state == CS_FLUSH && c->refresh) {
+    /* The client has the stale copy; refresh it without the client */
+    shutdown(c->cfd, SHUT_RDWR);
+    c->refresh = 0;
+    c->detached = 1;
+    c->olen = strlen(c->obuf);
+    c->state = CS_CONNECT;
+    return;
+  }
+  if (c->state == CS_SEND_REQ)
+    c->state = CS_RESP_HDRS;
+  c->ilen = 0;
+}
+
+/* Frees the origin's addresses, so that a reconnect looks them up anew */
+static void conn_forget_addrs(conn_t *c)
+{
+  if (c->ai)
+    freeaddrinfo(c->ai);
+  c->ai = c->aip = NULL;
+}
+
+void conn_connected(conn_t *c, int ufd)
+{
+  conn_forget_addrs(c);
+  c->ufd = ufd;
+  c->connecting = 0;
+  c->state = CS_SEND_REQ;
+  c->optr = c->obuf;
+}
+
+/* Tells the client that the origin could not be reached */
+static void conn_unreachable(conn_t *c)
+{
+  conn_error(c, "Connection Failed", "503", "Service Unavailable",
+             "The proxy server could not retrieve the resource.");
+}
+
+/*
+ * The origin could not be resolved or connected to.  It is taken for
+ * down for config.origin_ttl: requests for it fail at once meanwhile.
+ */
+void conn_connect_failed(conn_t *c)
+{
+  if (c->ufd >= 0) {
+    close(c->ufd);
+    c->ufd = -1;
+  }
+  c->connecting = 0;
+  conn_forget_addrs(c);
+  fprintf(stderr, "Connection to %s on port %s failed.\n", c->host, c->port);
+  cache_origin_failed(c->host, c->port, config.origin_ttl);
+  if (c->detached) {
+    c->state = CS_DONE;
+    return;
+  }
+  conn_unreachable(c);
+}
+
+/* Formats an error response into obuf and flushes it to the client */
+static void conn_error(conn_t *c, char *cause, char *errnum, char *shortmsg,
+                       char *longmsg)
+{
+  if (!c->obuf)
+    c->obuf = Malloc(MAXBUF);
+  c->olen = clienterror(c->obuf, cause, errnum, shortmsg, longmsg);
+  c->optr = c->obuf;
+  c->state = CS_FLUSH;
+  c->refresh = 0;
+  c->prefetch = 0;
+}
+
+/* Appends a formatted string to obuf; returns -1 when it does not fit */
+static int oappend(conn_t *c, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(c->obuf + c->olen, MAXBUF - c->olen, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= MAXBUF - c->olen)
+    return -1;
+  c->olen += n;
+  return 0;
+}
+
+/* Builds the cache key "host:port/path", with the host in lower case */
+static char *make_key(char *host, char *port, char *path)
+{
+  size_t len = strlen(host) + strlen(port) + strlen(path) + 2;
+  char *key = Malloc(len), *p;
+
+  sprintf(key, "%s:%s%s", host, port, path);
+  for (p = key; *p != ':'; p++)
+    *p = tolower((unsigned char)*p);
+  return key;
+}
+
+/* Request headers the cache answers itself; see conditional_headers() */
+static const char *conditionals[] = {
+  "If-None-Match", "If-Modified-Since", "Range", "If-Range",
+  "Accept-Encoding",
+};
+#define NCONDITIONALS (sizeof(conditionals) / sizeof(conditionals[0]))
+#define COND_LINE "GET / HTTP/1.0\r\n"
+
+static int is_conditional(const char *line)
+{
+  size_t i, n;
+
+  for (i = 0; i < NCONDITIONALS; i++) {
+    n = strlen(conditionals[i]);
+    if (strncasecmp(line, conditionals[i], n) == 0 && line[n] == ':')
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Copies the client's conditional, Range and Accept-Encoding headers
+ * out of the request head req into a head of their own, or returns
+ * NULL if it has none.  They are needed after ibuf is reused.
+ */
+static char *conditional_headers(const char *req)
+{
+  const char *v[NCONDITIONALS];
+  size_t len[NCONDITIONALS], i, total = 0;
+  char *cond, *p;
+
+  for (i = 0; i < NCONDITIONALS; i++) {
+    len[i] = 0;
+    if ((v[i] = http_header(req, conditionals[i], &len[i])))
+      total += strlen(conditionals[i]) + len[i] + 4;
+  }
+  if (!total)
+    return NULL;
+  p = cond = Malloc(total + strlen(COND_LINE) + 3);
+  p += sprintf(p, COND_LINE);
+  for (i = 0; i < NCONDITIONALS; i++)
+    if (v[i])
+      p += sprintf(p, "%s: %.*s\r\n", conditionals[i], (int)len[i], v[i]);
+  sprintf(p, "\r\n");
+  return cond;
+}
+
+/* Adds the validators of the stale copy in c->hit to the request in obuf */
+static int add_validators(conn_t *c)
+{
+  const char *v;
+  size_t len;
+  int err = 0;
+
+  if ((v = http_header(c->hit->data, "ETag", &len)))
+    err |= oappend(c, "If-None-Match: %.*s\r\n", (int)len, v);
+  if ((v = http_header(c->hit->data, "Last-Modified", &len)))
+    err |= oappend(c, "If-Modified-Since: %.*s\r\n", (int)len, v);
+  return err;
+}
+
+/*
+ * conn_request - parse the buffered request and rewrite it for the
+ *     origin server, replacing the connection headers and User-Agent
+ *     and adding a Host header when the client left it out.  A fetch
+ *     for the cache drops the client's conditional, Range and
+ *     Accept-Encoding headers, so that the origin sends the whole
+ *     response unencoded, and adds our own validators when it
+ *     revalidates a stale copy.  A Range request that misses is
+ *     passed on as it is (see conn_prefetch()).
+ */
+static void conn_request(conn_t *c)
+{
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE], path[MAXLINE];
+  char host[MAXLINE], port[MAXLINE];
+  char *line, *eol;
+  cache_fill_t *fill;
+  int is_host_exist = 0, is_connection_exist = 0;
+  int is_proxy_connection_exist = 0, is_user_agent_exist = 0, err = 0;
+
+  if (sscanf(c->ibuf, "%s %s %s", method, uri, version) != 3) {
+    conn_error(c, "request", "400", "Bad Request",
+               "Proxy received a malformed request");
+    return;
+  }
+  if (config.verbose)
+    printf("Request: %s %s %s\n", method, uri, version);
+  if (conn_admin(c, method, uri))
+    return;
+  if (!(strcasecmp(method, "GET") == 0 || strcasecmp(method, "HEAD") == 0)) {
+    conn_error(c, method, "501", "Not implemented",
+               "Tiny does not implement this method");
+    return;
+  }
+  /* Browsers ask for favicon.ico on their own; drop it silently */
+  if (strstr(uri, "favicon.ico")) {
+    c->state = CS_DONE;
+    return;
+  }
+  if (!parse_uri(uri, host, port, path) || !*host ||
+      strlen(host) >= CONN_HOSTLEN || strlen(port) >= NI_MAXSERV) {
+    conn_error(c, uri, "400", "Bad Request",
+               "Proxy received a malformed request");
+    return;
+  }
+  strcpy(c->host, host);
+  strcpy(c->port, port);
+
+  c->cond = conditional_headers(c->ibuf);
+  if (cache_enabled() && strcasecmp(method, "GET") == 0) {
+    c->key = make_key(host, port, path);
+    switch (cache_join(c->key, &c->hit, &fill)) {
+    case CACHE_STALE:
+      if (fill) {
+        /* Sent first, then refreshed once the client has it */
+        c->lead = fill;
+        c->refresh = 1;
+        break;
+      }
+      /* fall through: a refresh is already under way */
+    case CACHE_HIT:
+      conn_send_hit(c);
+      return;
+    case CACHE_LEAD:
+      c->lead = fill;
+      /* A disk hit is sent whole, even to a Range request */
+      if (disk_lookup(c->key, &c->disk)) {
+        fill_abort(c);          /* any followers fetch for themselves */
+        c->ilen = 0;
+        c->state = CS_DISK;
+        return;
+      }
+      if (conn_range(c)) {
+        /* Followers fetch the whole object for themselves meanwhile */
+        fill_abort(c);
+        if (conn_segments(c))
+          return;
+        c->prefetch = !c->seg.fetch && config.range_fetch;
+      }
+      /* A stale copy is only worth keeping if it can be revalidated */
+      if (c->hit && (!c->lead || !http_has_validator(c->hit->data))) {
+        cache_release(c->hit);
+        c->hit = NULL;
+      }
+      break;
+    case CACHE_FOLLOW:
+      if (conn_range(c))        /* it is fetching all of the object */
+        cache_fill_leave(fill, NULL, 0);
+      else
+        c->follow = fill;
+      break;
+    }
+  }
+
+  if (!c->obuf)
+    c->obuf = Malloc(MAXBUF);
+  c->olen = 0;
+  err |= oappend(c, "%s %s HTTP/1.0\r\n", method, path);
+  line = strchr(c->ibuf, '\n') + 1;
+  while (*line != '\r' && *line != '\n') {
+    eol = strchr(line, '\n');
+    *eol = '\0';
+    if (eol > line && eol[-1] == '\r')
+      eol[-1] = '\0';
+    if (strncasecmp(line, "Proxy-Connection:", 17) == 0) {
+      err |= oappend(c, "Proxy-Connection: close\r\n");
+      is_proxy_connection_exist = 1;
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      err |= oappend(c, "Connection: close\r\n");
+      is_connection_exist = 1;
+    } else if (strncasecmp(line, "User-Agent:", 11) == 0) {
+      err |= oappend(c, "%s", user_agent_hdr);
+      is_user_agent_exist = 1;
+    } else if (is_conditional(line)) {
+      ;                         /* added back below unless fetching for us */
+    } else {
+      if (strncasecmp(line, "Host:", 5) == 0)
+        is_host_exist = 1;
+      err |= oappend(c, "%s\r\n", line);
+    }
+    line = eol + 1;
+  }
+  if (!is_proxy_connection_exist)
+    err |= oappend(c, "Proxy-Connection: close\r\n");
+  if (!is_connection_exist)
+    err |= oappend(c, "Connection: close\r\n");
+  if (!is_host_exist)
+    err |= oappend(c, "Host: %s:%s\r\n", c->host, c->port);
+  if (!is_user_agent_exist)
+    err |= oappend(c, "%s", user_agent_hdr);
+  c->reqlen = c->olen;
+  if (c->hit)
+    err |= add_validators(c);
+  else if (c->seg.fetch)
+    err |= oappend(c, "Range: bytes=%zu-%zu\r\n", c->seg.at,
+                   (c->seg.at + c->seg.size < c->seg.total ?
+                    c->seg.at + c->seg.size : c->seg.total) - 1);
+  else if (!c->lead && c->cond)
+    err |= oappend(c, "%.*s", (int)(strlen(c->cond) - strlen(COND_LINE) - 2),
+                   c->cond + strlen(COND_LINE));
+  err |= oappend(c, "\r\n");
+  if (err) {
+    conn_error(c, "request", "400", "Bad Request",
+               "Request headers are too large");
+    return;
+  }
+  c->ilen = 0;
+  c->state = CS_CONNECT;
+  if (c->follow)
+    conn_follow(c);
+  else if (c->refresh)
+    conn_send_hit(c);
+  else if (cache_origin_down(c->host, c->port)) {
+    fill_abort(c);
+    cache_negative();
+    conn_unreachable(c);
+  }
+}
+
+/* Whether the client is on the loopback interface */
+static int conn_local(conn_t *c)
+{
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+  if (getpeername(c->cfd, (struct sockaddr *)&ss, &len) < 0)
+    return 0;
+  if (ss.ss_family == AF_INET)
+    return (ntohl(((struct sockaddr_in *)&ss)->sin_addr.s_addr) >> 24) == 127;
+  return ss.ss_family == AF_INET6 &&
+         (IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr) ||
+          (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr) &&
+           sin6->sin6_addr.s6_addr[12] == 127));
+}
+
+/* Sends a response of our own, with blen bytes of body built in c->parts */
+static void conn_reply(conn_t *c, const char *status, const char *type,
+                       size_t blen)
+{
+  if (!c->obuf)
+    c->obuf = Malloc(MAXBUF);
+  c->olen = snprintf(c->obuf, MAXBUF, "HTTP/1.0 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Cache-Control: no-store\r\n\r\n", status, type, blen);
+  c->optr = c->obuf;
+  c->then = c->parts;
+  c->then_len = blen;
+  c->state = CS_FLUSH;
+}
+
+/* Writes s as a JSON string */
+static void json_string(FILE *f, const char *s)
+{
+  putc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    else
+      putc(*s, f);
+  }
+  putc('"', f);
+}
+
+/*
+ * Copies the value of parameter name in the query string q (NULL for
+ * none) to out (size bytes).  Returns 0 if it is not there.
+ */
+static int query_param(const char *q, const char *name, char *out,
+                       size_t size)
+{
+  size_t n = strlen(name);
+
+  for (; q; q = strchr(q, '&') ? strchr(q, '&') + 1 : NULL)
+    if (strncmp(q, name, n) == 0 && q[n] == '=') {
+      snprintf(out, size, "%.*s", (int)strcspn(q + n + 1, "&"), q + n + 1);
+      return 1;
+    }
+  return 0;
+}
+
+/*
+ * Sends the cache's statistics as JSON: its size, its counters, and
+ * rates per second since they started, and the top (?top=N, 10 by
+ * default) objects that have answered the most lookups.  With
+ * host=name[:port], also what that origin has in the cache.
+ */
+static void conn_stats(conn_t *c, const char *query)
+{
+  cache_obj_t *top[CONN_TOP_MAX];
+  struct cache_stats cs;
+  struct disk_stats ds;
+  char arg[CONN_HOSTLEN + NI_MAXSERV + 2];
+  long objects, bytes;
+  size_t len;
+  double secs;
+  FILE *f;
+  int n = 10, i;
+
+  if (query_param(query, "top", arg, sizeof(arg)))
+    n = atoi(arg);
+  if (n < 0 || n > CONN_TOP_MAX)
+    n = CONN_TOP_MAX;
+  cache_get_stats(&cs);
+  secs = difftime(time(NULL), cs.since);
+  if (secs < 1)
+    secs = 1;
+  free(c->parts);
+  f = open_memstream(&c->parts, &len);
+  fprintf(f, "{\n  \"objects\": %ld,\n  \"bytes\": %ld,\n"
+          "  \"capacity\": %zu,\n  \"uptime\": %.0f,\n"
+          "  \"hits\": %ld,\n  \"misses\": %ld,\n  \"evictions\": %ld,\n"
+          "  \"inserts\": %ld,\n  \"purged\": %ld,\n  \"bans\": %ld,\n"
+          "  \"banned\": %ld,\n  \"hit_ratio\": %.4f,\n"
+          "  \"hits_per_sec\": %.2f,\n  \"misses_per_sec\": %.2f,\n"
+          "  \"evictions_per_sec\": %.2f,\n",
+          cs.objects, cs.bytes, config.cache_size, secs, cs.hits, cs.misses,
+          cs.evictions, cs.inserts, cs.purged, cs.bans, cs.banned,
+          cs.hits + cs.misses ? (double)cs.hits / (cs.hits + cs.misses) : 0,
+          cs.hits / secs, cs.misses / secs, cs.evictions / secs);
+  if (disk_enabled()) {
+    disk_get_stats(&ds);
+    fprintf(f, "  \"disk_objects\": %ld,\n  \"disk_bytes\": %ld,\n"
+            "  \"disk_hits\": %ld,\n", ds.objects, ds.bytes, ds.hits);
+  }
+  if (query_param(query, "host", arg, sizeof(arg) - 1)) {
+    /* Keys are "host:port/path" with the host in lower case */
+    for (i = 0; arg[i]; i++)
+      arg[i] = tolower((unsigned char)arg[i]);
+    strcat(arg, strchr(arg, ':') ? "/" : ":");
+    if (cache_usage(arg, &objects, &bytes) == 0) {
+      fprintf(f, "  \"host\": {\"prefix\": ");
+      json_string(f, arg);
+      fprintf(f, ", \"objects\": %ld, \"bytes\": %ld},\n", objects, bytes);
+    }
+  }
+  fprintf(f, "  \"hottest\": [");
+  n = cache_hottest(top, n);
+  for (i = 0; i < n; i++) {
+    fprintf(f, "%s\n    {\"key\": ", i ? "," : "");
+    json_string(f, top[i]->key);
+    fprintf(f, ", \"hits\": %u, \"bytes\": %zu}", top[i]->hits,
+            top[i]->size);
+    cache_release(top[i]);
+  }
+  fprintf(f, "%s]\n}\n", n ? "\n  " : "");
+  fclose(f);
+  conn_reply(c, "200 OK", "application/json", len);
+}
+
+/*
+ * conn_admin - answer a cache administration request, if the request
+ *     is one: PURGE of a URL drops its object (and the head entry of
+ *     one cached in segments), or of a URL ending in "*" every object
+ *     under it at once; BAN of a URL drops every object whose URL
+ *     starts with it, or with an X-Ban-Regex header, whose key
+ *     ("host:port/path") matches that extended regex; GET /__cache
+ *     sends the statistics.  Only clients on the proxy's own host may
+ *     make them.  Returns 0 if the request is not one.
+ */
+static int conn_admin(conn_t *c, char *method, char *uri)
+{
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE], key[MAXLINE + 4], *k;
+  int purge = strcasecmp(method, "PURGE") == 0, ok;
+  const char *v;
+  size_t len;
+
+  if (!purge && strcasecmp(method, "BAN") != 0 &&
+      !(strcasecmp(method, "GET") == 0 &&
+        strncmp(uri, "/__cache", 8) == 0 && (!uri[8] || uri[8] == '?')))
+    return 0;
+  if (!conn_local(c)) {
+    conn_error(c, method, "403", "Forbidden",
+               "Cache administration is only allowed from the proxy's host");
+    return 1;
+  }
+  if (*uri == '/') {
+    conn_stats(c, uri[8] ? uri + 9 : NULL);
+    return 1;
+  }
+  if (!purge && (v = http_header(c->ibuf, "X-Ban-Regex", &len))) {
+    snprintf(key, sizeof(key), "%.*s", (int)len, v);
+    ok = cache_ban(key, 1) == 0;
+  } else if (!parse_uri(uri, host, port, path) || !*host) {
+    ok = 0;
+  } else {
+    k = make_key(host, port, path);
+    snprintf(key, sizeof(key), "%s", k);
+    free(k);
+    if (!purge) {
+      ok = cache_ban(key, 0) == 0;
+    } else if (strlen(key) > 1 && key[strlen(key) - 1] == '*') {
+      key[strlen(key) - 1] = '\0';
+      free(c->parts);
+      c->parts = Malloc(64);
+      snprintf(c->parts, 64, "Purged %ld\n", cache_purge_prefix(key));
+      conn_reply(c, "200 OK", "text/plain", strlen(c->parts));
+      return 1;
+    } else {
+      ok = cache_purge(key);
+      strcat(key, "#h");
+      ok |= cache_purge(key);
+      free(c->parts);
+      c->parts = strdup(ok ? "Purged\n" : "Not cached\n");
+      conn_reply(c, ok ? "200 OK" : "404 Not Found", "text/plain",
+                 strlen(c->parts));
+      return 1;
+    }
+  }
+  if (!ok) {
+    conn_error(c, uri, "400", "Bad Request", "Bad ban pattern");
+    return 1;
+  }
+  free(c->parts);
+  c->parts = strdup("Banned\n");
+  conn_reply(c, "200 OK", "text/plain", strlen(c->parts));
+  return 1;
+}
+
+/* Makes c->wakefd, if there is none yet; returns -1 if it cannot */
+static int conn_wakefd(conn_t *c)
+{
+  if (c->wakefd < 0)
+    c->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return c->wakefd;
+}
+
+/* Starts waiting for the fetch in c->follow */
+static void conn_follow(conn_t *c)
+{
+  if (c->nonblock) {
+    if (conn_wakefd(c) < 0) {
+      conn_unfollow(c, 0);
+      return;
+    }
+    c->waiter.fd = c->wakefd;
+    cache_fill_watch(c->follow, &c->waiter);
+  }
+  c->olen = 0;                  /* obuf keeps the request, in case */
+  c->state = CS_FOLLOW;
+}
+
+/* Stops following; served says whether the response came from the fill */
+static void conn_unfollow(conn_t *c, int served)
+{
+  cache_fill_leave(c->follow, c->wakefd >= 0 ? &c->waiter : NULL, served);
+  c->follow = NULL;
+}
+
+/*
+ * conn_wait - look for more of the response a follower is streaming;
+ *     blocking connections sleep until there is some.  Returns
+ *     CW_WAIT_FILL while a non-blocking one must keep waiting, else 0
+ *     once there is output or the connection has moved on: done, or
+ *     fetching on its own because the fill was given up.
+ */
+int conn_wait(conn_t *c)
+{
+  unsigned long n;
+  unsigned seq;
+  const char *p;
+  size_t len;
+  int state;
+
+  for (;;) {
+    /* Drain and note the state before reading, so no change is lost */
+    if (c->nonblock)
+      read(c->wakefd, &n, sizeof(n));
+    seq = cache_fill_seq(c->follow);
+    state = cache_fill_state(c->follow);
+    if ((len = cache_fill_read(c->follow, &c->cursor, &p)) > 0) {
+      c->optr = (char *)p;
+      c->olen = len;
+      return 0;
+    }
+    if (state != CACHE_FILLING) {
+      conn_unfollow(c, c->cursor.pos > 0);
+      if (state == CACHE_FILLED)
+        c->state = CS_FLUSH;
+      else if (c->cursor.pos == 0 && cache_origin_down(c->host, c->port)) {
+        cache_negative();
+        conn_unreachable(c);
+      } else if (c->cursor.pos == 0) {
+        c->olen = strlen(c->obuf);
+        c->state = CS_CONNECT;
+      }
+      else
+        c->state = CS_DONE;     /* the client already has part of it */
+      return 0;
+    }
+    if (c->nonblock)
+      return CW_WAIT_FILL;
+    cache_fill_wait(c->follow, seq);
+  }
+}
+
+/*
+ * conn_resolve - look c's origin up without blocking.  Returns 1 once
+ *     its addresses are in c->ai, to be tried from c->aip on; 0 while
+ *     the lookup is in progress, and c->wakefd becomes readable when it
+ *     is done; and -1 if it failed.
+ */
+int conn_resolve(conn_t *c)
+{
+  unsigned long n;
+
+  if (c->ai)
+    return 1;
+  if (!c->resolve) {
+    if (conn_wakefd(c) < 0)
+      return -1;
+    c->resolve = resolve_start(c->host, c->port, c->wakefd);
+  }
+  /* Drain before asking, so that a lookup ending now still wakes us */
+  read(c->wakefd, &n, sizeof(n));
+  if (!resolve_result(c->resolve, &c->ai))
+    return 0;
+  resolve_release(c->resolve);
+  c->resolve = NULL;
+  c->aip = c->ai;
+  return c->ai ? 1 : -1;
+}
+
+/*
+ * conn_connect - open the upstream socket.  Blocking connections use
+ *     open_clientfd(); non-blocking ones resolve the origin with
+ *     conn_resolve() and start an asynchronous connect to each of its
+ *     addresses in turn until one succeeds, polled on later calls.
+ *     Returns 1 when connected, 0 while the lookup or a connect is
+ *     still in flight and -1 on failure.
+ */
+static int conn_connect(conn_t *c)
+{
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer);
+  struct addrinfo *p;
+  int fd, rc, err = 0;
+
+  if (!c->nonblock) {
+    if ((fd = open_clientfd(c->host, c->port)) < 0)
+      return -1;
+    c->ufd = fd;
+    return 1;
+  }
+
+  if (c->connecting) {
+    if (getpeername(c->ufd, (SA *)&peer, &len) == 0)
+      return 1;
+    len = sizeof(err);
+    if (getsockopt(c->ufd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && !err)
+      return 0;
+    /* That address failed: go on to the next */
+    close(c->ufd);
+    c->ufd = -1;
+    c->ufd_gen++;
+    c->connecting = 0;
+  } else if ((rc = conn_resolve(c)) <= 0) {
+    return rc;
+  }
+
+  for (p = c->aip; p; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      c->ufd = fd;
+      break;
+    }
+    if (errno == EINPROGRESS) {
+      c->ufd = fd;
+      c->connecting = 1;
+      break;
+    }
+    close(fd);
+  }
+  if (!p)
+    return -1;
+  c->aip = p->ai_next;
+  return c->connecting ? 0 : 1;
+}
+
+/* Takes a relay pipe from this thread's pool, or makes a new one */
+static int pipe_get(conn_t *c)
+{
+  if (pipe_pooled > 0) {
+    pipe_pooled--;
+    c->pipefd[0] = pipe_pool[pipe_pooled][0];
+    c->pipefd[1] = pipe_pool[pipe_pooled][1];
+    return 0;
+  }
+  return pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC);
+}
+
+/* Returns an empty pipe to the pool; one still holding data is closed */
+static void pipe_put(conn_t *c)
+{
+  if (c->pipefd[0] < 0)
+    return;
+  if (c->piped == 0 && pipe_pooled < PIPE_POOL) {
+    pipe_pool[pipe_pooled][0] = c->pipefd[0];
+    pipe_pool[pipe_pooled][1] = c->pipefd[1];
+    pipe_pooled++;
+  } else {
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+  }
+  c->pipefd[0] = c->pipefd[1] = -1;
+  c->piped = 0;
+}
+
+/*
+ * conn_splice - relay body bytes upstream -> pipe -> client without
+ *     copying them to user space.  Returns 0 after making progress (or
+ *     after falling back to copying when the kernel will not splice
+ *     these descriptors), else the want it is blocked on.
+ */
+static int conn_splice(conn_t *c)
+{
+  ssize_t n;
+
+  if (c->pipefd[0] < 0 && pipe_get(c) < 0) {
+    c->can_splice = 0;
+    return 0;
+  }
+  if (c->piped == 0) {
+    n = splice(c->ufd, NULL, c->pipefd[1], NULL, SPLICE_CHUNK,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINTR)
+      return 0;
+    if (n < 0 && errno == EAGAIN)
+      return CW_READ_UPSTREAM;
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      pipe_put(c);
+      c->can_splice = 0;
+      return 0;
+    }
+    if (n <= 0) {
+      pipe_put(c);
+      if (n == 0)
+        conn_relayed(c);
+      else
+        c->state = CS_FLUSH;
+      return 0;
+    }
+    c->piped = n;
+  }
+  n = splice(c->pipefd[0], NULL, c->cfd, NULL, c->piped,
+             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0 && errno == EINTR)
+    return 0;
+  if (n < 0 && errno == EAGAIN)
+    return CW_WRITE_CLIENT;
+  if (n < 0) {
+    c->state = CS_DONE;
+    return 0;
+  }
+  c->piped -= n;
+  return 0;
+}
+
+/*
+ * conn_sendfile - send disk tier bytes to the client from the page
+ *     cache.  Returns 0 after making progress (or after falling back to
+ *     reading when the kernel will not sendfile), else the want it is
+ *     blocked on.
+ */
+static int conn_sendfile(conn_t *c)
+{
+  ssize_t n;
+
+  n = sendfile(c->cfd, c->disk.fd, &c->disk.off, c->disk.len);
+  if (n < 0 && errno == EINTR)
+    return 0;
+  if (n < 0 && errno == EAGAIN)
+    return CW_WRITE_CLIENT;
+  if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+    c->can_sendfile = 0;
+    return 0;
+  }
+  if (n <= 0) {
+    c->state = CS_DONE;
+    return 0;
+  }
+  c->disk.len -= n;
+  return 0;
+}
+
+/*
+ * conn_run - perform the connection's I/O with read/write/connect until
+ *     it finishes (CW_DONE) or a non-blocking descriptor would block, in
+ *     which case the blocking want is returned.
+ */
+int conn_run(conn_t *c)
+{
+  struct iovec iov[CONN_IOV];
+  int want, fd, rc;
+  size_t room;
+  ssize_t n;
+  char *p;
+
+  for (;;) {
+    want = conn_want(c);
+    switch (want) {
+    case CW_READ_CLIENT:
+    case CW_READ_UPSTREAM:
+      fd = (want == CW_READ_CLIENT) ? c->cfd : c->ufd;
+      p = conn_rbuf(c, &room);
+      if ((n = read(fd, p, room)) < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return want;
+      }
+      conn_read_done(c, n);
+      break;
+    case CW_WRITE_CLIENT:
+    case CW_WRITE_UPSTREAM:
+      fd = (want == CW_WRITE_CLIENT) ? c->cfd : c->ufd;
+      if ((n = writev(fd, iov, conn_iov(c, iov))) < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return want;
+      }
+      conn_write_done(c, n);
+      break;
+    case CW_SPLICE:
+      if ((rc = conn_splice(c)) != 0)
+        return rc;
+      break;
+    case CW_SENDFILE:
+      if ((rc = conn_sendfile(c)) != 0)
+        return rc;
+      break;
+    case CW_READ_DISK:
+      p = conn_rbuf(c, &room);
+      if ((n = pread(c->disk.fd, p, room, c->disk.off)) < 0 && errno == EINTR)
+        continue;
+      conn_read_done(c, n);
+      break;
+    case CW_WAIT_FILL:
+      if ((rc = conn_wait(c)) != 0)
+        return rc;
+      break;
+    case CW_CONNECT:
+      rc = conn_connect(c);
+      if (rc == 0)
+        return want;
+      if (rc < 0)
+        conn_connect_failed(c);
+      else
+        conn_connected(c, c->ufd);
+      break;
+    default:
+      return CW_DONE;
+    }
+  }
+}
@@ -0,0 +1,173 @@
+/*
+ * conn.h - per-connection state machine for the proxy
+ *
+ * A conn_t holds everything needed to move one request through the
+ * proxy.  The state machine itself never blocks and never touches a
+ * socket: an engine (the blocking doit() driver, the epoll reactor)
+ * asks conn_want() what the connection is waiting for, performs that
+ * I/O, and reports the result back with conn_read_done(),
+ * conn_write_done() or conn_connected().  Output is up to CONN_IOV
+ * pieces (conn_iov()): a response built around a cached body, such as
+ * a revalidated or partial one, sends its head and the body in one
+ * writev().  conn_run() is the common
+ * engine loop for plain read/write/connect on blocking or O_NONBLOCK
+ * descriptors; it also moves response bodies with splice() when the
+ * connection allows it (CW_SPLICE).
+ *
+ * A response found in the disk tier is sent with sendfile() from its
+ * slab file (CW_SENDFILE) when the engine allows it, else read into
+ * ibuf (CW_READ_DISK, from c->disk.fd at c->disk.off) and written.
+ *
+ * A GET for a stale cached object revalidates it with the origin: a
+ * 304 Not Modified sends (and re-caches) the stored copy.  A client's
+ * own If-None-Match or If-Modified-Since is answered from the cache.
+ *
+ * A Range request is answered from a cached object with a 206 (one
+ * range, or multipart/byteranges) or a 416.  One that misses is passed
+ * on to the origin; with -B the connection then lets its client go
+ * and fetches the whole object for the cache (c->prefetch), closing
+ * its upstream socket for a new one (engines watch c->ufd_gen).
+ *
+ * An object too large to cache whole is cached in segments, each an
+ * entry of its own, plus a head entry (conn_segments()).  A Range
+ * request for it is answered from the cached segments its range starts
+ * in, or by fetching just the one segment it starts in; either way the
+ * 206 may end short of the range asked for, at the end of what is
+ * cached or fetched, and the client asks again for the rest.
+ *
+ * An object the cache keeps gzipped goes as it is to a client whose
+ * Accept-Encoding takes gzip; any other is sent the stored head and
+ * then the body inflated into ibuf a buffer at a time (c->gz).
+ *
+ * A stale object within its stale window is sent at once; the first
+ * such request then shuts the client socket down and carries on as a
+ * background refresh of the object, with no client (c->detached).
+ *
+ * A GET that misses while another connection is already fetching the
+ * same object streams the response from that fetch as it arrives,
+ * waiting (CW_WAIT_FILL) when it has caught up.  Engines call
+ * conn_wait() when c->wakefd becomes readable; blocking connections
+ * just sleep in it.
+ *
+ * A non-blocking connection looks its origin up with conn_resolve(),
+ * which hands the lookup to a resolver thread (resolve.c); meanwhile it
+ * waits for c->wakefd on CW_CONNECT.  A connect that fails moves on to
+ * the origin's next address.
+ */
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "proxy.h"
+#include "cache.h"
+#include "disk.h"
+#include "gzip.h"
+#include "resolve.h"
+#include <sys/uio.h>
+
+#define CONN_HOSTLEN 256
+#define CONN_SEGS 8     /* most cached segments sent in one response */
+#define CONN_IOV 2      /* most pieces conn_iov() sends at once */
+#define CONN_TOP_MAX 100 /* most hottest objects /__cache lists */
+
+/* Where a connection is in its request/response lifetime */
+enum conn_state {
+  CS_READ_REQ,    /* reading request line and headers from the client */
+  CS_CONNECT,     /* waiting for the upstream connection */
+  CS_SEND_REQ,    /* sending the rewritten request upstream */
+  CS_FOLLOW,      /* sending the response another connection fetches */
+  CS_DISK,        /* sending a response from the disk tier */
+  CS_RESP_HDRS,   /* reading and relaying the response headers */
+  CS_RELAY_BODY,  /* relaying the response body */
+  CS_FLUSH,       /* draining the last output to the client */
+  CS_DONE
+};
+
+/* What the connection needs from its engine next */
+enum conn_want {
+  CW_READ_CLIENT,
+  CW_CONNECT,
+  CW_WRITE_UPSTREAM,
+  CW_READ_UPSTREAM,
+  CW_WRITE_CLIENT,
+  CW_SPLICE,      /* move body bytes upstream -> pipe -> client */
+  CW_WAIT_FILL,   /* call conn_wait() once wakefd is readable */
+  CW_SENDFILE,    /* move disk tier bytes to the client */
+  CW_READ_DISK,   /* read disk tier bytes into conn_rbuf() */
+  CW_DONE
+};
+
+/* A Range answered from an object cached in segments */
+struct conn_seg {
+  cache_obj_t *head;         /* the object's head entry */
+  size_t size;               /* of a segment */
+  size_t total;              /* of the object */
+  size_t pos, last;          /* next byte for the client, and its last */
+  size_t at;                 /* offset of objs[i], or of the next byte
+                                of the segment being fetched */
+  cache_obj_t *objs[CONN_SEGS]; /* consecutive cached segments to send */
+  int n, i;
+  int fetch;                 /* fetching the segment at pos instead */
+  char *buf;                 /* ... into this, cap bytes */
+  size_t len, cap;
+  time_t expires, stale_until;
+};
+
+typedef struct conn {
+  int cfd;                   /* client socket */
+  int ufd;                   /* upstream socket, -1 until connected */
+  int state;
+  int nonblock;              /* descriptors are O_NONBLOCK */
+  int connecting;            /* non-blocking connect() in flight */
+  int can_splice;            /* engine allows the splice() body relay */
+  int can_sendfile;          /* engine allows sendfile() of disk hits */
+  int refresh;               /* send the stale c->hit, then refresh it */
+  int detached;              /* refreshing: the client has been let go */
+  int prefetch;              /* fetch the whole object after the range */
+  unsigned ufd_gen;          /* bumped when ufd is closed for another */
+  int pipefd[2];             /* relay pipe while splicing, else -1 */
+  size_t piped;              /* bytes sitting in the pipe */
+  char *ibuf;                /* request, then upstream response bytes */
+  size_t ilen;
+  char *obuf;                /* rewritten request or error response */
+  size_t reqlen;             /* of the request, up to conditional headers */
+  char *optr;                /* next byte to send to the current peer */
+  size_t olen;
+  char *then;                /* more to send once optr is done, if then_len */
+  size_t then_len;
+  char host[CONN_HOSTLEN];
+  char port[NI_MAXSERV];
+  resolve_t *resolve;        /* non-blocking lookup of host in flight */
+  struct addrinfo *ai, *aip; /* host's addresses, and the next to try */
+  char *key;                 /* cache key of a GET, else NULL */
+  char *cond;                /* the client's conditional, Range and
+                                Accept-Encoding headers */
+  char *parts;               /* multipart/byteranges or our own body
+                                being sent */
+  char *plain;               /* a gzipped hit's body, inflated whole */
+  gzip_stream_t *gz;         /* a gzipped hit's body, being inflated */
+  cache_obj_t *hit;          /* cached response being sent or revalidated */
+  cache_fill_t *lead;        /* fetch being copied for the cache */
+  cache_fill_t *follow;      /* fetch this connection streams from */
+  struct cache_cursor cursor; /* how much of it has been sent */
+  int wakefd;                /* eventfd a non-blocking follower or lookup
+                                waits on */
+  struct cache_waiter waiter;
+  struct disk_ref disk;      /* disk tier response being sent */
+  struct conn_seg seg;       /* Range answered from segments */
+  struct conn *next;         /* engine-private list link */
+} conn_t;
+
+conn_t *conn_new(int cfd, int nonblock);
+void conn_free(conn_t *c);
+int conn_want(conn_t *c);
+char *conn_rbuf(conn_t *c, size_t *room);
+void conn_read_done(conn_t *c, ssize_t n);
+int conn_iov(conn_t *c, struct iovec *iov);
+void conn_write_done(conn_t *c, ssize_t n);
+void conn_connected(conn_t *c, int ufd);
+void conn_connect_failed(conn_t *c);
+int conn_resolve(conn_t *c);
+int conn_wait(conn_t *c);
+int conn_run(conn_t *c);
+
+#endif /* __CONN_H__ */
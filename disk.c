@@ -0,0 +1,398 @@
+/*
+ * disk.c - disk-backed second tier of the object cache
+ *
+ * Objects evicted from memory are spilled here instead of being lost.
+ * The tier is a ring of preallocated slab files of DISK_SLAB bytes in
+ * one directory.  Spills are appended to the current slab with
+ * pwrite(); when it is full the next slab in the ring is recycled,
+ * dropping everything it held, so eviction is FIFO by slab and costs
+ * no I/O.  The index - key, slab and offset of each object - stays in
+ * memory, so a lookup never touches the disk, and a hit is sent to the
+ * client straight from the page cache with sendfile().  The objects
+ * themselves are never in the proxy's memory, so the tier can be many
+ * times the memory budget without growing the RSS.
+ *
+ * Like objects in memory, an entry is checked against the cache's bans
+ * added since it was last looked up (cache_banned()) and dropped if
+ * one matches.
+ *
+ * Readers and writers pin a slab while they use it; a pinned slab is
+ * not recycled, and a spill that would need it is dropped instead.
+ *
+ * The index starts empty, unless a snapshot restores it.  Each slab
+ * starts with a header holding its generation, which is bumped (and
+ * written before any data) whenever the slab is reused, so a restored
+ * entry is only trusted while its slab is still in the generation the
+ * snapshot saw.  Within a generation a slab is only appended to.
+ */
+#include "disk.h"
+#include "cache.h"
+
+#define DISK_SLAB  (16 * 1024 * 1024)
+#define DISK_HDR   4096                 /* slab header; data starts here */
+#define DISK_MAGIC 0x31424c53595850UL   /* "PXYSLB1" */
+
+/* On-disk slab header */
+struct slab_hdr {
+  unsigned long magic;
+  unsigned long gen;
+};
+
+struct disk_entry {
+  char *key;
+  unsigned long hash;
+  int slab;
+  off_t off;
+  size_t size;
+  time_t expires;                 /* as the object's in memory */
+  unsigned long bans;             /* cache bans it has been checked against */
+  struct disk_entry *next;        /* hash chain */
+  struct disk_entry *slab_next;   /* everything in the same slab */
+};
+
+struct slab {
+  int fd;
+  unsigned long gen;
+  size_t used;                    /* 0 until written in this generation */
+  int pins;
+  struct disk_entry *entries;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct slab *slabs;
+  int nslabs, cur;
+  unsigned long next_gen;
+  struct disk_entry **buckets;
+  size_t nbuckets;                /* a power of 2 */
+  struct disk_stats stats;
+} disk = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * disk_init - open (creating) and preallocate the slab files in dir for
+ *     a tier of capacity bytes.  Exits if they cannot be set up.
+ */
+void disk_init(const char *dir, size_t capacity)
+{
+  struct slab_hdr hdr;
+  char path[MAXLINE];
+  int i, err;
+
+  disk.next_gen = 1;                    /* 0 is never written */
+  disk.nslabs = capacity / DISK_SLAB;
+  if (disk.nslabs < 2)
+    disk.nslabs = 2;
+  disk.slabs = Calloc(disk.nslabs, sizeof(struct slab));
+  for (i = 0; i < disk.nslabs; i++) {
+    snprintf(path, sizeof(path), "%s/slab.%d", dir, i);
+    if ((disk.slabs[i].fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+                                 0600)) < 0)
+      unix_error("disk_init: open slab");
+    if ((err = posix_fallocate(disk.slabs[i].fd, 0, DISK_SLAB)) != 0) {
+      errno = err;
+      unix_error("disk_init: fallocate slab");
+    }
+    if (pread(disk.slabs[i].fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == DISK_MAGIC) {
+      disk.slabs[i].gen = hdr.gen;
+      if (hdr.gen >= disk.next_gen)
+        disk.next_gen = hdr.gen + 1;
+    }
+  }
+  /* About one bucket per 8 KB object */
+  for (disk.nbuckets = 1024; disk.nbuckets < capacity / 8192;)
+    disk.nbuckets *= 2;
+  disk.buckets = Calloc(disk.nbuckets, sizeof(struct disk_entry *));
+}
+
+int disk_enabled(void)
+{
+  return disk.nslabs > 0;
+}
+
+/* Index helpers; caller holds the lock */
+static struct disk_entry **entry_find(const char *key, unsigned long hash)
+{
+  struct disk_entry **pp = &disk.buckets[hash & (disk.nbuckets - 1)];
+
+  for (; *pp; pp = &(*pp)->next)
+    if ((*pp)->hash == hash && strcmp((*pp)->key, key) == 0)
+      break;
+  return pp;
+}
+
+/* Drops an entry from the hash chain and the stats, not its slab list */
+static void entry_unlink(struct disk_entry **pp)
+{
+  struct disk_entry *e = *pp;
+
+  *pp = e->next;
+  disk.stats.objects--;
+  disk.stats.bytes -= e->size;
+}
+
+/* Drops an entry from the index; its slab frees it */
+static void entry_drop(struct disk_entry **pp)
+{
+  struct disk_entry *e = *pp;
+
+  entry_unlink(pp);
+  free(e->key);
+  e->key = NULL;
+}
+
+/* Adds an entry to the index; caller holds the lock */
+static void entry_add(const char *key, unsigned long hash, int slab,
+                      off_t off, size_t size, time_t expires)
+{
+  struct disk_entry **pp = entry_find(key, hash), *e;
+
+  if (*pp)
+    entry_drop(pp);
+  e = Malloc(sizeof(struct disk_entry));
+  e->key = strdup(key);
+  e->hash = hash;
+  e->slab = slab;
+  e->off = off;
+  e->size = size;
+  e->expires = expires;
+  e->bans = cache_bans();
+  e->next = *pp;
+  *pp = e;
+  e->slab_next = disk.slabs[slab].entries;
+  disk.slabs[slab].entries = e;
+  disk.stats.objects++;
+  disk.stats.bytes += size;
+}
+
+/* Forgets everything in slab i so that it can be rewritten */
+static void slab_recycle(int i)
+{
+  struct slab *sl = &disk.slabs[i];
+  struct disk_entry *e, *next;
+
+  for (e = sl->entries; e; e = next) {
+    next = e->slab_next;
+    if (e->key)                 /* else already replaced */
+      entry_unlink(entry_find(e->key, e->hash));
+    free(e->key);
+    free(e);
+  }
+  sl->entries = NULL;
+  sl->used = 0;
+}
+
+/*
+ * Starts a new generation of the slab, before its first write since it
+ * was recycled or since startup.  Returns -1 if the header write fails.
+ */
+static int slab_start(struct slab *sl)
+{
+  struct slab_hdr hdr = { DISK_MAGIC, disk.next_gen++ };
+
+  if (pwrite(sl->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    return -1;
+  sl->gen = hdr.gen;
+  sl->used = DISK_HDR;
+  return 0;
+}
+
+/*
+ * disk_put - spill a copy of an object evicted from memory, replacing
+ *     any older copy.  Objects larger than a slab are not kept.
+ */
+void disk_put(const char *key, unsigned long hash, const char *data,
+              size_t size, time_t expires)
+{
+  struct slab *sl;
+  size_t done = 0;
+  ssize_t n;
+  off_t off;
+  int i;
+
+  if (!disk_enabled() || size > DISK_SLAB - DISK_HDR)
+    return;
+  pthread_mutex_lock(&disk.lock);
+  if (disk.slabs[disk.cur].used + size > DISK_SLAB) {
+    i = (disk.cur + 1) % disk.nslabs;
+    if (disk.slabs[i].pins) {
+      disk.stats.drops++;
+      pthread_mutex_unlock(&disk.lock);
+      return;
+    }
+    slab_recycle(i);
+    disk.cur = i;
+  }
+  i = disk.cur;
+  sl = &disk.slabs[i];
+  if (sl->used == 0 && slab_start(sl) < 0) {
+    disk.stats.drops++;
+    pthread_mutex_unlock(&disk.lock);
+    return;
+  }
+  off = sl->used;
+  sl->used += size;
+  sl->pins++;
+  pthread_mutex_unlock(&disk.lock);
+
+  while (done < size) {
+    if ((n = pwrite(sl->fd, data + done, size - done, off + done)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    done += n;
+  }
+
+  pthread_mutex_lock(&disk.lock);
+  sl->pins--;
+  if (done < size) {
+    disk.stats.drops++;
+  } else {
+    entry_add(key, hash, i, off, size, expires);
+    disk.stats.writes++;
+  }
+  pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+ * disk_lookup - find a fresh copy of key on disk.  On a hit fills in
+ *     ref, pinning the slab until disk_release(), and returns 1; else
+ *     returns 0.  A stale copy is left for a newer spill to replace.
+ */
+int disk_lookup(const char *key, struct disk_ref *ref)
+{
+  unsigned long hash = cache_hash(key, strlen(key));
+  struct disk_entry **pp, *e;
+  unsigned long bans;
+
+  if (!disk_enabled())
+    return 0;
+  pthread_mutex_lock(&disk.lock);
+  pp = entry_find(key, hash);
+  if ((e = *pp) && e->expires && e->expires <= time(NULL))
+    e = NULL;
+  if (e && e->bans != (bans = cache_bans())) {
+    if (cache_banned(key, e->bans)) {
+      entry_drop(pp);
+      e = NULL;
+    } else
+      e->bans = bans;
+  }
+  if (e) {
+    disk.slabs[e->slab].pins++;
+    ref->fd = disk.slabs[e->slab].fd;
+    ref->off = e->off;
+    ref->len = e->size;
+    ref->slab = e->slab;
+    disk.stats.hits++;
+  }
+  pthread_mutex_unlock(&disk.lock);
+  return e != NULL;
+}
+
+/*
+ * disk_remove - forget the copy of key on disk, if any.  Returns 1 if
+ *     there was one.  Its bytes stay until the slab is recycled.
+ */
+int disk_remove(const char *key)
+{
+  struct disk_entry **pp;
+  int found;
+
+  if (!disk_enabled())
+    return 0;
+  pthread_mutex_lock(&disk.lock);
+  pp = entry_find(key, cache_hash(key, strlen(key)));
+  if ((found = *pp != NULL))
+    entry_drop(pp);
+  pthread_mutex_unlock(&disk.lock);
+  return found;
+}
+
+/*
+ * disk_sweep - check every entry against the cache's bans added since
+ *     it was last, before the oldest of them are forgotten
+ */
+void disk_sweep(void)
+{
+  unsigned long bans = cache_bans();
+  struct disk_entry **pp;
+  size_t b;
+
+  if (!disk_enabled())
+    return;
+  pthread_mutex_lock(&disk.lock);
+  for (b = 0; b < disk.nbuckets; b++)
+    for (pp = &disk.buckets[b]; *pp;)
+      if ((*pp)->bans != bans && cache_banned((*pp)->key, (*pp)->bans))
+        entry_drop(pp);
+      else {
+        (*pp)->bans = bans;
+        pp = &(*pp)->next;
+      }
+  pthread_mutex_unlock(&disk.lock);
+}
+
+void disk_release(struct disk_ref *ref)
+{
+  if (ref->fd < 0)
+    return;
+  pthread_mutex_lock(&disk.lock);
+  disk.slabs[ref->slab].pins--;
+  pthread_mutex_unlock(&disk.lock);
+  ref->fd = -1;
+}
+
+/*
+ * disk_walk - call fn on every object in the index, with the lock held,
+ *     passing the generation of its slab.
+ */
+void disk_walk(void (*fn)(const char *key, int slab, unsigned long gen,
+                          off_t off, size_t size, time_t expires, void *arg),
+               void *arg)
+{
+  struct disk_entry *e;
+  size_t b;
+
+  pthread_mutex_lock(&disk.lock);
+  for (b = 0; b < disk.nbuckets; b++)
+    for (e = disk.buckets[b]; e; e = e->next)
+      fn(e->key, e->slab, disk.slabs[e->slab].gen, e->off, e->size,
+         e->expires, arg);
+  pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+ * disk_restore - put an entry saved by disk_walk() back in the index,
+ *     if its slab is still in generation gen.  Returns 1 if it was.
+ *     Only for startup, before any spill.
+ */
+int disk_restore(const char *key, int slab, unsigned long gen, off_t off,
+                 size_t size, time_t expires)
+{
+  struct slab *sl;
+
+  if (!disk_enabled() || slab < 0 || slab >= disk.nslabs)
+    return 0;
+  sl = &disk.slabs[slab];
+  if (sl->gen != gen || gen == 0 || off < DISK_HDR ||
+      size > DISK_SLAB - (size_t)off)
+    return 0;
+  pthread_mutex_lock(&disk.lock);
+  entry_add(key, cache_hash(key, strlen(key)), slab, off, size, expires);
+  if ((size_t)off + size > sl->used)
+    sl->used = off + size;
+  /* Spills carry on in the newest restored slab */
+  if (sl->gen > disk.slabs[disk.cur].gen || !disk.slabs[disk.cur].used)
+    disk.cur = slab;
+  pthread_mutex_unlock(&disk.lock);
+  return 1;
+}
+
+void disk_get_stats(struct disk_stats *st)
+{
+  pthread_mutex_lock(&disk.lock);
+  *st = disk.stats;
+  pthread_mutex_unlock(&disk.lock);
+}
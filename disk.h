@@ -0,0 +1,42 @@
+/*
+ * disk.h - disk-backed second tier of the object cache
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include <time.h>
+
+/* Where a cached response sits on disk; pins its slab until released */
+struct disk_ref {
+  int fd;                         /* slab file, -1 when not holding one */
+  off_t off;                      /* next byte to send */
+  size_t len;                     /* bytes left to send */
+  int slab;
+};
+
+/* Counters, updated under the tier's lock */
+struct disk_stats {
+  long hits;
+  long writes;                    /* objects spilled from memory */
+  long drops;                     /* spills skipped: slab busy, write error */
+  long objects;
+  long bytes;
+};
+
+void disk_init(const char *dir, size_t capacity);
+int disk_enabled(void);
+void disk_put(const char *key, unsigned long hash, const char *data,
+              size_t size, time_t expires);
+int disk_lookup(const char *key, struct disk_ref *ref);
+int disk_remove(const char *key);
+void disk_sweep(void);
+void disk_release(struct disk_ref *ref);
+void disk_walk(void (*fn)(const char *key, int slab, unsigned long gen,
+                          off_t off, size_t size, time_t expires, void *arg),
+               void *arg);
+int disk_restore(const char *key, int slab, unsigned long gen, off_t off,
+                 size_t size, time_t expires);
+void disk_get_stats(struct disk_stats *st);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,159 @@
+/*
+ * gzip.c - gzip coding of cached response bodies (zlib)
+ *
+ * The cache keeps text responses with their head as received and their
+ * body gzipped (cache.c decides, with gzip_wanted()).  A client that
+ * accepts gzip is sent the gzipped body as it is; any other gets it
+ * inflated a buffer at a time through a gzip_stream_t, so that a hit
+ * never needs more than one buffer of plain text at once.
+ */
+#include "gzip.h"
+#include "http.h"
+#include <zlib.h>
+
+#define GZIP_WINDOW (15 + 16)           /* zlib's windowBits for gzip */
+
+struct gzip_stream {
+  z_stream zs;
+  int done;
+};
+
+/*
+ * zlib's state is costly to set up (deflate's is some 256 KB), so each
+ * thread keeps one deflater and one inflater and resets them per use.
+ */
+static __thread z_stream deflater, inflater;
+static __thread int deflater_level, have_inflater;
+
+/* Media types that compress well; text/... always does */
+static const char *gzip_types[] = {
+  "application/json", "application/javascript", "application/xml",
+  "application/xhtml+xml", "application/rss+xml", "image/svg+xml",
+};
+
+/*
+ * gzip_wanted - whether a response with head resp and a body of blen
+ *     bytes is worth storing gzipped: text that the origin did not
+ *     encode itself, and not too short to gain anything.
+ */
+int gzip_wanted(const char *resp, size_t blen)
+{
+  const char *v;
+  size_t len, n, i;
+
+  if (blen < GZIP_MIN_BODY || http_header(resp, "Content-Encoding", &len) ||
+      !(v = http_header(resp, "Content-Type", &len)))
+    return 0;
+  n = strcspn(v, "; \t\r\n");
+  if (n > len)
+    n = len;
+  if (n > 5 && strncasecmp(v, "text/", 5) == 0)
+    return 1;
+  for (i = 0; i < sizeof(gzip_types) / sizeof(gzip_types[0]); i++)
+    if (n == strlen(gzip_types[i]) && strncasecmp(v, gzip_types[i], n) == 0)
+      return 1;
+  return 0;
+}
+
+/*
+ * gzip_deflate - gzip the len bytes at data at the given level into out
+ *     (size bytes).  Returns the gzipped length, or 0 if it would not
+ *     fit: callers pass what the result must come in under to be worth
+ *     keeping.
+ */
+size_t gzip_deflate(const char *data, size_t len, int level, char *out,
+                    size_t size)
+{
+  z_stream *zs = &deflater;
+
+  if (deflater_level != level) {
+    if (deflater_level)
+      deflateEnd(zs);
+    memset(zs, 0, sizeof(*zs));
+    deflater_level = 0;
+    if (deflateInit2(zs, level, Z_DEFLATED, GZIP_WINDOW, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return 0;
+    deflater_level = level;
+  } else
+    deflateReset(zs);
+  zs->next_in = (unsigned char *)data;
+  zs->avail_in = len;
+  zs->next_out = (unsigned char *)out;
+  zs->avail_out = size;
+  return deflate(zs, Z_FINISH) == Z_STREAM_END ? size - zs->avail_out : 0;
+}
+
+/*
+ * gzip_inflate - inflate the zlen gzipped bytes at z into out, which
+ *     they must fill exactly (size bytes).  Returns 0 if they do not.
+ */
+int gzip_inflate(const char *z, size_t zlen, char *out, size_t size)
+{
+  z_stream *zs = &inflater;
+
+  if (!have_inflater) {
+    if (inflateInit2(zs, GZIP_WINDOW) != Z_OK)
+      return 0;
+    have_inflater = 1;
+  } else
+    inflateReset(zs);
+  zs->next_in = (unsigned char *)z;
+  zs->avail_in = zlen;
+  zs->next_out = (unsigned char *)out;
+  zs->avail_out = size;
+  return inflate(zs, Z_FINISH) == Z_STREAM_END && zs->avail_out == 0;
+}
+
+/*
+ * gzip_open - start inflating the zlen gzipped bytes at z, which must
+ *     stay put until gzip_close().  Returns NULL if zlib cannot start.
+ */
+gzip_stream_t *gzip_open(const char *z, size_t zlen)
+{
+  gzip_stream_t *s = Calloc(1, sizeof(gzip_stream_t));
+
+  if (inflateInit2(&s->zs, GZIP_WINDOW) != Z_OK) {
+    free(s);
+    return NULL;
+  }
+  s->zs.next_in = (unsigned char *)z;
+  s->zs.avail_in = zlen;
+  return s;
+}
+
+/*
+ * gzip_read - inflate the next at most size bytes of s into out.
+ *     Returns their count, 0 at the end, or -1 if the data is corrupt
+ *     or cut short.
+ */
+ssize_t gzip_read(gzip_stream_t *s, char *out, size_t size)
+{
+  int rc;
+
+  if (s->done)
+    return 0;
+  s->zs.next_out = (unsigned char *)out;
+  s->zs.avail_out = size;
+  rc = inflate(&s->zs, Z_NO_FLUSH);
+  if (rc == Z_STREAM_END)
+    s->done = 1;
+  else if (rc != Z_OK)
+    return -1;
+  return size - s->zs.avail_out;
+}
+
+void gzip_close(gzip_stream_t *s)
+{
+  inflateEnd(&s->zs);
+  free(s);
+}
+
+/* gzip_cpu_us - the calling thread's CPU time, to charge coding to */
+long gzip_cpu_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
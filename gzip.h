@@ -0,0 +1,24 @@
+/*
+ * gzip.h - gzip coding of cached response bodies (zlib)
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+
+/* Bodies shorter than this are not worth gzipping */
+#define GZIP_MIN_BODY 256
+
+/* A gzipped body being inflated piece by piece.  Opaque outside gzip.c. */
+typedef struct gzip_stream gzip_stream_t;
+
+int gzip_wanted(const char *resp, size_t blen);
+size_t gzip_deflate(const char *data, size_t len, int level, char *out,
+                    size_t size);
+int gzip_inflate(const char *z, size_t zlen, char *out, size_t size);
+gzip_stream_t *gzip_open(const char *z, size_t zlen);
+ssize_t gzip_read(gzip_stream_t *s, char *out, size_t size);
+void gzip_close(gzip_stream_t *s);
+long gzip_cpu_us(void);
+
+#endif /* __GZIP_H__ */
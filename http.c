@@ -0,0 +1,732 @@
+/*
+ * http.c - HTTP response header parsing for the cache
+ *
+ * http_freshness() turns a response's headers into the freshness model
+ * of a shared cache (RFC 9111): whether the response may be stored at
+ * all, and the time until which it may be served without asking the
+ * origin.  The lifetime comes from, in order, Cache-Control s-maxage,
+ * max-age, Expires less Date, a tenth of the time since Last-Modified
+ * (at most HTTP_HEURISTIC_MAX), or the proxy's default; the age the
+ * response already had when it arrived, by Date or an Age header, is
+ * taken off.  The result is one absolute time, so that checking it on
+ * a lookup is a single comparison.  A second one bounds how long the
+ * response may then be served stale while it is refreshed: by its
+ * stale-while-revalidate, or the proxy's default window, unless it
+ * demands revalidation (must-revalidate, proxy-revalidate, s-maxage,
+ * no-cache).
+ *
+ * The rest supports revalidation: http_refresh() updates a stored
+ * head with the headers of a 304 Not Modified, and http_not_modified()
+ * evaluates a client's If-None-Match or If-Modified-Since against a
+ * cached response.
+ *
+ * http_ranges() and the functions after it answer a client's Range
+ * request from a cached 200: one range as a 206 with Content-Range,
+ * several as a multipart/byteranges body, none satisfiable as a 416.
+ * http_accepts_gzip() and http_gzip_head() send a body the cache keeps
+ * gzipped to a client that takes it that way.
+ *
+ * A head passed here is a complete response or request head: it need
+ * not be NUL-terminated, but it must end with its blank line.
+ */
+#define _GNU_SOURCE             /* strptime, timegm */
+#include "http.h"
+
+/*
+ * http_head_len - return the length of the head (through the blank
+ *     line) at the start of the len bytes at buf, or 0 if incomplete
+ */
+size_t http_head_len(const char *buf, size_t len)
+{
+  const char *p;
+
+  if ((p = memmem(buf, len, "\r\n\r\n", 4)))
+    return p - buf + 4;
+  if ((p = memmem(buf, len, "\n\n", 2)))
+    return p - buf + 2;
+  return 0;
+}
+
+/*
+ * http_status - return the status code of the response head of len
+ *     bytes at hdrs, or -1.  Only its status line is read.
+ */
+int http_status(const char *hdrs, size_t len)
+{
+  const char *end = memchr(hdrs, '\n', len), *p;
+  int status = 0, digits = 0;
+
+  if (!end)
+    end = hdrs + len;
+  if (end - hdrs < 5 || strncmp(hdrs, "HTTP/", 5) != 0 ||
+      !(p = memchr(hdrs, ' ', end - hdrs)))
+    return -1;
+  while (p < end && *p == ' ')
+    p++;
+  for (; p < end && digits < 3 && isdigit((unsigned char)*p); p++, digits++)
+    status = 10 * status + *p - '0';
+  return digits == 3 ? status : -1;
+}
+
+/*
+ * Finds the next header called name from line *p on, stopping at the
+ * blank line that ends the block.  Returns its value with surrounding
+ * white space trimmed and its length in *len, and moves *p past it; or
+ * returns NULL.
+ */
+static const char *header_from(const char **p, const char *name, size_t *len)
+{
+  size_t n = strlen(name);
+  const char *line = *p, *eol, *next, *v;
+
+  for (; *line && *line != '\r' && *line != '\n'; line = next) {
+    if (!(eol = strchr(line, '\n')))
+      eol = line + strlen(line);
+    next = *eol ? eol + 1 : eol;
+    if (strncasecmp(line, name, n) != 0 || line[n] != ':')
+      continue;
+    for (v = line + n + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+      ;
+    while (eol > v && isspace((unsigned char)eol[-1]))
+      eol--;
+    *len = eol - v;
+    *p = next;
+    return v;
+  }
+  *p = line;
+  return NULL;
+}
+
+/*
+ * http_header - return the value of the first header called name in the
+ *     head hdrs (status or request line first), with its length in
+ *     *len, or NULL.  The value is not NUL-terminated.
+ */
+const char *http_header(const char *hdrs, const char *name, size_t *len)
+{
+  const char *p = strchr(hdrs, '\n');
+
+  if (!p)
+    return NULL;
+  p++;
+  return header_from(&p, name, len);
+}
+
+/* http_date - parse an HTTP-date of len bytes; returns -1 if invalid */
+time_t http_date(const char *s, size_t len)
+{
+  static const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",        /* IMF-fixdate */
+    "%A, %d-%b-%y %H:%M:%S GMT",        /* obsolete RFC 850 */
+    "%a %b %e %H:%M:%S %Y",             /* asctime() */
+  };
+  char buf[64], *end;
+  struct tm tm;
+  size_t i;
+
+  if (len >= sizeof(buf))
+    return -1;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(buf, formats[i], &tm)) && *end == '\0')
+      return timegm(&tm);
+  }
+  return -1;
+}
+
+/*
+ * Whether the n-byte directive at v is name, bare or with an argument;
+ * points *arg at the argument, or sets it to NULL.
+ */
+static int directive_is(const char *v, size_t n, const char *name,
+                        const char **arg)
+{
+  size_t k = strlen(name);
+
+  if (n < k || strncasecmp(v, name, k) != 0)
+    return 0;
+  for (v += k, n -= k; n > 0 && isspace((unsigned char)*v); v++, n--)
+    ;
+  *arg = NULL;
+  if (n == 0)
+    return 1;
+  if (*v != '=')
+    return 0;
+  *arg = v + 1;
+  return 1;
+}
+
+/* Reads a delta-seconds argument, possibly quoted; -1 if there is none */
+static long delta_seconds(const char *arg)
+{
+  long n;
+
+  if (!arg)
+    return -1;
+  if (*arg == '"')
+    arg++;
+  if (!isdigit((unsigned char)*arg))
+    return -1;
+  n = strtol(arg, NULL, 10);
+  return n > 0x7fffffff ? 0x7fffffff : n;
+}
+
+/* Whether the value of the header at v (n bytes) is exactly word */
+static int value_is(const char *v, size_t n, const char *word)
+{
+  return n == strlen(word) && strncasecmp(v, word, n) == 0;
+}
+
+/*
+ * http_freshness - work out from the response head hdrs, received at
+ *     now, whether a shared cache may store the response, until when it
+ *     is fresh and until when it may be served stale.  default_ttl is
+ *     the lifetime of a response that gives no expiry and no
+ *     Last-Modified; default_swr the stale window of one that allows it.
+ */
+void http_freshness(const char *hdrs, time_t now, int default_ttl,
+                    int default_swr, struct http_fresh *f)
+{
+  const char *p, *v, *tok, *end, *arg;
+  long max_age = -1, s_maxage = -1, age = 0, swr = 0;
+  int no_cache = 0, has_cc = 0, revalidate = 0;
+  time_t date, when, lifetime, current_age;
+  size_t len, n;
+
+  f->storable = 1;
+  f->expires = f->stale_until = now;
+  if (!(p = strchr(hdrs, '\n')))
+    return;
+  for (p++; (v = header_from(&p, "Cache-Control", &len)); has_cc = 1) {
+    for (end = v + len; v < end; v = tok + 1) {
+      if (!(tok = memchr(v, ',', end - v)))
+        tok = end;
+      while (v < tok && isspace((unsigned char)*v))
+        v++;
+      n = tok - v;
+      if (directive_is(v, n, "no-store", &arg) ||
+          directive_is(v, n, "private", &arg))
+        f->storable = 0;
+      else if (directive_is(v, n, "no-cache", &arg))
+        no_cache = 1;
+      else if (directive_is(v, n, "s-maxage", &arg))
+        s_maxage = delta_seconds(arg);
+      else if (directive_is(v, n, "max-age", &arg))
+        max_age = delta_seconds(arg);
+      else if (directive_is(v, n, "stale-while-revalidate", &arg))
+        swr = delta_seconds(arg);
+      else if (directive_is(v, n, "must-revalidate", &arg) ||
+               directive_is(v, n, "proxy-revalidate", &arg))
+        revalidate = 1;
+    }
+  }
+  if (!has_cc && (v = http_header(hdrs, "Pragma", &len)) &&
+      value_is(v, len, "no-cache"))
+    no_cache = 1;
+  /* The key is the URL alone, so only a variant by encoding is safe,
+   * and only when this one is not encoded */
+  if ((v = http_header(hdrs, "Vary", &len)) &&
+      (!value_is(v, len, "Accept-Encoding") ||
+       http_header(hdrs, "Content-Encoding", &n)))
+    f->storable = 0;
+  if (!f->storable)
+    return;
+
+  if (!(v = http_header(hdrs, "Date", &len)) || (date = http_date(v, len)) < 0)
+    date = now;
+  if ((v = http_header(hdrs, "Age", &len)) && isdigit((unsigned char)*v))
+    age = atol(v);
+
+  if (no_cache)
+    lifetime = 0;
+  else if (s_maxage >= 0)
+    lifetime = s_maxage;
+  else if (max_age >= 0)
+    lifetime = max_age;
+  else if ((v = http_header(hdrs, "Expires", &len)))
+    /* An invalid Expires, such as "0", means already expired */
+    lifetime = (when = http_date(v, len)) < 0 ? 0 : when - date;
+  else if ((v = http_header(hdrs, "Last-Modified", &len)) &&
+           (when = http_date(v, len)) >= 0 && when <= date)
+    lifetime = (date - when) / 10 < HTTP_HEURISTIC_MAX ?
+               (date - when) / 10 : HTTP_HEURISTIC_MAX;
+  else
+    lifetime = default_ttl;
+
+  current_age = now - date > age ? now - date : age;
+  f->expires = now - current_age + lifetime;
+  if (!revalidate && !no_cache && s_maxage < 0)
+    f->stale_until = f->expires + (swr > default_swr ? swr : default_swr);
+  else
+    f->stale_until = f->expires;
+}
+
+/* Whether a response head carries a validator to revalidate it with */
+int http_has_validator(const char *hdrs)
+{
+  size_t len;
+
+  return http_header(hdrs, "ETag", &len) ||
+         http_header(hdrs, "Last-Modified", &len);
+}
+
+/* Headers a 304 may not change in the stored head (RFC 9111 4.3.4) */
+static int keep_stored(const char *line, size_t n)
+{
+  static const char *names[] = {
+    "Content-Length", "Content-Encoding", "Transfer-Encoding",
+    "Connection", "Proxy-Connection", "Keep-Alive",
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if (n == strlen(names[i]) && strncasecmp(line, names[i], n) == 0)
+      return 1;
+  return 0;
+}
+
+/* Steps over a header line; sets *n to the length of its name */
+static const char *line_next(const char *line, size_t *n)
+{
+  const char *colon = line + strcspn(line, ":\n");
+
+  *n = *colon == ':' ? (size_t)(colon - line) : 0;
+  return strchr(line, '\n') + 1;
+}
+
+/*
+ * Appends the header line at line (through its '\n') to out as a CRLF
+ * line; returns 0 if it does not fit in size.
+ */
+static int line_copy(const char *line, char *out, size_t *pos, size_t size)
+{
+  size_t len = strchr(line, '\n') - line;
+
+  if (len > 0 && line[len - 1] == '\r')
+    len--;
+  if (*pos + len + 2 > size)
+    return 0;
+  memcpy(out + *pos, line, len);
+  memcpy(out + *pos + len, "\r\n", 2);
+  *pos += len + 2;
+  return 1;
+}
+
+/*
+ * http_refresh - write to out (size bytes) the stored response head
+ *     updated with the header fields of the 304 head notmod: those it
+ *     carries replace the stored ones, except for the framing and
+ *     encoding.  Returns the length, or 0 if it would not fit.
+ */
+size_t http_refresh(const char *stored, const char *notmod, char *out,
+                    size_t size)
+{
+  const char *line, *next, *first = strchr(notmod, '\n') + 1;
+  size_t pos = 0, n, len;
+  char name[MAXLINE];
+
+  if (!line_copy(stored, out, &pos, size))   /* the stored status line */
+    return 0;
+  for (line = strchr(stored, '\n') + 1; *line != '\r' && *line != '\n';
+       line = next) {
+    next = line_next(line, &n);
+    if (n > 0 && n < sizeof(name) && !keep_stored(line, n)) {
+      memcpy(name, line, n);
+      name[n] = '\0';
+      if (http_header(notmod, name, &len))
+        continue;
+    }
+    if (!line_copy(line, out, &pos, size))
+      return 0;
+  }
+  for (line = first; *line != '\r' && *line != '\n'; line = next) {
+    next = line_next(line, &n);
+    if (n > 0 && !keep_stored(line, n) && !line_copy(line, out, &pos, size))
+      return 0;
+  }
+  if (pos + 2 > size)
+    return 0;
+  memcpy(out + pos, "\r\n", 2);
+  return pos + 2;
+}
+
+/* Whether the entity tag etag is in the If-None-Match list (weakly) */
+static int etag_listed(const char *list, size_t len, const char *etag,
+                       size_t elen)
+{
+  const char *v = list, *end = list + len, *tok;
+  size_t n;
+
+  if (elen >= 2 && strncmp(etag, "W/", 2) == 0) {
+    etag += 2;
+    elen -= 2;
+  }
+  for (; v < end; v = tok + 1) {
+    if (!(tok = memchr(v, ',', end - v)))
+      tok = end;
+    while (v < tok && isspace((unsigned char)*v))
+      v++;
+    for (n = tok - v; n > 0 && isspace((unsigned char)v[n - 1]); n--)
+      ;
+    if (n == 1 && *v == '*')
+      return 1;
+    if (n >= 2 && strncmp(v, "W/", 2) == 0) {
+      v += 2;
+      n -= 2;
+    }
+    if (n == elen && memcmp(v, etag, n) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * http_not_modified - whether the conditional request head req is
+ *     answered by 304 Not Modified for the cached response head resp.
+ *     If-None-Match takes precedence over If-Modified-Since.
+ */
+int http_not_modified(const char *req, const char *resp)
+{
+  const char *v, *etag;
+  size_t len, elen;
+  time_t since, modified;
+
+  if ((v = http_header(req, "If-None-Match", &len)))
+    return (etag = http_header(resp, "ETag", &elen)) ?
+           etag_listed(v, len, etag, elen) :
+           len == 1 && *v == '*';
+  if (!(v = http_header(req, "If-Modified-Since", &len)) ||
+      (since = http_date(v, len)) < 0)
+    return 0;
+  return (v = http_header(resp, "Last-Modified", &len)) &&
+         (modified = http_date(v, len)) >= 0 && modified <= since;
+}
+
+/*
+ * http_not_modified_head - write to out (size bytes) a 304 head for
+ *     the cached response head resp.  Returns the length, or 0 if it
+ *     would not fit.
+ */
+size_t http_not_modified_head(const char *resp, char *out, size_t size)
+{
+  static const char *names[] = {
+    "Date", "ETag", "Last-Modified", "Cache-Control", "Expires", "Vary",
+    "Content-Location",
+  };
+  const char *v;
+  size_t i, len;
+  int n, pos;
+
+  pos = snprintf(out, size, "HTTP/1.0 304 Not Modified\r\n");
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (!(v = http_header(resp, names[i], &len)))
+      continue;
+    n = snprintf(out + pos, size - pos, "%s: %.*s\r\n", names[i], (int)len, v);
+    if (n < 0 || (size_t)(pos += n) >= size)
+      return 0;
+  }
+  n = snprintf(out + pos, size - pos, "\r\n");
+  if (n < 0 || (size_t)(pos += n) >= size)
+    return 0;
+  return pos;
+}
+
+/* Parses the decimal number at p (before end); returns its digit count */
+static size_t range_number(const char *p, const char *end, size_t *v)
+{
+  const char *s = p;
+
+  for (*v = 0; p < end && isdigit((unsigned char)*p); p++)
+    *v = *v > ((size_t)-1 - 9) / 10 ? (size_t)-1 : *v * 10 + (*p - '0');
+  return p - s;
+}
+
+/*
+ * http_ranges - resolve the Range header value spec (len bytes) against
+ *     a representation of size bytes into at most HTTP_MAX_RANGES
+ *     ranges at r, in the order asked.  Returns how many, 0 if none is
+ *     satisfiable, or -1 if the header is to be ignored: not in bytes,
+ *     malformed, or asking for too many ranges.
+ */
+int http_ranges(const char *spec, size_t len, size_t size,
+                struct http_range *r)
+{
+  const char *p = spec, *end = spec + len, *tok, *q;
+  size_t first, last, d;
+  int n = 0, sets = 0;
+
+  if (len < 6 || strncasecmp(spec, "bytes=", 6) != 0)
+    return -1;
+  for (p += 6; p < end; p = tok + 1) {
+    if (!(tok = memchr(p, ',', end - p)))
+      tok = end;
+    while (p < tok && isspace((unsigned char)*p))
+      p++;
+    for (q = tok; q > p && isspace((unsigned char)q[-1]); q--)
+      ;
+    if (p == q)
+      continue;
+    if (++sets > HTTP_MAX_RANGES)
+      return -1;
+    if (*p == '-') {                    /* the last d bytes */
+      if (!(d = range_number(p + 1, q, &last)) || p + 1 + d != q)
+        return -1;
+      if (last == 0 || size == 0)
+        continue;
+      first = last >= size ? 0 : size - last;
+      last = size - 1;
+    } else {
+      if (!(d = range_number(p, q, &first)) || p[d] != '-')
+        return -1;
+      p += d + 1;
+      if (p == q)
+        last = (size_t)-1;
+      else if (!(d = range_number(p, q, &last)) || p + d != q || last < first)
+        return -1;
+      if (first >= size)
+        continue;
+      if (last >= size)
+        last = size - 1;
+    }
+    r[n].first = first;
+    r[n++].last = last;
+  }
+  return sets ? n : -1;
+}
+
+/*
+ * http_if_range - whether the Range of request head req applies to the
+ *     cached response head resp: it has no If-Range, or the entity tag
+ *     or date there matches resp's strongly.
+ */
+int http_if_range(const char *req, const char *resp)
+{
+  const char *v, *etag;
+  size_t len, elen;
+  time_t when;
+
+  if (!(v = http_header(req, "If-Range", &len)))
+    return 1;
+  if (*v == '"' || (len >= 2 && strncmp(v, "W/", 2) == 0))
+    return *v == '"' && (etag = http_header(resp, "ETag", &elen)) &&
+           elen == len && memcmp(v, etag, len) == 0;
+  return (when = http_date(v, len)) >= 0 &&
+         (v = http_header(resp, "Last-Modified", &len)) &&
+         http_date(v, len) == when;
+}
+
+/*
+ * Appends the header lines of resp to out, but for those that frame
+ * its body (and the header called drop, if not NULL); returns 0 if
+ * they do not fit in size.
+ */
+static int copy_unframed(const char *resp, const char *drop, char *out,
+                         size_t *pos, size_t size)
+{
+  const char *framing[] = {
+    "Content-Length", "Content-Range", "Transfer-Encoding", drop,
+  };
+  const char *line, *next;
+  size_t i, k, nf = drop ? 4 : 3;
+
+  for (line = strchr(resp, '\n') + 1; *line != '\r' && *line != '\n';
+       line = next) {
+    next = line_next(line, &k);
+    for (i = 0; i < nf; i++)
+      if (k == strlen(framing[i]) && strncasecmp(line, framing[i], k) == 0)
+        break;
+    if (i == nf && !line_copy(line, out, pos, size))
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * http_partial_head - write to out (outsize bytes) the 206 head for n
+ *     ranges r of the size-byte body of the cached response head resp,
+ *     with a body of length bytes: one range has a Content-Range, more
+ *     are a multipart/byteranges body with the given boundary.  Returns
+ *     the length, or 0 if it would not fit.
+ */
+size_t http_partial_head(const char *resp, const struct http_range *r, int n,
+                         size_t size, const char *boundary, size_t length,
+                         char *out, size_t outsize)
+{
+  size_t pos;
+  int m;
+
+  /* A multipart body has a Content-Type per part instead */
+  pos = snprintf(out, outsize, "HTTP/1.0 206 Partial Content\r\n");
+  if (!copy_unframed(resp, n > 1 ? "Content-Type" : NULL, out, &pos,
+                     outsize))
+    return 0;
+  if (n == 1)
+    m = snprintf(out + pos, outsize - pos, "Content-Range: bytes %zu-%zu/%zu"
+                 "\r\n", r->first, r->last, size);
+  else
+    m = snprintf(out + pos, outsize - pos, "Content-Type: multipart/"
+                 "byteranges; boundary=%s\r\n", boundary);
+  if (m < 0 || (pos += m) >= outsize)
+    return 0;
+  m = snprintf(out + pos, outsize - pos, "Content-Length: %zu\r\n\r\n",
+               length);
+  if (m < 0 || (pos += m) >= outsize)
+    return 0;
+  return pos;
+}
+
+/*
+ * http_byteranges - return a Malloc()ed multipart/byteranges body for
+ *     n ranges r of the size-byte body of the cached response head
+ *     resp, each part carrying its Content-Type, and its length in *len.
+ */
+char *http_byteranges(const char *resp, const char *body, size_t size,
+                      const struct http_range *r, int n,
+                      const char *boundary, size_t *len)
+{
+  const char *type;
+  size_t tlen = 0, cap, pos = 0;
+  char *buf;
+  int i;
+
+  type = http_header(resp, "Content-Type", &tlen);
+  cap = strlen(boundary) + 16;
+  for (i = 0; i < n; i++)
+    cap += strlen(boundary) + tlen + 128 + r[i].last - r[i].first + 1;
+  buf = Malloc(cap);
+  for (i = 0; i < n; i++) {
+    pos += sprintf(buf + pos, "\r\n--%s\r\n", boundary);
+    if (type)
+      pos += sprintf(buf + pos, "Content-Type: %.*s\r\n", (int)tlen, type);
+    pos += sprintf(buf + pos, "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                   r[i].first, r[i].last, size);
+    memcpy(buf + pos, body + r[i].first, r[i].last - r[i].first + 1);
+    pos += r[i].last - r[i].first + 1;
+  }
+  pos += sprintf(buf + pos, "\r\n--%s--\r\n", boundary);
+  *len = pos;
+  return buf;
+}
+
+/* http_unsatisfiable_head - write the 416 head for a size-byte body */
+size_t http_unsatisfiable_head(size_t size, char *out, size_t outsize)
+{
+  int n = snprintf(out, outsize, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                   "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n"
+                   "\r\n", size);
+
+  return n < 0 || (size_t)n >= outsize ? 0 : n;
+}
+
+/*
+ * http_content_range - parse the Content-Range of a 206 head hdrs into
+ *     its first and last byte and the size of the whole.  Returns 0 if
+ *     it has none, or one with an unknown size.
+ */
+int http_content_range(const char *hdrs, size_t *first, size_t *last,
+                       size_t *size)
+{
+  const char *v, *end;
+  size_t len, d;
+
+  if (!(v = http_header(hdrs, "Content-Range", &len)) || len < 6 ||
+      strncasecmp(v, "bytes ", 6) != 0)
+    return 0;
+  end = v + len;
+  v += 6;
+  if (!(d = range_number(v, end, first)) || v[d] != '-')
+    return 0;
+  v += d + 1;
+  if (!(d = range_number(v, end, last)) || v[d] != '/')
+    return 0;
+  v += d + 1;
+  return (d = range_number(v, end, size)) && v + d == end &&
+         *first <= *last && *last < *size;
+}
+
+/*
+ * http_full_head - write to out (outsize bytes) the 200 head for the
+ *     whole size-byte representation that the 200 or 206 head resp
+ *     describes (some of).  Returns the length, or 0 if it would not
+ *     fit.
+ */
+size_t http_full_head(const char *resp, size_t size, char *out,
+                      size_t outsize)
+{
+  size_t pos;
+  int m;
+
+  pos = snprintf(out, outsize, "HTTP/1.0 200 OK\r\n");
+  if (!copy_unframed(resp, NULL, out, &pos, outsize))
+    return 0;
+  m = snprintf(out + pos, outsize - pos, "Content-Length: %zu\r\n\r\n", size);
+  if (m < 0 || (pos += m) >= outsize)
+    return 0;
+  return pos;
+}
+
+/*
+ * http_accepts_gzip - whether the request head req has an
+ *     Accept-Encoding that takes gzip (or anything) at a nonzero q
+ */
+int http_accepts_gzip(const char *req)
+{
+  const char *v, *end, *tok, *q;
+  size_t len, n;
+
+  if (!(v = http_header(req, "Accept-Encoding", &len)))
+    return 0;
+  for (end = v + len; v < end; v = tok + 1) {
+    if (!(tok = memchr(v, ',', end - v)))
+      tok = end;
+    while (v < tok && isspace((unsigned char)*v))
+      v++;
+    for (n = 0; v + n < tok && v[n] != ';' && !isspace((unsigned char)v[n]);
+         n++)
+      ;
+    if (!((n == 4 && strncasecmp(v, "gzip", 4) == 0) ||
+          (n == 6 && strncasecmp(v, "x-gzip", 6) == 0) ||
+          (n == 1 && *v == '*')))
+      continue;
+    if (!(q = memchr(v, ';', tok - v)))
+      return 1;
+    for (q++; q < tok && isspace((unsigned char)*q); q++)
+      ;
+    return !(q + 1 < tok && (*q == 'q' || *q == 'Q') && q[1] == '=' &&
+             strtod(q + 2, NULL) == 0);
+  }
+  return 0;
+}
+
+/*
+ * http_gzip_head - write to out (outsize bytes) the head of the cached
+ *     response head resp for its body gzipped to size bytes: with
+ *     Content-Encoding and Vary, and its ETag made weak, since the
+ *     bytes are not the origin's.  Returns the length, or 0 if it
+ *     would not fit.
+ */
+size_t http_gzip_head(const char *resp, size_t size, char *out,
+                      size_t outsize)
+{
+  const char *etag;
+  size_t pos = 0, len;
+  int m;
+
+  if (!line_copy(resp, out, &pos, outsize) ||
+      !copy_unframed(resp, "ETag", out, &pos, outsize))
+    return 0;
+  if ((etag = http_header(resp, "ETag", &len))) {
+    m = snprintf(out + pos, outsize - pos, "ETag: %s%.*s\r\n",
+                 strncmp(etag, "W/", 2) == 0 ? "" : "W/", (int)len, etag);
+    if (m < 0 || (pos += m) >= outsize)
+      return 0;
+  }
+  m = snprintf(out + pos, outsize - pos, "Content-Encoding: gzip\r\n"
+               "Vary: Accept-Encoding\r\nContent-Length: %zu\r\n\r\n",
+               size);
+  if (m < 0 || (pos += m) >= outsize)
+    return 0;
+  return pos;
+}
@@ -0,0 +1,58 @@
+/*
+ * http.h - HTTP response header parsing for the cache
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include <time.h>
+
+/* Longest heuristic freshness lifetime, in seconds */
+#define HTTP_HEURISTIC_MAX (24 * 60 * 60)
+
+/* Most ranges honoured in one Range header; more and it is ignored */
+#define HTTP_MAX_RANGES 16
+
+/* A satisfiable byte range, inclusive */
+struct http_range {
+  size_t first, last;
+};
+
+/* How long a response may be served from a shared cache */
+struct http_fresh {
+  int storable;                   /* may be cached at all */
+  time_t expires;                 /* fresh until then */
+  time_t stale_until;             /* then stale, but may be served while
+                                     it is refreshed, until this */
+};
+
+size_t http_head_len(const char *buf, size_t len);
+int http_status(const char *hdrs, size_t len);
+const char *http_header(const char *hdrs, const char *name, size_t *len);
+time_t http_date(const char *s, size_t len);
+void http_freshness(const char *hdrs, time_t now, int default_ttl,
+                    int default_swr, struct http_fresh *f);
+int http_has_validator(const char *hdrs);
+size_t http_refresh(const char *stored, const char *notmod, char *out,
+                    size_t size);
+int http_not_modified(const char *req, const char *resp);
+size_t http_not_modified_head(const char *resp, char *out, size_t size);
+int http_ranges(const char *spec, size_t len, size_t size,
+                struct http_range *r);
+int http_if_range(const char *req, const char *resp);
+size_t http_partial_head(const char *resp, const struct http_range *r, int n,
+                         size_t size, const char *boundary, size_t length,
+                         char *out, size_t outsize);
+char *http_byteranges(const char *resp, const char *body, size_t size,
+                      const struct http_range *r, int n,
+                      const char *boundary, size_t *len);
+size_t http_unsatisfiable_head(size_t size, char *out, size_t outsize);
+int http_content_range(const char *hdrs, size_t *first, size_t *last,
+                       size_t *size);
+size_t http_full_head(const char *resp, size_t size, char *out,
+                      size_t outsize);
+int http_accepts_gzip(const char *req);
+size_t http_gzip_head(const char *resp, size_t size, char *out,
+                      size_t outsize);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,477 @@
+/*
+ * policy.c - eviction policies for the object cache
+ *
+ * lru      - one recency list; evicts the least recently used object.
+ *
+ * tinylfu  - W-TinyLFU.  New objects enter a small LRU window (1% of
+ *            the budget).  Objects pushed out of the window must win
+ *            a frequency contest against the victim of the main area
+ *            to stay; the main area is a segmented LRU (probation, and
+ *            a protected segment for objects hit while on probation).
+ *            Frequencies come from a count-min sketch of 4-bit
+ *            counters over every lookup, halved every sample period so
+ *            old popularity fades, behind a Bloom filter "doorkeeper"
+ *            that absorbs keys seen only once.  A scan of one-hit
+ *            keys therefore churns through the window and leaves the
+ *            hot set in the main area alone.
+ *
+ * clock    - CLOCK (second chance).  One FIFO; a hit only sets the
+ *            object's reference bit, and eviction moves referenced
+ *            objects back to the head, clearing the bit, until it finds
+ *            an unreferenced one.
+ *
+ * s3fifo   - S3-FIFO.  New objects enter a small FIFO (10% of the
+ *            budget); those hit while there move on to the main FIFO,
+ *            the rest are evicted and remembered in a ghost table of
+ *            hashes, so that their next insert goes straight to main.
+ *            Main is a CLOCK with a two-bit hit counter.
+ *
+ * clock and s3fifo never reorder a list on a hit, so hits take no
+ * policy lock at all: a relaxed load, and a store only if the counter
+ * is not saturated yet, which leaves hot objects' cache lines clean.
+ */
+#include "policy.h"
+
+void policy_list_push(struct policy_list *l, cache_obj_t *obj)
+{
+  obj->prev = NULL;
+  obj->next = l->head;
+  if (l->head)
+    l->head->prev = obj;
+  l->head = obj;
+  if (!l->tail)
+    l->tail = obj;
+  l->bytes += obj->size;
+}
+
+void policy_list_unlink(struct policy_list *l, cache_obj_t *obj)
+{
+  if (obj->prev)
+    obj->prev->next = obj->next;
+  else
+    l->head = obj->next;
+  if (obj->next)
+    obj->next->prev = obj->prev;
+  else
+    l->tail = obj->prev;
+  obj->prev = obj->next = NULL;
+  l->bytes -= obj->size;
+}
+
+static void list_move(struct policy_list *from, struct policy_list *to,
+                      cache_obj_t *obj)
+{
+  policy_list_unlink(from, obj);
+  policy_list_push(to, obj);
+}
+
+/*
+ * LRU
+ */
+static int lru_init(struct policy *p, size_t capacity, void *(*alloc)(size_t))
+{
+  p->capacity = capacity;
+  return 0;
+}
+
+static void lru_insert(struct policy *p, cache_obj_t *obj)
+{
+  policy_list_push(&p->q[0], obj);
+}
+
+static void lru_hit(struct policy *p, cache_obj_t *obj)
+{
+  if (obj != p->q[0].head)
+    list_move(&p->q[0], &p->q[0], obj);
+}
+
+static void lru_remove(struct policy *p, cache_obj_t *obj)
+{
+  policy_list_unlink(&p->q[0], obj);
+}
+
+static cache_obj_t *lru_evict(struct policy *p)
+{
+  cache_obj_t *obj = p->q[0].tail;
+
+  if (obj)
+    policy_list_unlink(&p->q[0], obj);
+  return obj;
+}
+
+const struct policy_ops policy_lru = {
+  "lru", 0, lru_init, NULL, lru_insert, lru_hit, lru_remove, lru_evict
+};
+
+/*
+ * W-TinyLFU
+ */
+#define Q_WINDOW    0
+#define Q_PROBATION 1
+#define Q_PROTECTED 2
+
+#define SKETCH_ROWS 4
+#define WORD_BITS   (8 * sizeof(unsigned long))
+
+static const unsigned long sketch_seed[SKETCH_ROWS] = {
+  0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+  0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL
+};
+
+/* Counter number of hash h in row i */
+static size_t sketch_index(struct policy *p, unsigned long h, int i)
+{
+  return ((size_t)i << p->width_bits) +
+         ((h * sketch_seed[i]) >> (64 - p->width_bits));
+}
+
+static int sketch_get(struct policy *p, size_t idx)
+{
+  return (p->sketch[idx / 16] >> (4 * (idx % 16))) & 0xf;
+}
+
+static int sketch_estimate(struct policy *p, unsigned long h)
+{
+  int i, n, min = 15;
+
+  for (i = 0; i < SKETCH_ROWS; i++)
+    if ((n = sketch_get(p, sketch_index(p, h, i))) < min)
+      min = n;
+  return min;
+}
+
+static void sketch_increment(struct policy *p, unsigned long h)
+{
+  size_t idx;
+  int i;
+
+  for (i = 0; i < SKETCH_ROWS; i++) {
+    idx = sketch_index(p, h, i);
+    if (sketch_get(p, idx) < 15)
+      p->sketch[idx / 16] += 1UL << (4 * (idx % 16));
+  }
+}
+
+/* Doorkeeper bits: two probes into 8 bits per sketch counter */
+static size_t door_bit(struct policy *p, unsigned long h, int i)
+{
+  return (h * sketch_seed[i + 2]) >> (64 - p->width_bits - 3);
+}
+
+static int door_test(struct policy *p, unsigned long h)
+{
+  size_t a = door_bit(p, h, 0), b = door_bit(p, h, 1);
+
+  return (p->doorkeeper[a / WORD_BITS] >> (a % WORD_BITS) & 1) &&
+         (p->doorkeeper[b / WORD_BITS] >> (b % WORD_BITS) & 1);
+}
+
+static void door_set(struct policy *p, unsigned long h)
+{
+  size_t a = door_bit(p, h, 0), b = door_bit(p, h, 1);
+
+  p->doorkeeper[a / WORD_BITS] |= 1UL << (a % WORD_BITS);
+  p->doorkeeper[b / WORD_BITS] |= 1UL << (b % WORD_BITS);
+}
+
+static int tinylfu_frequency(struct policy *p, unsigned long h)
+{
+  return sketch_estimate(p, h) + door_test(p, h);
+}
+
+static size_t sketch_words(struct policy *p)
+{
+  return ((size_t)SKETCH_ROWS << p->width_bits) / 16;
+}
+
+static size_t door_words(struct policy *p)
+{
+  return ((size_t)8 << p->width_bits) / WORD_BITS;
+}
+
+static int tinylfu_init(struct policy *p, size_t capacity,
+                        void *(*alloc)(size_t))
+{
+  /* One counter per 1 KB of budget, at least 1024 */
+  p->width_bits = 10;
+  while (((size_t)1 << p->width_bits) < capacity / 1024)
+    p->width_bits++;
+  if (!(p->sketch = alloc(sketch_words(p) * sizeof(unsigned long))) ||
+      !(p->doorkeeper = alloc(door_words(p) * sizeof(unsigned long))))
+    return -1;
+  memset(p->sketch, 0, sketch_words(p) * sizeof(unsigned long));
+  memset(p->doorkeeper, 0, door_words(p) * sizeof(unsigned long));
+  p->sample_size = 10L << p->width_bits;
+  p->capacity = capacity;
+  p->window_max = capacity / 100;
+  p->protected_max = (capacity - p->window_max) / 5 * 4;
+  return 0;
+}
+
+/* Ages the sketch: halves every counter and empties the doorkeeper */
+static void tinylfu_reset(struct policy *p)
+{
+  size_t i;
+
+  for (i = 0; i < sketch_words(p); i++)
+    p->sketch[i] = (p->sketch[i] >> 1) & 0x7777777777777777UL;
+  memset(p->doorkeeper, 0, door_words(p) * sizeof(unsigned long));
+  p->samples /= 2;
+}
+
+static void tinylfu_record(struct policy *p, unsigned long hash)
+{
+  if (++p->samples >= p->sample_size)
+    tinylfu_reset(p);
+  if (!door_test(p, hash))
+    door_set(p, hash);
+  else
+    sketch_increment(p, hash);
+}
+
+static void tinylfu_insert(struct policy *p, cache_obj_t *obj)
+{
+  obj->queue = Q_WINDOW;
+  policy_list_push(&p->q[Q_WINDOW], obj);
+}
+
+static void tinylfu_hit(struct policy *p, cache_obj_t *obj)
+{
+  struct policy_list *prot = &p->q[Q_PROTECTED];
+  cache_obj_t *demoted;
+
+  if (obj->queue != Q_PROBATION) {
+    list_move(&p->q[obj->queue], &p->q[obj->queue], obj);
+    return;
+  }
+  obj->queue = Q_PROTECTED;
+  list_move(&p->q[Q_PROBATION], prot, obj);
+  while (prot->bytes > p->protected_max && prot->tail != obj) {
+    demoted = prot->tail;
+    demoted->queue = Q_PROBATION;
+    list_move(prot, &p->q[Q_PROBATION], demoted);
+  }
+}
+
+static void tinylfu_remove(struct policy *p, cache_obj_t *obj)
+{
+  policy_list_unlink(&p->q[obj->queue], obj);
+}
+
+/*
+ * The window's overflow moves on to probation while the main area has
+ * room.  Once it is full, each candidate competes with the main area's
+ * victim: the one the sketch has seen less often is evicted, and a
+ * winning candidate takes the victim's place.  With the window in
+ * budget, the main area gives up its least recently used probation
+ * (else protected) object.
+ */
+static cache_obj_t *tinylfu_evict(struct policy *p)
+{
+  struct policy_list *win = &p->q[Q_WINDOW], *main;
+  cache_obj_t *cand, *victim;
+  size_t main_max = p->capacity - p->window_max;
+
+  while (win->tail && win->bytes > p->window_max) {
+    cand = win->tail;
+    main = p->q[Q_PROBATION].tail ? &p->q[Q_PROBATION] : &p->q[Q_PROTECTED];
+    victim = main->tail;
+    if (victim && p->q[Q_PROBATION].bytes + p->q[Q_PROTECTED].bytes +
+                  cand->size > main_max &&
+        tinylfu_frequency(p, cand->hash) <=
+        tinylfu_frequency(p, victim->hash)) {
+      policy_list_unlink(win, cand);
+      return cand;
+    }
+    cand->queue = Q_PROBATION;
+    list_move(win, &p->q[Q_PROBATION], cand);
+    if (victim &&
+        p->q[Q_PROBATION].bytes + p->q[Q_PROTECTED].bytes > main_max) {
+      policy_list_unlink(main, victim);
+      return victim;
+    }
+  }
+  for (main = &p->q[Q_PROBATION]; main <= &p->q[Q_PROTECTED]; main++)
+    if ((victim = main->tail)) {
+      policy_list_unlink(main, victim);
+      return victim;
+    }
+  if ((victim = win->tail))
+    policy_list_unlink(win, victim);
+  return victim;
+}
+
+const struct policy_ops policy_tinylfu = {
+  "tinylfu", 0, tinylfu_init, tinylfu_record, tinylfu_insert, tinylfu_hit,
+  tinylfu_remove, tinylfu_evict
+};
+
+/*
+ * CLOCK and S3-FIFO
+ */
+#define Q_SMALL 0
+#define Q_MAIN  1
+
+/* Counts a hit in obj's ref byte, saturating at max */
+static void ref_hit(cache_obj_t *obj, unsigned char max)
+{
+  unsigned char r = __atomic_load_n(&obj->ref, __ATOMIC_RELAXED);
+
+  if (r < max)
+    __atomic_store_n(&obj->ref, r + 1, __ATOMIC_RELAXED);
+}
+
+/* Takes one hit off obj's ref byte; returns the count before */
+static int ref_take(cache_obj_t *obj)
+{
+  unsigned char r = __atomic_load_n(&obj->ref, __ATOMIC_RELAXED);
+
+  if (r)
+    __atomic_store_n(&obj->ref, r - 1, __ATOMIC_RELAXED);
+  return r;
+}
+
+/* Evicts from a CLOCK list: referenced objects get another round */
+static cache_obj_t *clock_sweep(struct policy_list *l)
+{
+  cache_obj_t *obj;
+
+  while ((obj = l->tail)) {
+    if (!ref_take(obj)) {
+      policy_list_unlink(l, obj);
+      return obj;
+    }
+    list_move(l, l, obj);
+  }
+  return NULL;
+}
+
+static void clock_insert(struct policy *p, cache_obj_t *obj)
+{
+  obj->ref = 0;
+  policy_list_push(&p->q[0], obj);
+}
+
+static void clock_hit(struct policy *p, cache_obj_t *obj)
+{
+  ref_hit(obj, 1);
+}
+
+static cache_obj_t *clock_evict(struct policy *p)
+{
+  return clock_sweep(&p->q[0]);
+}
+
+const struct policy_ops policy_clock = {
+  "clock", 1, lru_init, NULL, clock_insert, clock_hit, lru_remove,
+  clock_evict
+};
+
+static int s3fifo_init(struct policy *p, size_t capacity,
+                       void *(*alloc)(size_t))
+{
+  /* Remember about as many keys as main holds 4 KB objects */
+  p->ghost_size = 1024;
+  while (p->ghost_size < capacity / 4096)
+    p->ghost_size *= 2;
+  if (!(p->ghost = alloc(2 * p->ghost_size * sizeof(unsigned long))) ||
+      !(p->ghost_ring = alloc(p->ghost_size * sizeof(unsigned long))))
+    return -1;
+  memset(p->ghost, 0, 2 * p->ghost_size * sizeof(unsigned long));
+  memset(p->ghost_ring, 0, p->ghost_size * sizeof(unsigned long));
+  p->capacity = capacity;
+  p->small_max = capacity / 10;
+  return 0;
+}
+
+/*
+ * The ghost is a direct-mapped table of hashes, so a key that collides
+ * with a newer one is forgotten early.  The ring expires entries in
+ * eviction order.
+ */
+static unsigned long *ghost_slot(struct policy *p, unsigned long h)
+{
+  return &p->ghost[h & (2 * p->ghost_size - 1)];
+}
+
+static void ghost_add(struct policy *p, unsigned long h)
+{
+  unsigned long *ring = &p->ghost_ring[p->ghost_pos++ & (p->ghost_size - 1)];
+
+  if (*ghost_slot(p, *ring) == *ring)
+    *ghost_slot(p, *ring) = 0;
+  *ring = h;
+  *ghost_slot(p, h) = h;
+}
+
+static void s3fifo_insert(struct policy *p, cache_obj_t *obj)
+{
+  unsigned long *g = ghost_slot(p, obj->hash);
+
+  obj->ref = 0;
+  if (*g == obj->hash) {
+    *g = 0;
+    obj->queue = Q_MAIN;
+  } else
+    obj->queue = Q_SMALL;
+  policy_list_push(&p->q[obj->queue], obj);
+}
+
+static void s3fifo_hit(struct policy *p, cache_obj_t *obj)
+{
+  ref_hit(obj, 3);
+}
+
+static void s3fifo_remove(struct policy *p, cache_obj_t *obj)
+{
+  policy_list_unlink(&p->q[obj->queue], obj);
+}
+
+/*
+ * Small evicts while over its share (or while main is empty): objects
+ * hit since they came in move to main, the rest leave for the ghost.
+ * Otherwise main evicts as a CLOCK.
+ */
+static cache_obj_t *s3fifo_evict(struct policy *p)
+{
+  struct policy_list *small = &p->q[Q_SMALL], *main = &p->q[Q_MAIN];
+  cache_obj_t *obj;
+
+  while ((obj = small->tail) &&
+         (small->bytes > p->small_max || !main->tail)) {
+    policy_list_unlink(small, obj);
+    if (__atomic_load_n(&obj->ref, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&obj->ref, 0, __ATOMIC_RELAXED);
+      obj->queue = Q_MAIN;
+      policy_list_push(main, obj);
+    } else {
+      ghost_add(p, obj->hash);
+      return obj;
+    }
+  }
+  if ((obj = clock_sweep(main)))
+    return obj;
+  if ((obj = small->tail))
+    policy_list_unlink(small, obj);
+  return obj;
+}
+
+const struct policy_ops policy_s3fifo = {
+  "s3fifo", 1, s3fifo_init, NULL, s3fifo_insert, s3fifo_hit, s3fifo_remove,
+  s3fifo_evict
+};
+
+const struct policy_ops *const policies[] = {
+  &policy_lru, &policy_tinylfu, &policy_clock, &policy_s3fifo, NULL
+};
+
+/* Returns the policy called name, or NULL */
+const struct policy_ops *policy_find(const char *name)
+{
+  int i;
+
+  for (i = 0; policies[i]; i++)
+    if (strcmp(policies[i]->name, name) == 0)
+      return policies[i];
+  return NULL;
+}
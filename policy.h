@@ -0,0 +1,63 @@
+/*
+ * policy.h - eviction policies for the object cache
+ *
+ * The cache keeps its index and its byte budget; a policy only decides
+ * the order in which objects leave.  Every call is made with the
+ * cache's policy lock held, except hit() in a policy that sets
+ * lockless_hit: that one may only touch the object's ref byte, with
+ * atomic loads and stores.  A policy threads objects through lists
+ * using their prev/next links and the policy-private queue byte.
+ */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+/* A list of objects, most recently used first */
+struct policy_list {
+  cache_obj_t *head, *tail;
+  size_t bytes;
+};
+
+struct policy {
+  const struct policy_ops *ops;
+  size_t capacity;
+  struct policy_list q[3];        /* meaning is up to the policy */
+
+  /* W-TinyLFU */
+  size_t window_max, protected_max;
+  unsigned long *sketch;          /* count-min sketch, 4-bit counters */
+  unsigned long *doorkeeper;      /* Bloom filter of keys seen once */
+  int width_bits;                 /* counters per sketch row, log2 */
+  long samples, sample_size;      /* counters are halved every sample_size */
+
+  /* S3-FIFO */
+  size_t small_max;
+  unsigned long *ghost;           /* hashes recently evicted from small */
+  unsigned long *ghost_ring;      /* the same, in eviction order */
+  size_t ghost_size, ghost_pos;   /* ring length (a power of 2), next slot */
+};
+
+struct policy_ops {
+  const char *name;
+  int lockless_hit;               /* hit() runs without the policy lock */
+  /* Sets p up for a byte budget; alloc is the cache's allocator */
+  int (*init)(struct policy *p, size_t capacity, void *(*alloc)(size_t));
+  /* Every lookup of a key, hit or miss; may be NULL */
+  void (*record)(struct policy *p, unsigned long hash);
+  void (*insert)(struct policy *p, cache_obj_t *obj);
+  void (*hit)(struct policy *p, cache_obj_t *obj);
+  void (*remove)(struct policy *p, cache_obj_t *obj);
+  /* Unlinks and returns the next object to evict, NULL if empty */
+  cache_obj_t *(*evict)(struct policy *p);
+};
+
+extern const struct policy_ops policy_lru, policy_tinylfu, policy_clock,
+                                policy_s3fifo;
+extern const struct policy_ops *const policies[];     /* NULL terminated */
+
+const struct policy_ops *policy_find(const char *name);
+void policy_list_push(struct policy_list *l, cache_obj_t *obj);
+void policy_list_unlink(struct policy_list *l, cache_obj_t *obj);
+
+#endif /* __POLICY_H__ */
@@ -1,199 +1,339 @@
-#include "csapp.h"
-#include <stdio.h>
-void doit(int fd);
-void read_requesthdrs(int clientfd, rio_t *rio_server, void *request_buf, char *hostname, char *port);
-int parse_uri(char *uri, char *hostname, char *port, char *path);
-void serve_static(int fd, char *filename, int filesize, char *method);
-void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs, char *method);
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
-                 char *longmsg);
+#include "conn.h"
+#include "sbuf.h"
+#include "policy.h"
+#include "snapshot.h"
+#include <getopt.h>
+
 void sigchld_handler(int sig);
+static void fork_loop(int listenfd);
+static void thread_loop(int listenfd);
+static void *worker(void *vargp);
+static void *reporter(void *vargp);
+
+struct proxy_config config = {
+  .mode = MODE_EPOLL,
+  .nthreads = 16,
+  .queue_size = 256,
+  .cache_size = MAX_CACHE_SIZE,
+  .max_object = MAX_OBJECT_SIZE,
+  .segment_size = 1024 * 1024,
+  .policy = "lru",
+  .disk_size = 1024UL * 1024 * 1024,
+  .default_ttl = 300,
+  .refreshes = 16,
+  .negative_ttl = 10,
+  .origin_ttl = 5,
+  .warm_jobs = 8,
+};
+
+/* Long names for the options that have them */
+static struct option long_options[] = {
+  { "warm", required_argument, NULL, 'w' },
+  { "warm-jobs", required_argument, NULL, 'j' },
+  { NULL, 0, NULL, 0 },
+};
+
+static sbuf_t sbuf; /* Shared buffer of connected descriptors */
+
+static void usage(char *prog)
+{
+  fprintf(stderr, "usage: %s [-v] [-m epoll|reuseport|uring|threads|fork] "
+          "[-r reactors] [-t threads] [-q queue] [-c cache-bytes] "
+          "[-o object-bytes] [-p lru|tinylfu|clock|s3fifo] [-D disk-dir] "
+          "[-C disk-bytes] [-P snapshot] [-I secs] [-N] [-T secs] [-W secs] "
+          "[-R refreshes] [-B] [-G segment-bytes] [-z gzip-level] [-e secs] "
+          "[-E secs] [-w|--warm file] [-j|--warm-jobs n] [-S secs] "
+          "<port>\n",
+          prog);
+  exit(1);
+}
 
-static const char *user_agent_hdr =
-    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
-    "Firefox/10.0.3\r\n";
 int main(int argc, char **argv) {
-  int listenfd, connfd;
-  char hostname[MAXLINE], port[MAXLINE];
+  int listenfd, opt;
+  pthread_t tid;
+  /* Check command-line args */
+  while ((opt = getopt_long(argc, argv,
+                            "m:r:t:q:c:o:p:D:C:P:I:NT:W:R:BG:z:e:E:w:j:S:v",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'm':
+      if (!strcmp(optarg, "epoll"))
+        config.mode = MODE_EPOLL;
+      else if (!strcmp(optarg, "reuseport"))
+        config.mode = MODE_REUSEPORT;
+      else if (!strcmp(optarg, "uring"))
+        config.mode = MODE_URING;
+      else if (!strcmp(optarg, "threads"))
+        config.mode = MODE_THREADS;
+      else if (!strcmp(optarg, "fork"))
+        config.mode = MODE_FORK;
+      else
+        usage(argv[0]);
+      break;
+    case 'r':
+      config.nreactors = atoi(optarg);
+      break;
+    case 't':
+      config.nthreads = atoi(optarg);
+      break;
+    case 'q':
+      config.queue_size = atoi(optarg);
+      break;
+    case 'c':
+      config.cache_size = atol(optarg);
+      break;
+    case 'o':
+      config.max_object = atol(optarg);
+      break;
+    case 'p':
+      if (!policy_find(optarg))
+        usage(argv[0]);
+      config.policy = optarg;
+      break;
+    case 'D':
+      config.disk_dir = optarg;
+      break;
+    case 'C':
+      config.disk_size = atol(optarg);
+      break;
+    case 'P':
+      config.snapshot = optarg;
+      break;
+    case 'I':
+      config.snapshot_interval = atoi(optarg);
+      break;
+    case 'N':
+      config.snapshot_index = 1;
+      break;
+    case 'T':
+      config.default_ttl = atoi(optarg);
+      break;
+    case 'W':
+      config.stale_window = atoi(optarg);
+      break;
+    case 'R':
+      config.refreshes = atoi(optarg);
+      break;
+    case 'B':
+      config.range_fetch = 1;
+      break;
+    case 'G':
+      config.segment_size = atol(optarg);
+      break;
+    case 'z':
+      config.gzip_level = atoi(optarg);
+      break;
+    case 'e':
+      config.negative_ttl = atoi(optarg);
+      break;
+    case 'E':
+      config.origin_ttl = atoi(optarg);
+      break;
+    case 'w':
+      config.warm_file = optarg;
+      break;
+    case 'j':
+      config.warm_jobs = atoi(optarg);
+      break;
+    case 'S':
+      config.stats_interval = atoi(optarg);
+      break;
+    case 'v':
+      config.verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || config.nthreads < 1 || config.queue_size < 1 ||
+      config.gzip_level < 0 || config.gzip_level > 9 || config.warm_jobs < 1)
+    usage(argv[0]);
+  /* A client hanging up mid-response must not kill the proxy */
+  Signal(SIGPIPE, SIG_IGN);
+  /* Forked children can only share a cache placed in shared memory */
+  cache_init(config.cache_size, config.max_object, config.mode == MODE_FORK,
+             config.policy);
+  cache_refresh_limit(config.refreshes);
+  cache_gzip(config.gzip_level);
+  /* The disk tier's index is private to one process */
+  if (config.disk_dir && config.mode == MODE_FORK)
+    fprintf(stderr, "disk tier is not available with -m fork\n");
+  else if (config.disk_dir && cache_enabled())
+    disk_init(config.disk_dir, config.disk_size);
+  /* Before any other thread, so that only the snapshot thread takes TERM */
+  if (config.snapshot && cache_enabled()) {
+    snapshot_load(config.snapshot);
+    snapshot_start(config.snapshot, !config.snapshot_index,
+                   config.snapshot_interval);
+  }
+  if (config.stats_interval > 0)
+    Pthread_create(&tid, NULL, reporter, NULL);
+  /* Fetches retry until the listener below is open */
+  if (config.warm_file)
+    warm_start(argv[optind]);
+  if (config.mode == MODE_REUSEPORT) {
+    if (config.nreactors < 1)
+      config.nreactors = reactor_default_count();
+    reactor_run_sharded(argv[optind], config.nreactors);
+    return 0;
+  }
+  listenfd = Open_listenfd(argv[optind]);
+  if (config.mode == MODE_FORK)
+    fork_loop(listenfd);
+  else if (config.mode == MODE_THREADS)
+    thread_loop(listenfd);
+  else if (config.mode == MODE_URING && uring_run(listenfd) == 0)
+    ;
+  else {
+    if (config.mode == MODE_URING)
+      fprintf(stderr, "io_uring not supported, using epoll\n");
+    reactor_run(listenfd);
+  }
+  return 0;
+}
+
+/*
+ * thread_loop - prethreaded model: the main thread only accepts and
+ *     queues descriptors; config.nthreads workers run doit() on them.
+ *     A full queue blocks accept(), which bounds concurrency.
+ */
+static void thread_loop(int listenfd)
+{
+  int i, connfd;
+  pthread_t tid;
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
-  /* Check command-line args */
-  if (argc != 2) {
-  fprintf(stderr, "usage: %s <port>\n", argv[0]);
-  exit(1);
+
+  sbuf_init(&sbuf, config.queue_size);
+  for (i = 0; i < config.nthreads; i++) /* Create worker threads */
+    Pthread_create(&tid, NULL, worker, NULL);
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+      continue;
+    }
+    sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
+  }
+}
+
+static void *worker(void *vargp)
+{
+  Pthread_detach(pthread_self());
+  while (1) {
+    int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+    doit(connfd);                    /* Service client */
   }
+  return NULL;
+}
+
+/* Prints cache and queue-wait statistics every config.stats_interval s */
+static void *reporter(void *vargp)
+{
+  long removed, wait_us, max_wait_us, last = 0, last_wait = 0;
+  int depth;
+  struct cache_stats cs;
+  struct disk_stats ds;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    sleep(config.stats_interval);
+    cache_get_stats(&cs);
+    fprintf(stderr, "cache: %ld objects, %ld bytes, %ld hits, %ld misses, "
+            "%ld collapsed, %ld inserts, %ld evictions, %ld expired, "
+            "%ld revalidated, %ld not modified, %ld served stale, "
+            "%ld refreshes, %ld partial, %ld negative\n", cs.objects, cs.bytes,
+            cs.hits, cs.misses, cs.collapsed, cs.inserts, cs.evictions,
+            cs.expired, cs.revalidated, cs.not_modified, cs.served_stale,
+            cs.refreshes, cs.partial, cs.negative);
+    if (cs.purged || cs.bans)
+      fprintf(stderr, "admin: %ld purged, %ld bans, %ld objects banned\n",
+              cs.purged, cs.bans, cs.banned);
+    if (config.gzip_level > 0)
+      fprintf(stderr, "gzip: %ld objects, %ld bytes saved, %ld us deflating, "
+              "%ld us inflating\n", cs.gzipped, cs.gzip_saved, cs.deflate_us,
+              cs.inflate_us);
+    if (disk_enabled()) {
+      disk_get_stats(&ds);
+      fprintf(stderr, "disk: %ld objects, %ld bytes, %ld hits, %ld writes, "
+              "%ld drops\n", ds.objects, ds.bytes, ds.hits, ds.writes,
+              ds.drops);
+    }
+    if (config.mode != MODE_THREADS)
+      continue;
+    sbuf_stats(&sbuf, &removed, &wait_us, &max_wait_us, &depth);
+    fprintf(stderr, "queue: depth %d/%d, %ld conns, avg wait %ld us "
+            "(interval %ld us), max wait %ld us\n", depth, config.queue_size,
+            removed, removed ? wait_us / removed : 0,
+            removed > last ? (wait_us - last_wait) / (removed - last) : 0,
+            max_wait_us);
+    last = removed;
+    last_wait = wait_us;
+  }
+  return NULL;
+}
+
+/* Legacy model: one child process per accepted connection */
+static void fork_loop(int listenfd)
+{
+  int connfd;
+  char hostname[MAXLINE], port[MAXLINE];
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  sigset_t childmask;
+  sigemptyset(&childmask);
   Signal(SIGCHLD, sigchld_handler);
-  listenfd = Open_listenfd(argv[1]);
   while (1) {
   clientlen = sizeof(clientaddr);
   connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-  Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
-  port, MAXLINE, 0);
-  printf("Accepted connection from (%s, %s)\n", hostname, port);
+  if (config.verbose) {
+    Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
+    port, MAXLINE, 0);
+    printf("Accepted connection from (%s, %s)\n", hostname, port);
+  }
   if (Fork() == 0) {
+    /* snapshot_start() blocked SIGTERM; a child must still die of it */
+    Sigprocmask(SIG_SETMASK, &childmask, NULL);
     Close(listenfd);
     doit(connfd);
-    Close(connfd);
     exit(0);
   }
   Close(connfd);
   }
 }
-void doit(int serverfd)
-{
-  int is_static, clientfd, content_length;
-  struct stat sbuf;
-  char buf[MAXLINE], request_buf[MAXLINE], response_buf[MAXLINE];
-  char method[MAXLINE], uri[MAXLINE], version[MAXLINE], hostname[MAXLINE], port[MAXLINE], path[MAXLINE];
-  rio_t rio_server, rio_client;
-  /* Read request line and headers */
-  Rio_readinitb(&rio_server, serverfd);
-  Rio_readlineb(&rio_server, buf, MAXLINE);
-  printf("Request headers:\n");
-  printf("%s", buf);
-  sscanf(buf, "%s %s %s", method, uri, version);
-  if (!(strcasecmp(method, "GET") == 0 || strcasecmp(method, "HEAD") == 0)) {
-  clienterror(serverfd, method, "501", "Not implemented",
-  "Tiny does not implement this method");
-  return;
-  }
-  /* Check if the request is for favicon.ico and ignore it */
-  if (strstr(uri, "favicon.ico")) {
-      printf("Ignoring favicon.ico request\n");
-      return;  // Just return without sending any response
-  }
-  // Parse URI from GET request
-  if (!parse_uri(uri, hostname, port, path)) {
-      clienterror(serverfd, uri, "400", "Bad Request", "Proxy received a malformed request");
-      return;
-  }
-  printf("!!!!!!! %s %s %s !!!!!!\n", hostname, port, path);
-  sprintf(request_buf, "%s %s %s\r\n", method, path, "HTTP/1.0");
-  clientfd = Open_clientfd(hostname, port);
-  if (clientfd < 0) {
-        fprintf(stderr, "Connection to %s on port %s failed.\n", hostname, port);
-        clienterror(serverfd, "Connection Failed", "5-3", "Service Unavailable", "The proxy server could not retrieve the resource.");
-        return;
-  }
-  Rio_writen(clientfd, request_buf, strlen(request_buf));
-  printf("i will read request\n");
-  read_requesthdrs(clientfd, &rio_server, request_buf, hostname, port);
-  printf("reding request\n");
-  Rio_readinitb(&rio_client, clientfd);
-  while (strcmp(response_buf, "\r\n"))
-  {
-    Rio_readlineb(&rio_client, response_buf, MAXLINE);
-    if (strstr(response_buf, "Content-length")) // Response Body 수신에 사용하기 위해 Content-length 저장
-      content_length = atoi(strchr(response_buf, ':') + 1);
-    Rio_writen(serverfd, response_buf, strlen(response_buf));
-  }
-  printf("send p to s\n");
-  /* :넷: Response Body 읽기 & 전송 [Server -> Proxy -> Client] */
-  char saver[MAXLINE];
-  ssize_t n;
-  ssize_t size = 0;
-  while((n = Rio_readnb(&rio_client, saver, MAXLINE)) > 0)
-  {
-    Rio_writen(serverfd, saver, n);
-    size += n;
-  }
-  printf("responded byted : %d\n", n);
-}
-void read_requesthdrs(int clientfd, rio_t *rio_server, void *request_buf, char *hostname, char *port)
-    {
-      int is_host_exist;
-      int is_connection_exist;
-      int is_proxy_connection_exist;
-      int is_user_agent_exist;
-      Rio_readlineb(rio_server, request_buf, MAXLINE); // 첫번째 줄 읽기
-      while (strcmp(request_buf, "\r\n"))
-      {
-        if (strstr(request_buf, "Proxy-Connection") != NULL)
-        {
-          sprintf(request_buf, "Proxy-Connection: close\r\n");
-          is_proxy_connection_exist = 1;
-        }
-        else if (strstr(request_buf, "Connection") != NULL)
-        {
-          sprintf(request_buf, "Connection: close\r\n");
-          is_connection_exist = 1;
-        }
-        else if (strstr(request_buf, "User-Agent") != NULL)
-        {
-          sprintf(request_buf, user_agent_hdr);
-          is_user_agent_exist = 1;
-        }
-        else if (strstr(request_buf, "Host") != NULL)
-        {
-          is_host_exist = 1;
-        }
-        Rio_writen(clientfd, request_buf, strlen(request_buf)); // Server에 전송
-        Rio_readlineb(rio_server, request_buf, MAXLINE);       // 다음 줄 읽기
-      }
-      // 필수 헤더 미포함 시 추가로 전송
-      if (!is_proxy_connection_exist)
-      {
-        sprintf(request_buf, "Proxy-Connection: close\r\n");
-        Rio_writen(clientfd, request_buf, strlen(request_buf));
-      }
-      if (!is_connection_exist)
-      {
-        sprintf(request_buf, "Connection: close\r\n");
-        Rio_writen(clientfd, request_buf, strlen(request_buf));
-      }
-      if (!is_host_exist)
-      {
-        sprintf(request_buf, "Host: %s:%s\r\n", hostname, port);
-        Rio_writen(clientfd, request_buf, strlen(request_buf));
-      }
-      if (!is_user_agent_exist)
-      {
-        sprintf(request_buf, user_agent_hdr);
-        Rio_writen(clientfd, request_buf, strlen(request_buf));
-      }
-      sprintf(request_buf, "\r\n"); // 종료문
-      Rio_writen(clientfd, request_buf, strlen(request_buf));
-      return;
-    }
-void read_responsehdrs(int serverfd, rio_t *rio_client)
+
+/*
+ * doit - serve one client connection to completion on blocking sockets.
+ *     The request/response steps live in conn.c; closes fd when done.
+ */
+void doit(int fd)
 {
-  char buf[MAXLINE];
-  char *ptr;
-  int content_length = 0;
-  Rio_readlineb(rio_client, buf, MAXLINE);
-  while(strcmp(buf, "\r\n")) {
-    if (ptr = strstr(buf, "Content-length:")) {
-      ptr = strchr(ptr, ':');
-      ptr += 1;
-      while (isspace(*ptr)) ptr += 1;
-      content_length = atoi(ptr);
-    }
-    Rio_writen(serverfd, buf, strlen(buf));
-    printf("%s", buf);
-    Rio_readlineb(rio_client, buf, MAXLINE);
-  }
-  Rio_writen(serverfd, buf, strlen(buf));
-  return content_length;
+  conn_t *c = conn_new(fd, 0);
+  c->can_splice = 1;
+  c->can_sendfile = 1;
+  conn_run(c);
+  conn_free(c);
 }
-void clienterror(int fd, char *cause, char *errnum,
+
+/* Formats a complete error response into buf and returns its length */
+int clienterror(char *buf, char *cause, char *errnum,
 char *shortmsg, char *longmsg)
 {
-char buf[MAXLINE], body[MAXBUF];
+char body[MAXBUF];
+int n;
 /* Build the HTTP response body */
-sprintf(body, "<html><title>Tiny Error</title>");
-sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
- sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
- sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
- /* Print the HTTP response */
- sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
- Rio_writen(fd, buf, strlen(buf));
- sprintf(buf, "Content-type: text/html\r\n");
- Rio_writen(fd, buf, strlen(buf));
- sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
- Rio_writen(fd, buf, strlen(buf));
- Rio_writen(fd, body, strlen(body));
+n = snprintf(body, MAXBUF, "<html><title>Tiny Error</title>"
+             "<body bgcolor=""ffffff"">\r\n"
+             "%s: %s\r\n"
+             "<p>%s: %.512s\r\n"
+             "<hr><em>The Tiny Web server</em>\r\n",
+             errnum, shortmsg, longmsg, cause);
+/* Print the HTTP response */
+return snprintf(buf, MAXBUF, "HTTP/1.0 %s %s\r\n"
+                "Content-type: text/html\r\n"
+                "Content-length: %d\r\n\r\n%s",
+                errnum, shortmsg, n, body);
 }
 int parse_uri(char *uri, char *hostname, char *port, char *path) {
   if (uri == NULL) return 0;
@@ -0,0 +1,62 @@
+/*
+ * proxy.h - declarations shared by the proxy's translation units
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+
+/* Concurrency models, selected with -m */
+#define MODE_EPOLL   0  /* single-threaded edge-triggered epoll reactor */
+#define MODE_FORK    1  /* legacy: one child process per connection */
+#define MODE_THREADS 2  /* prethreaded workers fed by a bounded queue */
+#define MODE_REUSEPORT 3 /* one pinned reactor per CPU, SO_REUSEPORT */
+#define MODE_URING   4  /* io_uring engine, falls back to MODE_EPOLL */
+
+/* Runtime configuration, filled in by main() from the command line */
+struct proxy_config {
+  int mode;
+  int verbose;
+  int nthreads;         /* worker threads (-t) */
+  int queue_size;       /* accepted connections waiting for a worker (-q) */
+  int stats_interval;   /* seconds between stats reports, 0 = off (-S) */
+  int nreactors;        /* reactors for -m reuseport, 0 = one per CPU (-r) */
+  size_t cache_size;    /* object cache budget in bytes, 0 = off (-c) */
+  size_t max_object;    /* largest cacheable response in bytes (-o) */
+  char *policy;         /* eviction policy name (-p) */
+  char *disk_dir;       /* slab files of the disk tier, NULL = off (-D) */
+  size_t disk_size;     /* disk tier budget in bytes (-C) */
+  char *snapshot;       /* snapshot file for warm restarts, NULL = off (-P) */
+  int snapshot_interval; /* seconds between snapshots, 0 = on exit only (-I) */
+  int snapshot_index;   /* leave object bodies out of snapshots (-N) */
+  int default_ttl;      /* seconds fresh when a response says nothing (-T) */
+  int stale_window;     /* seconds stale copies may be served by default (-W) */
+  int refreshes;        /* background refreshes at once, 0 = never stale (-R) */
+  int range_fetch;      /* fetch whole objects after Range misses (-B) */
+  size_t segment_size;  /* large objects are cached in these, 0 = off (-G) */
+  int gzip_level;       /* keep text bodies gzipped at this, 0 = off (-z) */
+  int negative_ttl;     /* seconds 404s and 5xx are cached, at most (-e) */
+  int origin_ttl;       /* seconds an unreachable origin is not retried (-E) */
+  char *warm_file;      /* URLs to fetch into the cache at start (-w) */
+  int warm_jobs;        /* fetches at once while warming (-j) */
+};
+extern struct proxy_config config;
+
+/* proxy.c */
+void doit(int fd);
+int parse_uri(char *uri, char *hostname, char *port, char *path);
+int clienterror(char *buf, char *cause, char *errnum, char *shortmsg,
+                char *longmsg);
+
+/* reactor.c */
+void reactor_run(int listenfd);
+void reactor_run_sharded(char *port, int n);
+int reactor_default_count(void);
+
+/* uring.c */
+int uring_run(int listenfd);
+
+/* warm.c */
+void warm_start(char *port);
+
+#endif /* __PROXY_H__ */
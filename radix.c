@@ -0,0 +1,298 @@
+/*
+ * radix.c - prefix index of the cached objects' URLs
+ *
+ * A crit-bit tree after D. J. Bernstein's: each internal node branches
+ * on one bit, the first bit at which the keys below its two sides
+ * differ, and the leaves are the objects themselves, tagged in the low
+ * bit of the pointer.  The tree holds n - 1 nodes for n keys, all of
+ * one size, so they come from a free list refilled a block at a time
+ * from the cache's allocator (shared memory in the fork model) and are
+ * never given back.
+ *
+ * Keys are compared as NUL-terminated strings.  The objects under a
+ * prefix are the subtree of the last node passed, on the way down
+ * along the prefix, that branches within it; the node's counts are
+ * theirs.  Inserting or removing a key adjusts the counts on its path,
+ * which it has just walked, so that costs no more cache misses.
+ */
+#include "radix.h"
+
+#define RADIX_BLOCK 256                 /* nodes allocated at once */
+#define RADIX_DEPTH 256                 /* deepest a leaf may be */
+
+/* Two to a cache line */
+struct radix_node {
+  void *child[2];
+  long bytes;                           /* below this node */
+  int objects;                          /* and how many */
+  unsigned short byte;                  /* the critical bit's byte */
+  unsigned char otherbits;              /* every bit but that one */
+};
+
+#define IS_LEAF(p)  ((unsigned long)(p) & 1)
+#define LEAF(p)     ((cache_obj_t *)((unsigned long)(p) - 1))
+#define TAG(obj)    ((void *)((unsigned long)(obj) + 1))
+
+void radix_init(struct radix *t, void *(*alloc)(size_t))
+{
+  memset(t, 0, sizeof(*t));
+  t->alloc = alloc;
+}
+
+static struct radix_node *node_alloc(struct radix *t)
+{
+  struct radix_node *q;
+  int i;
+
+  if (!t->free) {
+    if (!(q = t->alloc(RADIX_BLOCK * sizeof(struct radix_node))))
+      return NULL;
+    for (i = 0; i < RADIX_BLOCK; i++) {
+      q[i].child[0] = t->free;
+      t->free = &q[i];
+    }
+    t->nodes += RADIX_BLOCK;
+  }
+  q = t->free;
+  t->free = q->child[0];
+  return q;
+}
+
+static void node_free(struct radix *t, struct radix_node *q)
+{
+  q->child[0] = t->free;
+  t->free = q;
+}
+
+/* Which side of q the key (len bytes) goes */
+static int direction(const struct radix_node *q, const char *key, size_t len)
+{
+  unsigned char c = q->byte < len ? key[q->byte] : 0;
+
+  return (1 + (q->otherbits | c)) >> 8;
+}
+
+/*
+ * Follows key's path down to its leaf, returning the slot holding the
+ * leaf.  The slots of the nodes on the way are stored in path, and
+ * their count in *depth.  Returns NULL if there are more than
+ * RADIX_DEPTH, which takes that many keys each extending the one
+ * before.  The tree is not empty.
+ */
+static void **walk(struct radix *t, const char *key, size_t len,
+                   void ***path, int *depth)
+{
+  void **pp = &t->root;
+  struct radix_node *q;
+
+  for (*depth = 0; !IS_LEAF(*pp); (*depth)++) {
+    if (*depth == RADIX_DEPTH)
+      return NULL;
+    path[*depth] = pp;
+    q = *pp;
+    pp = &q->child[direction(q, key, len)];
+  }
+  return pp;
+}
+
+/* Adds objects and bytes to the counts of the first n nodes of path */
+static void count_path(void ***path, int n, long objects, long bytes)
+{
+  struct radix_node *q;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    q = *path[i];
+    q->objects += objects;
+    q->bytes += bytes;
+  }
+}
+
+/*
+ * radix_insert - index obj under its key, replacing an object already
+ *     there.  Returns -1 if there is no memory for the node it needs,
+ *     or if the key is 64 KB or longer or its path too deep to walk().
+ */
+int radix_insert(struct radix *t, cache_obj_t *obj)
+{
+  const unsigned char *u = (unsigned char *)obj->key;
+  size_t len = obj->keylen, newbyte;
+  void **path[RADIX_DEPTH], **pp;
+  struct radix_node *q, *n;
+  cache_obj_t *old;
+  unsigned bits;
+  int depth, dir, i;
+
+  if (len >= 65535)
+    return -1;
+  if (!t->root) {
+    t->root = TAG(obj);
+    return 0;
+  }
+  /* The key's path ends at the leaf sharing the most of its bits */
+  if (!(pp = walk(t, obj->key, len, path, &depth)))
+    return -1;
+  old = LEAF(*pp);
+  for (newbyte = 0; newbyte < len; newbyte++)
+    if ((unsigned char)old->key[newbyte] != u[newbyte])
+      break;
+  if (newbyte == len && !old->key[len]) {
+    /* The same key: swap the object and adjust the bytes above it */
+    *pp = TAG(obj);
+    count_path(path, depth, 0, (long)obj->size - (long)old->size);
+    return 0;
+  }
+  bits = (unsigned char)old->key[newbyte] ^ u[newbyte];
+  bits |= bits >> 1;
+  bits |= bits >> 2;
+  bits |= bits >> 4;
+  bits = (bits & ~(bits >> 1)) ^ 255;
+  dir = (1 + (bits | (unsigned char)old->key[newbyte])) >> 8;
+  if (!(n = node_alloc(t)))
+    return -1;
+  n->byte = newbyte;
+  n->otherbits = bits;
+  n->child[1 - dir] = TAG(obj);
+
+  /* Hang it above the first node on the path that branches later */
+  for (i = 0; i < depth; i++) {
+    q = *path[i];
+    if (q->byte > newbyte || (q->byte == newbyte && q->otherbits > bits))
+      break;
+  }
+  count_path(path, i, 1, obj->size);
+  if (i < depth)
+    pp = path[i];
+  n->child[dir] = *pp;
+  if (IS_LEAF(*pp)) {
+    n->objects = 2;
+    n->bytes = LEAF(*pp)->size + obj->size;
+  } else {
+    n->objects = ((struct radix_node *)*pp)->objects + 1;
+    n->bytes = ((struct radix_node *)*pp)->bytes + obj->size;
+  }
+  *pp = n;
+  return 0;
+}
+
+/*
+ * Unlinks obj, the leaf in *pp whose parent node is in *parent, freeing
+ * the parent; the sibling takes its place
+ */
+static void unlink_leaf(struct radix *t, void **parent, void **pp)
+{
+  struct radix_node *q = *parent;
+
+  *parent = q->child[q->child[0] == *pp];
+  node_free(t, q);
+}
+
+/*
+ * Removes obj, whose path is deeper than walk() goes, walking it twice
+ * instead of recording it
+ */
+static void remove_deep(struct radix *t, cache_obj_t *obj)
+{
+  void **pp = &t->root, **parent = NULL;
+  struct radix_node *q;
+
+  while (!IS_LEAF(*pp)) {
+    q = *pp;
+    pp = &q->child[direction(q, obj->key, obj->keylen)];
+  }
+  if (LEAF(*pp) != obj)
+    return;
+  for (pp = &t->root; !IS_LEAF(*pp);) {
+    parent = pp;
+    q = *pp;
+    q->objects--;
+    q->bytes -= obj->size;
+    pp = &q->child[direction(q, obj->key, obj->keylen)];
+  }
+  unlink_leaf(t, parent, pp);
+}
+
+/* radix_remove - unindex obj, if it is the object indexed under its key */
+void radix_remove(struct radix *t, cache_obj_t *obj)
+{
+  void **path[RADIX_DEPTH], **pp;
+  int depth;
+
+  if (!t->root)
+    return;
+  if (!(pp = walk(t, obj->key, obj->keylen, path, &depth))) {
+    remove_deep(t, obj);
+    return;
+  }
+  if (LEAF(*pp) != obj)
+    return;
+  if (depth == 0) {
+    t->root = NULL;
+    return;
+  }
+  count_path(path, depth - 1, -1, -(long)obj->size);
+  unlink_leaf(t, path[depth - 1], pp);
+}
+
+/* The subtree of the objects whose keys start with prefix, or NULL */
+static void *prefix_top(struct radix *t, const char *prefix)
+{
+  size_t len = strlen(prefix);
+  struct radix_node *q;
+  void *p = t->root, *top = p;
+
+  if (!p)
+    return NULL;
+  while (!IS_LEAF(p)) {
+    q = p;
+    p = q->child[direction(q, prefix, len)];
+    if (q->byte < len)
+      top = p;
+  }
+  return strncmp(LEAF(p)->key, prefix, len) == 0 ? top : NULL;
+}
+
+/* radix_usage - count the objects whose keys start with prefix */
+void radix_usage(struct radix *t, const char *prefix, long *objects,
+                 long *bytes)
+{
+  void *top = prefix_top(t, prefix);
+
+  if (!top) {
+    *objects = *bytes = 0;
+  } else if (IS_LEAF(top)) {
+    *objects = 1;
+    *bytes = LEAF(top)->size;
+  } else {
+    *objects = ((struct radix_node *)top)->objects;
+    *bytes = ((struct radix_node *)top)->bytes;
+  }
+}
+
+static int collect(void *p, cache_obj_t **objs, int n, int max)
+{
+  struct radix_node *q;
+
+  while (n < max) {
+    if (IS_LEAF(p)) {
+      objs[n++] = LEAF(p);
+      break;
+    }
+    q = p;
+    n = collect(q->child[0], objs, n, max);
+    p = q->child[1];
+  }
+  return n;
+}
+
+/*
+ * radix_collect - store up to max of the objects whose keys start with
+ *     prefix in objs, returning how many.  No references are taken.
+ */
+int radix_collect(struct radix *t, const char *prefix, cache_obj_t **objs,
+                  int max)
+{
+  void *top = prefix_top(t, prefix);
+
+  return top ? collect(top, objs, 0, max) : 0;
+}
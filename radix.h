@@ -0,0 +1,34 @@
+/*
+ * radix.h - prefix index of the cached objects' URLs
+ *
+ * A crit-bit tree (a binary radix tree with one-way branches
+ * compressed away) over the keys of the objects in the cache.  Every
+ * internal node keeps the count and bytes of the objects below it, so
+ * the objects under a URL prefix - a host, a directory - are counted
+ * and found in time proportional to the prefix, not to the cache.
+ * Each cache shard keeps one of its own objects, and calls are made
+ * with that shard locked.
+ */
+#ifndef __RADIX_H__
+#define __RADIX_H__
+
+#include "cache.h"
+
+struct radix_node;
+
+struct radix {
+  void *root;                     /* a node, or a leaf (tagged object) */
+  struct radix_node *free;        /* nodes to reuse */
+  void *(*alloc)(size_t);         /* the cache's allocator */
+  long nodes;                     /* allocated, in use or free */
+};
+
+void radix_init(struct radix *t, void *(*alloc)(size_t));
+int radix_insert(struct radix *t, cache_obj_t *obj);
+void radix_remove(struct radix *t, cache_obj_t *obj);
+void radix_usage(struct radix *t, const char *prefix, long *objects,
+                 long *bytes);
+int radix_collect(struct radix *t, const char *prefix, cache_obj_t **objs,
+                  int max);
+
+#endif /* __RADIX_H__ */
@@ -0,0 +1,204 @@
+/*
+ * reactor.c - single-threaded edge-triggered epoll engine
+ *
+ * Every client and upstream socket is O_NONBLOCK and registered once
+ * with EPOLLIN|EPOLLOUT|EPOLLET.  Any event on either side of a
+ * connection simply reruns conn_run(), which retries the pending I/O
+ * until it would block; because we always try before waiting, no edge
+ * is ever lost.  Connections finished while handling a batch of events
+ * are freed only after the batch, since a later event in the same
+ * batch may still point at them.
+ *
+ * reactor_run_sharded() runs one such reactor per CPU, each on its own
+ * SO_REUSEPORT listener and pinned to its CPU, so the kernel spreads
+ * incoming connections and the reactors share nothing.
+ */
+#define _GNU_SOURCE             /* accept4, sched_setaffinity */
+#include "conn.h"
+#include <sched.h>
+#include <sys/epoll.h>
+
+#define MAXEVENTS 256
+
+static void reactor_add(int epfd, int fd, void *ptr)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+}
+
+/* Accepts until the backlog is empty */
+static void reactor_accept(int epfd, int listenfd)
+{
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+  char hostname[MAXLINE], port[MAXLINE];
+  conn_t *c;
+  int connfd;
+
+  for (;;) {
+    clientlen = sizeof(clientaddr);
+    connfd = accept4(listenfd, (SA *)&clientaddr, &clientlen, SOCK_NONBLOCK);
+    if (connfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+      return;
+    }
+    if (config.verbose) {
+      getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port,
+                  MAXLINE, 0);
+      printf("Accepted connection from (%s, %s)\n", hostname, port);
+    }
+    c = conn_new(connfd, 1);
+    c->can_splice = 1;
+    c->can_sendfile = 1;
+    reactor_add(epfd, connfd, c);
+  }
+}
+
+/* Runs c until it blocks; returns 1 when it has finished */
+static int reactor_step(int epfd, conn_t *c)
+{
+  int had_ufd = c->ufd >= 0, had_wakefd = c->wakefd >= 0;
+  unsigned ufd_gen = c->ufd_gen;
+
+  if (conn_run(c) == CW_DONE)
+    return 1;
+  /* A new upstream socket (connect in flight) joins the epoll set, as
+   * does the eventfd of a connection waiting for another's fetch */
+  if ((!had_ufd || c->ufd_gen != ufd_gen) && c->ufd >= 0)
+    reactor_add(epfd, c->ufd, c);
+  if (!had_wakefd && c->wakefd >= 0)
+    reactor_add(epfd, c->wakefd, c);
+  return 0;
+}
+
+void reactor_run(int listenfd)
+{
+  struct epoll_event events[MAXEVENTS];
+  conn_t *c, *done;
+  int epfd, i, n;
+
+  if ((epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0)
+    unix_error("fcntl error");
+  reactor_add(epfd, listenfd, NULL);
+
+  while (1) {
+    if ((n = epoll_wait(epfd, events, MAXEVENTS, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+    done = NULL;
+    for (i = 0; i < n; i++) {
+      c = events[i].data.ptr;
+      if (c == NULL) {
+        reactor_accept(epfd, listenfd);
+        continue;
+      }
+      if (c->state == CS_DONE)
+        continue;
+      if (reactor_step(epfd, c)) {
+        c->state = CS_DONE;
+        c->next = done;
+        done = c;
+      }
+    }
+    /* Closing the sockets also drops them from the epoll set */
+    while ((c = done)) {
+      done = c->next;
+      conn_free(c);
+    }
+  }
+}
+
+/* open_listenfd() with SO_REUSEPORT, so every reactor can bind the port */
+static int open_reuseport_listenfd(char *port)
+{
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+    return -1;
+  for (p = listp; p; p = p->ai_next) {
+    if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                   sizeof(int)) == 0 &&
+        bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 &&
+        listen(listenfd, LISTENQ) == 0)
+      break;
+    close(listenfd);
+  }
+  freeaddrinfo(listp);
+  return p ? listenfd : -1;
+}
+
+struct shard {
+  int cpu;      /* CPU to pin to, -1 for none */
+  int listenfd;
+};
+
+static void *reactor_thread(void *vargp)
+{
+  struct shard *sh = vargp;
+  cpu_set_t set;
+
+  if (sh->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(sh->cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+      fprintf(stderr, "sched_setaffinity(%d): %s\n", sh->cpu, strerror(errno));
+  }
+  reactor_run(sh->listenfd);
+  return NULL;
+}
+
+/*
+ * reactor_run_sharded - run n reactors, one per SO_REUSEPORT listener.
+ *     Reactor i is pinned to the i-th CPU we are allowed to run on
+ *     (wrapping around when n exceeds the CPU count).  All listeners
+ *     are bound before any reactor starts.  Never returns.
+ */
+void reactor_run_sharded(char *port, int n)
+{
+  struct shard *shards = Calloc(n, sizeof(struct shard));
+  pthread_t *tids = Calloc(n, sizeof(pthread_t));
+  cpu_set_t allowed;
+  int i, cpu, ncpu = 0, cpus[CPU_SETSIZE];
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &allowed))
+        cpus[ncpu++] = cpu;
+  for (i = 0; i < n; i++) {
+    shards[i].cpu = ncpu ? cpus[i % ncpu] : -1;
+    if ((shards[i].listenfd = open_reuseport_listenfd(port)) < 0)
+      unix_error("open_reuseport_listenfd error");
+  }
+  for (i = 0; i < n; i++)
+    Pthread_create(&tids[i], NULL, reactor_thread, &shards[i]);
+  for (i = 0; i < n; i++)
+    Pthread_join(tids[i], NULL);
+}
+
+/* Number of CPUs this process may run on, the default reactor count */
+int reactor_default_count(void)
+{
+  cpu_set_t allowed;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return 1;
+  return CPU_COUNT(&allowed);
+}
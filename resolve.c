@@ -0,0 +1,131 @@
+/*
+ * resolve.c - upstream name resolution off the event loops
+ *
+ * Lookups wait in a FIFO for one of RESOLVE_THREADS detached threads,
+ * started on first use, that runs getaddrinfo() and writes 1 to the
+ * requester's eventfd.  A lookup is shared by the requester and the
+ * thread, and freed by whichever lets go of it last: a connection that
+ * finishes first (the client hung up) just releases it, and the thread
+ * then neither writes to the descriptor, which may have been reused,
+ * nor keeps the result.
+ */
+#include "resolve.h"
+
+#define RESOLVE_THREADS 4
+
+struct resolve {
+  char *host, *port;
+  int fd;                       /* eventfd to write when done */
+  int refs;                     /* the requester's and the thread's */
+  int done;
+  struct addrinfo *ai;          /* the result, NULL if it failed */
+  struct resolve *next;         /* in the queue */
+};
+
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static struct resolve *queue, **queue_tail = &queue;
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+static void resolve_free(struct resolve *r)
+{
+  if (r->ai)
+    freeaddrinfo(r->ai);
+  free(r->host);
+  free(r->port);
+  free(r);
+}
+
+static void *resolver(void *vargp)
+{
+  struct addrinfo hints;
+  struct resolve *r;
+  unsigned long one = 1;
+  int refs;
+
+  Pthread_detach(pthread_self());
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  for (;;) {
+    pthread_mutex_lock(&resolve_lock);
+    while (!queue)
+      pthread_cond_wait(&resolve_cond, &resolve_lock);
+    r = queue;
+    if (!(queue = r->next))
+      queue_tail = &queue;
+    pthread_mutex_unlock(&resolve_lock);
+
+    if (getaddrinfo(r->host, r->port, &hints, &r->ai) != 0)
+      r->ai = NULL;
+
+    pthread_mutex_lock(&resolve_lock);
+    r->done = 1;
+    if ((refs = --r->refs) > 0 && write(r->fd, &one, sizeof(one)) < 0)
+      ;                         /* a full counter wakes it all the same */
+    pthread_mutex_unlock(&resolve_lock);
+    if (refs == 0)
+      resolve_free(r);
+  }
+  return NULL;
+}
+
+static void resolve_init(void)
+{
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < RESOLVE_THREADS; i++)
+    Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * resolve_start - look up host and port for a stream socket in the
+ *     background, writing 1 to the eventfd fd when done
+ */
+resolve_t *resolve_start(const char *host, const char *port, int fd)
+{
+  struct resolve *r = Calloc(1, sizeof(struct resolve));
+
+  pthread_once(&resolve_once, resolve_init);
+  r->host = strdup(host);
+  r->port = strdup(port);
+  r->fd = fd;
+  r->refs = 2;
+  pthread_mutex_lock(&resolve_lock);
+  *queue_tail = r;
+  queue_tail = &r->next;
+  pthread_cond_signal(&resolve_cond);
+  pthread_mutex_unlock(&resolve_lock);
+  return r;
+}
+
+/*
+ * resolve_result - returns 0 while the lookup r is in progress, else 1
+ *     with its addresses in *ai (NULL if it failed), which the caller
+ *     then owns and frees with freeaddrinfo()
+ */
+int resolve_result(resolve_t *r, struct addrinfo **ai)
+{
+  int done;
+
+  pthread_mutex_lock(&resolve_lock);
+  if ((done = r->done)) {
+    *ai = r->ai;
+    r->ai = NULL;
+  }
+  pthread_mutex_unlock(&resolve_lock);
+  return done;
+}
+
+/* resolve_release - let go of r, done or not; its eventfd is not written */
+void resolve_release(resolve_t *r)
+{
+  int refs;
+
+  pthread_mutex_lock(&resolve_lock);
+  refs = --r->refs;
+  pthread_mutex_unlock(&resolve_lock);
+  if (refs == 0)
+    resolve_free(r);
+}
@@ -0,0 +1,20 @@
+/*
+ * resolve.h - upstream name resolution off the event loops
+ *
+ * getaddrinfo() blocks, for as long as DNS takes, so the single-threaded
+ * engines hand lookups to a few resolver threads instead.  A lookup
+ * writes to an eventfd when it is done, which the engine waits on like
+ * any other descriptor, and the connection then collects the result.
+ */
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include "csapp.h"
+
+typedef struct resolve resolve_t;
+
+resolve_t *resolve_start(const char *host, const char *port, int fd);
+int resolve_result(resolve_t *r, struct addrinfo **ai);
+void resolve_release(resolve_t *r);
+
+#endif /* __RESOLVE_H__ */
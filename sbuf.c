@@ -0,0 +1,77 @@
+/*
+ * sbuf.c - bounded FIFO of connected descriptors (CS:APP sbuf)
+ *
+ * Besides the textbook producer/consumer buffer, every insert is time
+ * stamped so the consumer side can report how long connections sat in
+ * the queue before a worker picked them up.
+ */
+#include "sbuf.h"
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(struct timeval));
+    sp->n = n;                       /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+    sp->removed = sp->wait_us = sp->max_wait_us = 0;
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+
+/* Insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    int i;
+
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    i = (++sp->rear) % (sp->n);
+    sp->buf[i] = item;                      /* Insert the item */
+    gettimeofday(&sp->stamp[i], NULL);
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+
+/* Remove and return the first item from buffer sp */
+int sbuf_remove(sbuf_t *sp)
+{
+    int i, item;
+    long waited;
+    struct timeval now;
+
+    P(&sp->items);                          /* Wait for available item */
+    P(&sp->mutex);                          /* Lock the buffer */
+    i = (++sp->front) % (sp->n);
+    item = sp->buf[i];                      /* Remove the item */
+    gettimeofday(&now, NULL);
+    waited = (now.tv_sec - sp->stamp[i].tv_sec) * 1000000L +
+             (now.tv_usec - sp->stamp[i].tv_usec);
+    sp->removed++;
+    sp->wait_us += waited;
+    if (waited > sp->max_wait_us)
+        sp->max_wait_us = waited;
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+    return item;
+}
+
+/* Snapshot the queue-wait counters and the current queue depth */
+void sbuf_stats(sbuf_t *sp, long *removed, long *wait_us, long *max_wait_us,
+                int *depth)
+{
+    P(&sp->mutex);
+    *removed = sp->removed;
+    *wait_us = sp->wait_us;
+    *max_wait_us = sp->max_wait_us;
+    *depth = sp->rear - sp->front;
+    V(&sp->mutex);
+}
@@ -0,0 +1,30 @@
+/*
+ * sbuf.h - bounded FIFO of connected descriptors (CS:APP sbuf)
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct {
+    int *buf;          /* Buffer array */
+    struct timeval *stamp; /* Time each item was inserted */
+    int n;             /* Maximum number of slots */
+    int front;         /* buf[(front+1)%n] is first item */
+    int rear;          /* buf[rear%n] is last item */
+    sem_t mutex;       /* Protects accesses to buf and the counters */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+    long removed;      /* Items taken out so far */
+    long wait_us;      /* Total time those items spent queued */
+    long max_wait_us;  /* Longest time any item spent queued */
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_stats(sbuf_t *sp, long *removed, long *wait_us, long *max_wait_us,
+                int *depth);
+
+#endif /* __SBUF_H__ */
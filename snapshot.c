@@ -0,0 +1,333 @@
+/*
+ * snapshot.c - save and reload the object cache across restarts
+ *
+ * A snapshot is one file: a header, an index with a record per object,
+ * and then (unless written without bodies) the bytes of every object
+ * in memory, gzipped bodies as they are.  Disk tier objects are recorded
+ * by slab, offset and slab generation; their bytes are already in the
+ * slab files.
+ *
+ * The header carries a magic string, a format version and checksums
+ * (cache_hash()) of itself and of the index, so a file that is
+ * truncated, corrupt or from another version is skipped whole.  Each
+ * body has its own checksum, which the cache checks on the object's
+ * first hit: loading maps the file and adopts the bodies in place, so
+ * startup reads only the index, and the bodies are paged in as they
+ * are requested.
+ *
+ * Snapshots are written to path.tmp and renamed over path, so a crash
+ * mid-write leaves the previous snapshot intact; a mapping of the old
+ * file stays valid after the rename.
+ */
+#include "snapshot.h"
+#include "cache.h"
+#include "disk.h"
+#include <stddef.h>
+
+#define SNAP_MAGIC   "PXYSNAP"
+#define SNAP_VERSION 4
+#define SNAP_BODIES  1                  /* header flag */
+
+#define SNAP_MEMORY  0                  /* record tiers */
+#define SNAP_DISK    1
+
+struct snap_hdr {
+  char magic[8];
+  unsigned version;
+  unsigned flags;
+  unsigned long nrecords;
+  unsigned long index_len;              /* bytes of records after this */
+  unsigned long index_sum;
+  unsigned long hdr_sum;                /* of the fields above */
+};
+
+/* Followed by the key and its NUL, padded to 8 bytes */
+struct snap_rec {
+  unsigned keylen;
+  unsigned tier;
+  unsigned long size;
+  unsigned long plain;                  /* size ungzipped, if gzipped */
+  unsigned long off;                    /* in this file, or in the slab */
+  unsigned long sum;                    /* of the body, or slab generation */
+  long slab;
+  long expires;
+  long stale_until;
+};
+
+#define REC_LEN(keylen) \
+  (sizeof(struct snap_rec) + (((keylen) + 1 + 7) & ~7UL))
+
+/* What snapshot_write() collects before laying the file out */
+struct snap_list {
+  cache_obj_t **objs;
+  size_t nobjs, maxobjs;
+  struct snap_disk {
+    char *key;
+    int slab;
+    unsigned long gen;
+    off_t off;
+    size_t size;
+    time_t expires;
+  } *disk;
+  size_t ndisk, maxdisk;
+};
+
+static int collect_obj(cache_obj_t *obj, void *arg)
+{
+  struct snap_list *l = arg;
+
+  if (l->nobjs == l->maxobjs) {
+    l->maxobjs = l->maxobjs ? 2 * l->maxobjs : 256;
+    l->objs = Realloc(l->objs, l->maxobjs * sizeof(cache_obj_t *));
+  }
+  l->objs[l->nobjs++] = obj;
+  return 1;
+}
+
+static void collect_disk(const char *key, int slab, unsigned long gen,
+                         off_t off, size_t size, time_t expires, void *arg)
+{
+  struct snap_list *l = arg;
+  struct snap_disk *d;
+
+  if (l->ndisk == l->maxdisk) {
+    l->maxdisk = l->maxdisk ? 2 * l->maxdisk : 256;
+    l->disk = Realloc(l->disk, l->maxdisk * sizeof(struct snap_disk));
+  }
+  d = &l->disk[l->ndisk++];
+  d->key = strdup(key);
+  d->slab = slab;
+  d->gen = gen;
+  d->off = off;
+  d->size = size;
+  d->expires = expires;
+}
+
+/* Appends a record and its key to the index at *p */
+static void put_rec(char **p, const char *key, unsigned tier, size_t size,
+                    size_t plain, unsigned long off, unsigned long sum,
+                    long slab, time_t expires, time_t stale_until)
+{
+  struct snap_rec *r = (struct snap_rec *)*p;
+  size_t len = strlen(key);
+
+  memset(r, 0, REC_LEN(len));
+  r->keylen = len;
+  r->tier = tier;
+  r->size = size;
+  r->plain = plain;
+  r->off = off;
+  r->sum = sum;
+  r->slab = slab;
+  r->expires = expires;
+  r->stale_until = stale_until;
+  memcpy(r + 1, key, len);
+  *p += REC_LEN(len);
+}
+
+/*
+ * snapshot_write - save the cache (with the bytes of objects in memory
+ *     if bodies is set) to path.  Returns 0, or -1 after reporting why.
+ */
+int snapshot_write(const char *path, int bodies)
+{
+  struct snap_list l = { 0 };
+  struct snap_hdr hdr;
+  char tmp[MAXLINE], *index, *p;
+  unsigned long off;
+  size_t i;
+  FILE *fp;
+  int rc = -1;
+
+  if (bodies)
+    cache_walk(collect_obj, &l);
+  if (disk_enabled())
+    disk_walk(collect_disk, &l);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+  hdr.version = SNAP_VERSION;
+  hdr.flags = bodies ? SNAP_BODIES : 0;
+  hdr.nrecords = l.nobjs + l.ndisk;
+  for (i = 0; i < l.nobjs; i++)
+    hdr.index_len += REC_LEN(l.objs[i]->keylen);
+  for (i = 0; i < l.ndisk; i++)
+    hdr.index_len += REC_LEN(strlen(l.disk[i].key));
+
+  /* Bodies follow the index, each at an 8-byte boundary */
+  p = index = Malloc(hdr.index_len + 1);
+  off = sizeof(hdr) + hdr.index_len;
+  for (i = 0; i < l.nobjs; i++) {
+    put_rec(&p, l.objs[i]->key, SNAP_MEMORY, l.objs[i]->size,
+            l.objs[i]->plain, off,
+            cache_hash(l.objs[i]->data, l.objs[i]->size), -1,
+            l.objs[i]->expires, l.objs[i]->stale_until);
+    off += (l.objs[i]->size + 7) & ~7UL;
+  }
+  for (i = 0; i < l.ndisk; i++)
+    put_rec(&p, l.disk[i].key, SNAP_DISK, l.disk[i].size, 0, l.disk[i].off,
+            l.disk[i].gen, l.disk[i].slab, l.disk[i].expires,
+            l.disk[i].expires);
+  hdr.index_sum = cache_hash(index, hdr.index_len);
+  hdr.hdr_sum = cache_hash((char *)&hdr, offsetof(struct snap_hdr, hdr_sum));
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(fp = fopen(tmp, "w"))) {
+    fprintf(stderr, "snapshot: %s: %s\n", tmp, strerror(errno));
+    goto out;
+  }
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(index, hdr.index_len, 1, fp);
+  for (i = 0; i < l.nobjs; i++) {
+    fwrite(l.objs[i]->data, l.objs[i]->size, 1, fp);
+    fwrite("\0\0\0\0\0\0\0", (8 - l.objs[i]->size % 8) % 8, 1, fp);
+  }
+  if (fflush(fp) != 0 || fsync(fileno(fp)) < 0 || ferror(fp)) {
+    fprintf(stderr, "snapshot: %s: %s\n", tmp, strerror(errno));
+    fclose(fp);
+    unlink(tmp);
+    goto out;
+  }
+  fclose(fp);
+  if (rename(tmp, path) < 0) {
+    fprintf(stderr, "snapshot: %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+    goto out;
+  }
+  rc = 0;
+out:
+  for (i = 0; i < l.nobjs; i++)
+    cache_release(l.objs[i]);
+  for (i = 0; i < l.ndisk; i++)
+    free(l.disk[i].key);
+  free(l.objs);
+  free(l.disk);
+  free(index);
+  return rc;
+}
+
+/* Whether the header and index of a mapped snapshot of len bytes hold up */
+static int snapshot_valid(const char *base, size_t len)
+{
+  const struct snap_hdr *hdr = (const struct snap_hdr *)base;
+
+  return len >= sizeof(*hdr) &&
+         memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) == 0 &&
+         hdr->version == SNAP_VERSION &&
+         hdr->hdr_sum == cache_hash(base, offsetof(struct snap_hdr, hdr_sum)) &&
+         hdr->index_len <= len - sizeof(*hdr) &&
+         hdr->index_sum == cache_hash(base + sizeof(*hdr), hdr->index_len);
+}
+
+/*
+ * snapshot_load - map the snapshot at path and put its objects back in
+ *     the cache and the disk tier.  Objects in memory are adopted until
+ *     the budget is full.  Returns the number of objects restored, or
+ *     -1 if there was no usable snapshot.
+ */
+int snapshot_load(const char *path)
+{
+  const struct snap_hdr *hdr;
+  const struct snap_rec *r;
+  const char *base, *p, *end, *key;
+  struct timeval start, now;
+  long inmem = 0, ondisk = 0;
+  int fd, full = 0;
+  struct stat st;
+
+  gettimeofday(&start, NULL);
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr) ||
+      (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+          MAP_FAILED) {
+    close(fd);
+    fprintf(stderr, "snapshot: %s is unreadable, starting cold\n", path);
+    return -1;
+  }
+  close(fd);
+  if (!snapshot_valid(base, st.st_size)) {
+    munmap((void *)base, st.st_size);
+    fprintf(stderr, "snapshot: %s is corrupt or from another version, "
+            "starting cold\n", path);
+    return -1;
+  }
+
+  hdr = (const struct snap_hdr *)base;
+  p = base + sizeof(*hdr);
+  end = p + hdr->index_len;
+  while (p + sizeof(*r) <= end) {
+    r = (const struct snap_rec *)p;
+    key = (const char *)(r + 1);
+    if (REC_LEN((size_t)r->keylen) > (size_t)(end - p) || key[r->keylen])
+      break;
+    p += REC_LEN(r->keylen);
+    if (r->tier == SNAP_DISK)
+      ondisk += disk_restore(key, r->slab, r->sum, r->off, r->size,
+                             r->expires);
+    else if (r->tier == SNAP_MEMORY && !full &&
+             r->size <= cache_max_object() && r->off <= (size_t)st.st_size &&
+             r->size <= (size_t)st.st_size - r->off) {
+      if (!(full = !cache_adopt(key, base + r->off, r->size, r->plain,
+                                r->sum, r->expires, r->stale_until)))
+        inmem++;
+    }
+  }
+  /* Adopted objects point into the mapping, which stays for good */
+  if (!inmem)
+    munmap((void *)base, st.st_size);
+  gettimeofday(&now, NULL);
+  fprintf(stderr, "snapshot: %ld objects in memory, %ld on disk from %s "
+          "in %.1f ms\n", inmem, ondisk, path,
+          (now.tv_sec - start.tv_sec) * 1e3 +
+          (now.tv_usec - start.tv_usec) / 1e3);
+  return inmem + ondisk;
+}
+
+static struct {
+  const char *path;
+  int bodies, interval;
+  sigset_t signals;
+} snap;
+
+/* Writes a snapshot every snap.interval s and on SIGTERM or SIGINT */
+static void *snapshot_thread(void *vargp)
+{
+  struct timespec ts = { snap.interval, 0 };
+  int sig;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    if (snap.interval > 0)
+      sig = sigtimedwait(&snap.signals, NULL, &ts);
+    else
+      sig = sigwaitinfo(&snap.signals, NULL);
+    if (sig < 0 && errno != EAGAIN)
+      continue;                         /* EINTR */
+    snapshot_write(snap.path, snap.bodies);
+    if (sig > 0) {
+      fprintf(stderr, "snapshot: saved to %s, exiting\n", snap.path);
+      exit(0);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * snapshot_start - write snapshots to path from a thread of their own.
+ *     Blocks SIGTERM and SIGINT in the caller so that only that thread
+ *     takes them; call it before creating any other thread.
+ */
+void snapshot_start(const char *path, int bodies, int interval)
+{
+  pthread_t tid;
+
+  snap.path = path;
+  snap.bodies = bodies;
+  snap.interval = interval;
+  sigemptyset(&snap.signals);
+  sigaddset(&snap.signals, SIGTERM);
+  sigaddset(&snap.signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &snap.signals, NULL);
+  Pthread_create(&tid, NULL, snapshot_thread, NULL);
+}
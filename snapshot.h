@@ -0,0 +1,11 @@
+/*
+ * snapshot.h - save and reload the object cache across restarts
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+void snapshot_start(const char *path, int bodies, int interval);
+int snapshot_write(const char *path, int bodies);
+int snapshot_load(const char *path);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,427 @@
+/*
+ * uring.c - io_uring engine for the proxy
+ *
+ * A single-threaded alternative to reactor.c that drives the same
+ * conn.c state machine through io_uring, using the raw syscalls (no
+ * liburing).  Accept, connect, recv and send are all submitted as SQEs.
+ * SQEs prepared while handling one batch of completions go to the
+ * kernel together with the wait for the next batch, so a busy proxy
+ * makes one io_uring_enter() per batch instead of one read() or write()
+ * per 8 KB chunk.
+ *
+ * Receives use a provided buffer ring (IOSQE_BUFFER_SELECT), so an idle
+ * connection waiting for data pins no buffer of its own.  The data is
+ * copied into the connection and the buffer goes straight back to the
+ * ring.
+ *
+ * There is no sendfile opcode, so disk tier hits are read into the
+ * connection with IORING_OP_READ at the slab offset and then sent.
+ *
+ * uring_run() returns -1 without touching listenfd when the kernel
+ * cannot do this (no io_uring, no buffer rings, or a missing opcode);
+ * the caller then falls back to the epoll reactor.
+ */
+#include "conn.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES  1024         /* SQ size; the CQ is twice that */
+#define URING_NBUFS    1024         /* provided buffers, a power of 2 */
+#define URING_BUFSIZE  MAXBUF
+#define URING_BGID     0
+#define URING_ACCEPTS  16           /* accepts kept in flight */
+
+/* Operation tags kept in the low bits of user_data */
+#define OP_ACCEPT   0
+#define OP_RECV     1
+#define OP_SEND     2
+#define OP_CONNECT  3
+#define OP_WAKE     4           /* read of a waiting connection's eventfd */
+#define OP_DISK     5           /* read of a disk tier hit */
+#define OP_MASK     7UL
+
+/* Engine-private state wrapped around each connection */
+struct uconn {
+  conn_t *c;
+  int fd;                      /* socket being connected */
+  unsigned long wake;          /* eventfd counter read by OP_WAKE */
+  struct msghdr msg;           /* OP_SEND of more than one piece */
+  struct iovec iov[CONN_IOV];
+};
+
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;      /* SQEs prepared, not yet published */
+  unsigned to_submit;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *br;
+  char *bufs;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Checks that every opcode the engine submits is supported */
+static int uring_probe(struct uring *u)
+{
+  static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_CONNECT,
+                             IORING_OP_RECV, IORING_OP_SEND,
+                             IORING_OP_SENDMSG, IORING_OP_READ };
+  size_t len = sizeof(struct io_uring_probe) +
+               256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = Calloc(1, len);
+  int i, ok = 1;
+
+  if (sys_io_uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    ok = 0;
+  for (i = 0; ok && i < (int)(sizeof(ops) / sizeof(ops[0])); i++)
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+      ok = 0;
+  free(probe);
+  return ok ? 0 : -1;
+}
+
+/* Registers the provided buffer ring and fills it */
+static int uring_setup_bufs(struct uring *u)
+{
+  struct io_uring_buf_reg reg;
+  size_t ringsz = URING_NBUFS * sizeof(struct io_uring_buf);
+  int i;
+
+  u->br = mmap(NULL, ringsz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED)
+    return -1;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)u->br;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = URING_BGID;
+  if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return -1;
+  u->bufs = Malloc((size_t)URING_NBUFS * URING_BUFSIZE);
+  for (i = 0; i < URING_NBUFS; i++) {
+    u->br->bufs[i].addr = (unsigned long)(u->bufs + (size_t)i * URING_BUFSIZE);
+    u->br->bufs[i].len = URING_BUFSIZE;
+    u->br->bufs[i].bid = i;
+  }
+  __atomic_store_n(&u->br->tail, URING_NBUFS, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Hands buffer bid back to the kernel */
+static void uring_recycle(struct uring *u, int bid)
+{
+  unsigned short tail = u->br->tail;
+  struct io_uring_buf *b = &u->br->bufs[tail & (URING_NBUFS - 1)];
+
+  b->addr = (unsigned long)(u->bufs + (size_t)bid * URING_BUFSIZE);
+  b->len = URING_BUFSIZE;
+  b->bid = bid;
+  __atomic_store_n(&u->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static int uring_init(struct uring *u)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+  size_t sqsz, cqsz;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+  if ((u->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || uring_probe(u) < 0)
+    goto fail;
+
+  sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cqsz > sqsz)
+    sqsz = cqsz;
+  sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            u->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  cq = sq;
+  u->sq_head = (unsigned *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->sq_entries = p.sq_entries;
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                 IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto fail;
+  u->sq_local_tail = *u->sq_tail;
+  if (uring_setup_bufs(u) < 0)
+    goto fail;
+  return 0;
+
+fail:
+  close(u->fd);
+  return -1;
+}
+
+/* Publishes prepared SQEs to the kernel-visible tail */
+static void uring_flush(struct uring *u)
+{
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+/* Returns a zeroed SQE, submitting the queue first if it is full */
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+  unsigned idx;
+  int rc;
+
+  while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+         u->sq_entries) {
+    uring_flush(u);
+    if ((rc = sys_io_uring_enter(u->fd, u->to_submit, 0, 0)) > 0)
+      u->to_submit -= rc;
+  }
+  idx = u->sq_local_tail & *u->sq_mask;
+  sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[idx] = idx;
+  u->sq_local_tail++;
+  u->to_submit++;
+  return sqe;
+}
+
+static void uring_accept(struct uring *u, int listenfd)
+{
+  struct io_uring_sqe *sqe = uring_sqe(u);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->user_data = OP_ACCEPT;
+}
+
+static void uring_free(struct uconn *uc)
+{
+  if (uc->fd >= 0)
+    close(uc->fd);
+  conn_free(uc->c);
+  free(uc);
+}
+
+/* Starts a connect to the next resolved address; returns -1 if none left */
+static int uring_connect(struct uring *u, struct uconn *uc)
+{
+  struct io_uring_sqe *sqe;
+  struct addrinfo *p;
+
+  for (p = uc->c->aip; p; p = p->ai_next)
+    if ((uc->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) >= 0)
+      break;
+  if (!p)
+    return -1;
+  uc->c->aip = p->ai_next;
+  sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = uc->fd;
+  sqe->addr = (unsigned long)p->ai_addr;
+  sqe->off = p->ai_addrlen;
+  sqe->user_data = (unsigned long)uc | OP_CONNECT;
+  return 0;
+}
+
+/* Reads the connection's eventfd, to be woken when it is written */
+static void uring_wait(struct uring *u, struct uconn *uc)
+{
+  struct io_uring_sqe *sqe = uring_sqe(u);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = uc->c->wakefd;
+  sqe->addr = (unsigned long)&uc->wake;
+  sqe->len = sizeof(uc->wake);
+  sqe->user_data = (unsigned long)uc | OP_WAKE;
+}
+
+/*
+ * uring_drive - queue the one operation the connection is waiting for,
+ *     or free it when it has finished.  A connection never has more
+ *     than one operation in flight, so nothing needs cancelling.
+ */
+static void uring_drive(struct uring *u, struct uconn *uc)
+{
+  struct io_uring_sqe *sqe;
+  conn_t *c = uc->c;
+  size_t room;
+  char *p;
+  int want = conn_want(c), rc;
+
+  switch (want) {
+  case CW_READ_CLIENT:
+  case CW_READ_UPSTREAM:
+    conn_rbuf(c, &room);
+    sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = (want == CW_READ_CLIENT) ? c->cfd : c->ufd;
+    sqe->len = room < URING_BUFSIZE ? room : URING_BUFSIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (unsigned long)uc | OP_RECV;
+    return;
+  case CW_WRITE_CLIENT:
+  case CW_WRITE_UPSTREAM:
+    sqe = uring_sqe(u);
+    sqe->fd = (want == CW_WRITE_CLIENT) ? c->cfd : c->ufd;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if ((uc->msg.msg_iovlen = conn_iov(c, uc->iov)) > 1) {
+      uc->msg.msg_iov = uc->iov;
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->addr = (unsigned long)&uc->msg;
+      sqe->len = 1;
+    } else {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->addr = (unsigned long)c->optr;
+      sqe->len = c->olen;
+    }
+    sqe->user_data = (unsigned long)uc | OP_SEND;
+    return;
+  case CW_READ_DISK:
+    p = conn_rbuf(c, &room);
+    sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = c->disk.fd;
+    sqe->addr = (unsigned long)p;
+    sqe->len = room;
+    sqe->off = c->disk.off;
+    sqe->user_data = (unsigned long)uc | OP_DISK;
+    return;
+  case CW_CONNECT:
+    /* The lookup runs in a resolver thread, as in the epoll reactor */
+    if ((rc = conn_resolve(c)) == 0) {
+      uring_wait(u, uc);
+      return;
+    }
+    if (rc < 0 || uring_connect(u, uc) < 0) {
+      conn_connect_failed(c);
+      uring_drive(u, uc);
+    }
+    return;
+  case CW_WAIT_FILL:
+    if (conn_wait(c) == 0) {
+      uring_drive(u, uc);
+      return;
+    }
+    uring_wait(u, uc);
+    return;
+  default:
+    uring_free(uc);
+  }
+}
+
+static void uring_complete(struct uring *u, int listenfd,
+                           struct io_uring_cqe *cqe)
+{
+  struct uconn *uc = (struct uconn *)(unsigned long)(cqe->user_data & ~OP_MASK);
+  int op = cqe->user_data & OP_MASK, res = cqe->res, bid;
+  size_t room;
+  char *p;
+
+  switch (op) {
+  case OP_ACCEPT:
+    uring_accept(u, listenfd);
+    if (res < 0) {
+      if (res != -EINTR && res != -ECONNABORTED)
+        fprintf(stderr, "accept error: %s\n", strerror(-res));
+      return;
+    }
+    uc = Calloc(1, sizeof(struct uconn));
+    uc->c = conn_new(res, 1);
+    uc->fd = -1;
+    break;
+  case OP_RECV:
+    if (res == -ENOBUFS)
+      break;                    /* ring ran dry; just re-arm the recv */
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (res > 0) {
+        p = conn_rbuf(uc->c, &room);
+        memcpy(p, u->bufs + (size_t)bid * URING_BUFSIZE, res);
+      }
+      uring_recycle(u, bid);
+    }
+    conn_read_done(uc->c, res < 0 ? -1 : res);
+    break;
+  case OP_SEND:
+    conn_write_done(uc->c, res < 0 ? -1 : res);
+    break;
+  case OP_DISK:
+    conn_read_done(uc->c, res < 0 ? -1 : res);
+    break;
+  case OP_CONNECT:
+    if (res < 0) {
+      close(uc->fd);
+      uc->fd = -1;
+      if (uring_connect(u, uc) == 0)
+        return;
+      conn_connect_failed(uc->c);
+    } else {
+      conn_connected(uc->c, uc->fd);
+      uc->fd = -1;
+    }
+    break;
+  case OP_WAKE:
+    break;                      /* conn_wait() or conn_resolve() checks */
+  }
+  uring_drive(u, uc);
+}
+
+/*
+ * uring_run - serve listenfd with io_uring.  Returns -1 at once if the
+ *     kernel lacks the features we need; otherwise never returns.
+ */
+int uring_run(int listenfd)
+{
+  struct uring u;
+  unsigned head, tail;
+  int i, rc;
+
+  if (uring_init(&u) < 0)
+    return -1;
+  for (i = 0; i < URING_ACCEPTS; i++)
+    uring_accept(&u, listenfd);
+  while (1) {
+    uring_flush(&u);
+    rc = sys_io_uring_enter(u.fd, u.to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (rc >= 0)
+      u.to_submit -= rc;
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      unix_error("io_uring_enter error");
+    /* EBUSY means the CQ is full: reap before submitting more */
+    head = *u.cq_head;
+    tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+      uring_complete(&u, listenfd, &u.cqes[head & *u.cq_mask]);
+    __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+  }
+}
@@ -0,0 +1,285 @@
+/*
+ * warm.c - filling the cache from a list of URLs or an access log
+ *
+ * With --warm (-w) file, the proxy fetches the URLs in file through its
+ * own listener as soon as it starts, config.warm_jobs at a time, so
+ * that a freshly deployed proxy has them cached before traffic arrives
+ * or while it does.  Going through the listener, like any client,
+ * works the same with every engine and in fork mode.
+ *
+ * The first http:// URL on each line is taken, so the file may be a
+ * plain list, a common or combined log of a proxy, or this proxy's -v
+ * output; a line whose method is not GET is skipped.  URLs are fetched
+ * most frequent first, and warming stops when the memory budget is full
+ * so that what is cached is the hottest: when there is no room left for
+ * another round of fetches as big as the biggest so far, or at the
+ * first eviction, whichever comes first.
+ * Progress goes to stderr every second.
+ */
+#include "proxy.h"
+#include "cache.h"
+
+#define WARM_TIMEOUT 30         /* seconds to wait on one response */
+#define WARM_CONNECT_TRIES 100  /* 20 ms apart, for the listener to open */
+
+struct warm_url {
+  char *url;
+  long count;                   /* lines it was on */
+  long first;                   /* the first of them */
+};
+
+static struct {
+  struct warm_url *urls;
+  long n;
+  long next;                    /* next to fetch */
+  long fetched, failed, bytes;  /* so far */
+  long biggest;                 /* response fetched */
+  long evictions;               /* the cache's when warming started */
+  int running;                  /* workers */
+  int full;                     /* the budget is full: stop */
+  struct sockaddr_in addr;      /* the listener's, on loopback */
+} warm;
+
+/* Returns the URL on line, cut out in place, or NULL if none to fetch */
+static char *line_url(char *line)
+{
+  char *u = strstr(line, "http://"), *m, *end;
+
+  if (!u)
+    return NULL;
+  /* The word before the URL is the method, if it is in capitals */
+  for (end = u; end > line && end[-1] == ' '; end--)
+    ;
+  for (m = end; m > line && isupper((unsigned char)m[-1]); m--)
+    ;
+  if (m < end && (end - m != 3 || strncmp(m, "GET", 3) != 0))
+    return NULL;
+  u[strcspn(u, " \t\r\n\"")] = '\0';
+  return u;
+}
+
+/* Most frequent first, then in the order they were first seen */
+static int url_cmp(const void *a, const void *b)
+{
+  const struct warm_url *x = a, *y = b;
+
+  if (x->count != y->count)
+    return x->count > y->count ? -1 : 1;
+  return x->first < y->first ? -1 : 1;
+}
+
+/*
+ * Reads the URLs in file into warm.urls, each once, counting how often
+ * it appears.  Returns the number of lines skipped, or -1 if file
+ * cannot be read.
+ */
+static long warm_read(const char *file)
+{
+  char line[MAXLINE], *u;
+  long *slots = NULL, nslots = 0, cap = 0, skipped = 0, lines = 0, i, s;
+  unsigned long h;
+  FILE *f;
+
+  if (!(f = fopen(file, "r")))
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    lines++;
+    if (!(u = line_url(line))) {
+      skipped++;
+      continue;
+    }
+    if (2 * (warm.n + 1) > nslots) {
+      /* Rehash into a table twice the size; slots hold index + 1 */
+      free(slots);
+      nslots = nslots ? 2 * nslots : 1024;
+      slots = Calloc(nslots, sizeof(long));
+      for (i = 0; i < warm.n; i++) {
+        h = cache_hash(warm.urls[i].url, strlen(warm.urls[i].url));
+        for (s = h & (nslots - 1); slots[s]; s = (s + 1) & (nslots - 1))
+          ;
+        slots[s] = i + 1;
+      }
+    }
+    h = cache_hash(u, strlen(u));
+    for (s = h & (nslots - 1); slots[s]; s = (s + 1) & (nslots - 1))
+      if (strcmp(warm.urls[slots[s] - 1].url, u) == 0)
+        break;
+    if (slots[s]) {
+      warm.urls[slots[s] - 1].count++;
+      continue;
+    }
+    if (warm.n == cap) {
+      cap = cap ? 2 * cap : 1024;
+      warm.urls = Realloc(warm.urls, cap * sizeof(struct warm_url));
+    }
+    warm.urls[warm.n].url = strdup(u);
+    warm.urls[warm.n].count = 1;
+    warm.urls[warm.n].first = lines;
+    slots[s] = ++warm.n;
+  }
+  fclose(f);
+  free(slots);
+  qsort(warm.urls, warm.n, sizeof(struct warm_url), url_cmp);
+  return skipped;
+}
+
+/*
+ * Fetches url through the proxy and reads the response to the end.
+ * Returns its length, or -1 if it failed or was not a 200.
+ */
+static long warm_fetch(const char *url)
+{
+  struct timeval tv = { WARM_TIMEOUT, 0 };
+  char buf[MAXBUF];
+  long total = 0;
+  int fd, tries, len, status = 0;
+  ssize_t n;
+
+  /*
+   * Not open_clientfd(): a getaddrinfo() lock held here when a fork
+   * model child is forked would stay held in the child
+   */
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  for (tries = 0; connect(fd, (SA *)&warm.addr, sizeof(warm.addr)) < 0;
+       tries++) {
+    if (errno != ECONNREFUSED || tries == WARM_CONNECT_TRIES) {
+      close(fd);
+      return -1;
+    }
+    usleep(20000);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  /* gzip, so that objects the cache keeps gzipped are sent as they are */
+  len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n"
+                 "Accept-Encoding: gzip\r\n\r\n", url);
+  if (len >= (int)sizeof(buf) || rio_writen(fd, buf, len) != len) {
+    close(fd);
+    return -1;
+  }
+  while ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+    if (total == 0) {
+      buf[n] = '\0';
+      sscanf(buf, "HTTP/%*s %d", &status);
+    }
+    total += n;
+  }
+  close(fd);
+  return n == 0 && status == 200 ? total : -1;
+}
+
+/*
+ * Whether the budget is full: the next fetches, one per worker, might
+ * not fit, or the cache has evicted something since warming started
+ */
+static int warm_budget_full(void)
+{
+  struct cache_stats cs;
+  long room;
+
+  cache_get_stats(&cs);
+  room = (long)config.cache_size - cs.bytes;
+  return cs.evictions > warm.evictions ||
+         room < config.warm_jobs * __atomic_load_n(&warm.biggest,
+                                                   __ATOMIC_RELAXED);
+}
+
+static void *warm_worker(void *vargp)
+{
+  long i, n, big;
+
+  while (!__atomic_load_n(&warm.full, __ATOMIC_RELAXED) &&
+         (i = __atomic_fetch_add(&warm.next, 1, __ATOMIC_RELAXED)) < warm.n) {
+    if ((n = warm_fetch(warm.urls[i].url)) < 0) {
+      __atomic_add_fetch(&warm.failed, 1, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(&warm.fetched, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&warm.bytes, n, __ATOMIC_RELAXED);
+      big = __atomic_load_n(&warm.biggest, __ATOMIC_RELAXED);
+      while (n > big && !__atomic_compare_exchange_n(&warm.biggest, &big, n,
+                                                     0, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED))
+        ;
+    }
+    if (warm_budget_full())
+      __atomic_store_n(&warm.full, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_sub_fetch(&warm.running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void warm_progress(void)
+{
+  struct cache_stats cs;
+
+  cache_get_stats(&cs);
+  fprintf(stderr, "warm: %ld of %ld fetched, %ld failed, %ld bytes; "
+          "cache %ld objects, %ld of %zu bytes\n",
+          __atomic_load_n(&warm.fetched, __ATOMIC_RELAXED), warm.n,
+          __atomic_load_n(&warm.failed, __ATOMIC_RELAXED),
+          __atomic_load_n(&warm.bytes, __ATOMIC_RELAXED), cs.objects,
+          cs.bytes, config.cache_size);
+}
+
+/* Reads the file, runs the workers and reports until they are done */
+static void *warm_run(void *vargp)
+{
+  struct cache_stats cs;
+  struct timeval start, end;
+  pthread_t *tids;
+  long skipped;
+  int i;
+
+  Pthread_detach(pthread_self());
+  gettimeofday(&start, NULL);
+  if ((skipped = warm_read(config.warm_file)) < 0) {
+    fprintf(stderr, "warm: cannot read %s: %s\n", config.warm_file,
+            strerror(errno));
+    return NULL;
+  }
+  fprintf(stderr, "warm: %ld URLs from %s, %ld lines skipped, %d at once\n",
+          warm.n, config.warm_file, skipped, config.warm_jobs);
+  cache_get_stats(&cs);
+  warm.evictions = cs.evictions;
+  warm.running = config.warm_jobs;
+  tids = Malloc(config.warm_jobs * sizeof(pthread_t));
+  for (i = 0; i < config.warm_jobs; i++)
+    Pthread_create(&tids[i], NULL, warm_worker, NULL);
+  while (__atomic_load_n(&warm.running, __ATOMIC_ACQUIRE) > 0) {
+    sleep(1);
+    if (__atomic_load_n(&warm.running, __ATOMIC_ACQUIRE) > 0)
+      warm_progress();
+  }
+  for (i = 0; i < config.warm_jobs; i++)
+    Pthread_join(tids[i], NULL);
+  free(tids);
+  gettimeofday(&end, NULL);
+  fprintf(stderr, "warm: %s in %.1f s\n", warm.full ?
+          "stopped, the memory budget is full" : "done",
+          (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+  warm_progress();
+  for (i = 0; i < warm.n; i++)
+    free(warm.urls[i].url);
+  free(warm.urls);
+  warm.urls = NULL;
+  return NULL;
+}
+
+/*
+ * warm_start - fetch the URLs in config.warm_file through the proxy,
+ *     listening on port, in the background
+ */
+void warm_start(char *port)
+{
+  pthread_t tid;
+
+  if (!cache_enabled()) {
+    fprintf(stderr, "warm: the cache is off, nothing to warm\n");
+    return;
+  }
+  warm.addr.sin_family = AF_INET;
+  warm.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  warm.addr.sin_port = htons(atoi(port));
+  Pthread_create(&tid, NULL, warm_run, NULL);
+}